@@ -0,0 +1,304 @@
+//
+// Per-stage benchmarks of the GS-DBSCAN pipeline on host generated clustered data
+//
+// Cases whose footprint exceeds GS_DBSCAN_BENCH_MAX_BYTES (default 8 GiB) are skipped. The torch stages run on
+// GS_DBSCAN_BENCH_DEVICE ("cpu" or "cuda", defaults to the device of the build)
+//
+
+#include "../include/pch.h"
+#include <benchmark/benchmark.h>
+#include "../include/BenchUtils.h"
+#include "../include/gsDBSCAN/projections.h"
+#include "../include/gsDBSCAN/distances.h"
+#include "../include/gsDBSCAN/clustering.h"
+
+namespace bu = benchUtils;
+namespace au = GsDBSCAN::algo_utils;
+
+static const std::vector<int64_t> N_SWEEP = {10000, 100000, 1000000, 10000000};
+static const std::vector<int64_t> d_SWEEP = {16, 128, 784};
+static const std::vector<int64_t> D_SWEEP = {256, 1024};
+static const std::vector<int64_t> k_SWEEP = {2, 5, 10};
+static const std::vector<int64_t> m_SWEEP = {20, 50, 200};
+static const std::vector<int64_t> DEGREE_SWEEP = {10, 50};
+
+static bool skipIfTooLarge(benchmark::State &state, size_t bytes) {
+    if (bytes > bu::maxBenchBytes()) {
+        state.SkipWithError("Skipped, footprint exceeds GS_DBSCAN_BENCH_MAX_BYTES");
+        return true;
+    }
+    return false;
+}
+
+static void setPointCounters(benchmark::State &state, int64_t n) {
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+static torch::Tensor clusteredDatasetTensor(int n, int d, torch::Device device) {
+    const auto &X_h = bu::clusteredDataset(n, d);
+    auto X = torch::from_blob((void *) X_h.data(), {n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+    return X.to(device);
+}
+
+/*
+ * Projections
+ */
+
+static void BM_ProjectDataset(benchmark::State &state, const std::string &distanceMetric) {
+    int n = state.range(0);
+    int d = state.range(1);
+    int D = state.range(2);
+    int fourierEmbedDim = GsDBSCAN::FOURIER_EMBED_DIM_DEFAULT;
+
+    // The embedding is blocked, so beyond X and the projections only Y, W and two tiles of it (see embedAndProject)
+    bool useEmbedding = distanceMetric != "COSINE";
+    size_t YFloats = (size_t) (useEmbedding ? 2 * fourierEmbedDim : d) * D;
+    size_t embedFloats = useEmbedding ? (size_t) fourierEmbedDim * d + 2 * GsDBSCAN::projections::EMBED_ROW_TILE *
+                                                                       GsDBSCAN::projections::EMBED_DIM_TILE : 0;
+    if (skipIfTooLarge(state, ((size_t) n * (d + D) + YFloats + embedFloats) * sizeof(float))) return;
+
+    auto device = bu::benchDevice();
+    auto X = clusteredDatasetTensor(n, d, device);
+    auto Y = GsDBSCAN::projections::getRandomVectorsMatrix(d, D, distanceMetric, fourierEmbedDim, std::nullopt,
+                                                           device);
+
+    for (auto _: state) {
+        auto projections = GsDBSCAN::projections::projectDataset(X, D, distanceMetric, fourierEmbedDim, 1, Y);
+        au::synchroniseDevice(device);
+        benchmark::DoNotOptimize(projections);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK_CAPTURE(BM_ProjectDataset, L2, std::string("L2"))
+        ->ArgNames({"n", "d", "D"})->ArgsProduct({N_SWEEP, d_SWEEP, D_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_CAPTURE(BM_ProjectDataset, COSINE, std::string("COSINE"))
+        ->ArgNames({"n", "d", "D"})->ArgsProduct({N_SWEEP, d_SWEEP, D_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_ConstructAMatrix(benchmark::State &state) {
+    int n = state.range(0);
+    int D = state.range(1);
+    int k = state.range(2);
+
+    if (skipIfTooLarge(state, (size_t) n * D * (sizeof(float) + 2 * sizeof(int64_t)))) return;
+
+    auto device = bu::benchDevice();
+    auto projections = torch::randn({n, D}, torch::TensorOptions().device(device));
+
+    for (auto _: state) {
+        auto A = GsDBSCAN::projections::constructAMatrix(projections, k);
+        au::synchroniseDevice(device);
+        benchmark::DoNotOptimize(A);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK(BM_ConstructAMatrix)
+        ->ArgNames({"n", "D", "k"})->ArgsProduct({N_SWEEP, D_SWEEP, k_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_ConstructBMatrix(benchmark::State &state) {
+    int n = state.range(0);
+    int D = state.range(1);
+    int m = state.range(2);
+
+    if (skipIfTooLarge(state, (size_t) n * D * (sizeof(float) + 2 * sizeof(int64_t)))) return;
+
+    auto device = bu::benchDevice();
+    auto projections = torch::randn({n, D}, torch::TensorOptions().device(device));
+
+    for (auto _: state) {
+        auto B = GsDBSCAN::projections::constructBMatrix(projections, m);
+        au::synchroniseDevice(device);
+        benchmark::DoNotOptimize(B);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK(BM_ConstructBMatrix)
+        ->ArgNames({"n", "D", "m"})->ArgsProduct({N_SWEEP, D_SWEEP, m_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/*
+ * Distances
+ */
+
+static void BM_FindDistancesTorch(benchmark::State &state) {
+    int n = state.range(0);
+    int d = state.range(1);
+    int k = state.range(2);
+    int m = state.range(3);
+    int D = 1024;
+
+    size_t numCandidates = (size_t) 2 * k * m;
+    if (skipIfTooLarge(state, (size_t) n * (d + numCandidates) * sizeof(float))) return;
+
+    auto device = bu::benchDevice();
+    auto X = clusteredDatasetTensor(n, d, device);
+    auto [A_h, B_h] = bu::generateABMatrices(n, D, k, m);
+    auto A = torch::from_blob(A_h.data(), {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32)).to(device);
+    auto B = torch::from_blob(B_h.data(), {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32)).to(device);
+
+    for (auto _: state) {
+        auto distances = GsDBSCAN::distances::findDistancesTorch(X, A, B, GsDBSCAN::ALPHA_DEFAULT, -1, "L2");
+        au::synchroniseDevice(device);
+        benchmark::DoNotOptimize(distances);
+    }
+
+    if (device.is_cpu()) state.SetLabel(GsDBSCAN::simd::instructionSet());
+
+    setPointCounters(state, n);
+    state.counters["candidatesPerSec"] = benchmark::Counter((double) n * numCandidates,
+                                                            benchmark::Counter::kIsIterationInvariantRate);
+}
+
+BENCHMARK(BM_FindDistancesTorch)
+        ->ArgNames({"n", "d", "k", "m"})->ArgsProduct({N_SWEEP, d_SWEEP, k_SWEEP, m_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/*
+ * Clustering arrays, eps is chosen so that ~5% of the candidates are neighbours
+ */
+
+static const float CLUSTERING_ARRAYS_EPS = 0.05;
+
+static void BM_ConstructQueryVectorDegreeArray(benchmark::State &state) {
+    int n = state.range(0);
+    int k = state.range(1);
+    int m = state.range(2);
+    int numCandidates = 2 * k * m;
+
+    if (skipIfTooLarge(state, (size_t) n * numCandidates * sizeof(float))) return;
+
+    auto distances = bu::generateDistances(n, numCandidates);
+
+    for (auto _: state) {
+        auto degArray = GsDBSCAN::clustering::constructQueryVectorDegreeArrayCpu(distances.data(), n, numCandidates,
+                                                                                 CLUSTERING_ARRAYS_EPS, "L2");
+        benchmark::DoNotOptimize(degArray);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK(BM_ConstructQueryVectorDegreeArray)
+        ->ArgNames({"n", "k", "m"})->ArgsProduct({N_SWEEP, k_SWEEP, m_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_ConstructStartIdxArray(benchmark::State &state) {
+    int n = state.range(0);
+
+    auto distances = bu::generateDistances(n, 1);
+    std::vector<int> degArray(n);
+    for (int i = 0; i < n; i++) degArray[i] = (int) (distances[i] * 100);
+
+    for (auto _: state) {
+        auto startIdxArray = GsDBSCAN::clustering::constructStartIdxArrayCpu(degArray);
+        benchmark::DoNotOptimize(startIdxArray);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK(BM_ConstructStartIdxArray)
+        ->ArgNames({"n"})->ArgsProduct({N_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_ConstructAdjacencyList(benchmark::State &state) {
+    int n = state.range(0);
+    int k = state.range(1);
+    int m = state.range(2);
+    int D = 1024;
+    int numCandidates = 2 * k * m;
+
+    if (skipIfTooLarge(state, (size_t) n * numCandidates * (sizeof(float) + sizeof(int)))) return;
+
+    auto distances = bu::generateDistances(n, numCandidates);
+    auto [A, B] = bu::generateABMatrices(n, D, k, m);
+    auto degArray = GsDBSCAN::clustering::constructQueryVectorDegreeArrayCpu(distances.data(), n, numCandidates,
+                                                                             CLUSTERING_ARRAYS_EPS, "L2");
+    auto startIdxArray = GsDBSCAN::clustering::constructStartIdxArrayCpu(degArray);
+
+    for (auto _: state) {
+        auto adjacencyList = GsDBSCAN::clustering::constructAdjacencyListCpu(distances.data(), degArray,
+                                                                             startIdxArray, A.data(), B.data(), n, k,
+                                                                             m, CLUSTERING_ARRAYS_EPS, "L2");
+        benchmark::DoNotOptimize(adjacencyList);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK(BM_ConstructAdjacencyList)
+        ->ArgNames({"n", "k", "m"})->ArgsProduct({N_SWEEP, k_SWEEP, m_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+/*
+ * Cluster formation
+ */
+
+static const int CLUSTER_FORMATION_MIN_PTS = 10;
+
+static void BM_ProcessAdjacencyList(benchmark::State &state) {
+    int n = state.range(0);
+    int maxDegree = state.range(1);
+
+    // Adjacency list, then twice that for the symmetric CSR
+    if (skipIfTooLarge(state, (size_t) n * maxDegree * 3 * sizeof(int))) return;
+
+    auto [adjacencyList, degArray, startIdxArray] = bu::generateAdjacencyList(n, maxDegree);
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, 1, 1, CLUSTER_FORMATION_MIN_PTS, 1, 1, 0.5, "L2");
+
+    for (auto _: state) {
+        auto result = GsDBSCAN::clustering::processAdjacencyListHost(adjacencyList.data(), degArray.data(),
+                                                                     startIdxArray.data(), params);
+        benchmark::DoNotOptimize(result);
+    }
+
+    setPointCounters(state, n);
+}
+
+BENCHMARK(BM_ProcessAdjacencyList)
+        ->ArgNames({"n", "maxDegree"})->ArgsProduct({N_SWEEP, DEGREE_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+static void BM_FormClusters(benchmark::State &state, bool useUnionFind) {
+    int n = state.range(0);
+    int maxDegree = state.range(1);
+
+    if (skipIfTooLarge(state, (size_t) n * maxDegree * 3 * sizeof(int))) return;
+
+    auto [adjacencyList, degArray, startIdxArray] = bu::generateAdjacencyList(n, maxDegree);
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, 1, 1, CLUSTER_FORMATION_MIN_PTS, 1, 1, 0.5, "L2");
+    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::processAdjacencyListHost(
+            adjacencyList.data(), degArray.data(), startIdxArray.data(), params);
+
+    int numClusters = 0;
+
+    for (auto _: state) {
+        auto [clusterLabels, thisNumClusters] = useUnionFind
+                ? GsDBSCAN::clustering::formClustersUnionFindCPU(neighbourhoodMatrix, corePoints, n)
+                : GsDBSCAN::clustering::formClustersCPU(neighbourhoodMatrix, corePoints, n);
+        numClusters = thisNumClusters;
+        delete[] clusterLabels;
+    }
+
+    setPointCounters(state, n);
+    state.counters["numClusters"] = numClusters;
+}
+
+BENCHMARK_CAPTURE(BM_FormClusters, BFS, false)
+        ->ArgNames({"n", "maxDegree"})->ArgsProduct({N_SWEEP, DEGREE_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_CAPTURE(BM_FormClusters, UnionFind, true)
+        ->ArgNames({"n", "maxDegree"})->ArgsProduct({N_SWEEP, DEGREE_SWEEP})
+        ->Unit(benchmark::kMillisecond)->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,167 @@
+//
+// Synthetic data and helpers for the per-stage benchmarks (bench/GsDBSCANBench.cpp)
+//
+
+#ifndef SDBSCAN_BENCHUTILS_H
+#define SDBSCAN_BENCHUTILS_H
+
+#include "pch.h"
+#include "gsDBSCAN/GsDBSCAN_Params.h"
+#include "gsDBSCAN/algo_utils.h"
+#include <random>
+#include <cstdlib>
+#include <map>
+#include <memory>
+
+namespace benchUtils {
+
+    /**
+     * Largest footprint (in bytes) of a single benchmark case, cases above this are skipped. Can be overridden with the
+     * GS_DBSCAN_BENCH_MAX_BYTES environment variable
+     */
+    inline size_t maxBenchBytes() {
+        const char *env = std::getenv("GS_DBSCAN_BENCH_MAX_BYTES");
+        return env != nullptr ? std::stoull(env) : (size_t) 8 << 30;
+    }
+
+    /**
+     * Device to run the torch stages on. Defaults to the device of the executable (see DEVICE_DEFAULT), can be
+     * overridden with the GS_DBSCAN_BENCH_DEVICE environment variable ("cpu" or "cuda")
+     */
+    inline torch::Device benchDevice() {
+        const char *env = std::getenv("GS_DBSCAN_BENCH_DEVICE");
+        std::string device = env != nullptr ? env : GsDBSCAN::DEVICE_DEFAULT;
+        return device == "cpu" ? torch::Device(torch::kCPU) : torch::Device(torch::kCUDA);
+    }
+
+    /**
+     * Generates a dataset of isotropic Gaussian blobs on the host. Rows are generated in parallel, each chunk with
+     * its own seeded generator, so the dataset only depends on the seed (not on the number of threads)
+     *
+     * @param n number of points
+     * @param d dimension of the points
+     * @param numCenters number of blobs
+     * @param spread standard deviation of each blob, the centres are uniform in [-1, 1]^d
+     * @param seed seed of the generators
+     * @return the dataset, row major with shape (n, d)
+     */
+    inline std::vector<float>
+    generateClusteredDataset(int n, int d, int numCenters = 64, float spread = 0.05, unsigned int seed = 42) {
+        std::vector<float> centers((size_t) numCenters * d);
+        std::mt19937 centerGen(seed);
+        std::uniform_real_distribution<float> uniform(-1, 1);
+        for (auto &c: centers) c = uniform(centerGen);
+
+        std::vector<float> X((size_t) n * d);
+        const int chunkSize = 4096;
+
+        #pragma omp parallel for schedule(static)
+        for (int chunk = 0; chunk < (n + chunkSize - 1) / chunkSize; chunk++) {
+            std::mt19937 gen(seed + 1 + chunk);
+            std::normal_distribution<float> normal(0, spread);
+            std::uniform_int_distribution<int> centerDist(0, numCenters - 1);
+
+            for (int i = chunk * chunkSize; i < std::min(n, (chunk + 1) * chunkSize); i++) {
+                const float *center = centers.data() + (size_t) centerDist(gen) * d;
+                float *row = X.data() + (size_t) i * d;
+                for (int j = 0; j < d; j++) {
+                    row[j] = center[j] + normal(gen);
+                }
+            }
+        }
+
+        return X;
+    }
+
+    /**
+     * Same as generateClusteredDataset, but caches the last few datasets, since the benchmarks sweep many other
+     * params over the same (n, d)
+     */
+    inline const std::vector<float> &clusteredDataset(int n, int d) {
+        static std::map<std::pair<int, int>, std::unique_ptr<std::vector<float>>> cache;
+        auto key = std::make_pair(n, d);
+        auto it = cache.find(key);
+        if (it == cache.end()) {
+            if (cache.size() >= 2) cache.clear();
+            it = cache.emplace(key, std::make_unique<std::vector<float>>(generateClusteredDataset(n, d))).first;
+        }
+        return *it->second;
+    }
+
+    /**
+     * Random A and B matrices with the right shapes and index ranges, for stages that only depend on their shape
+     */
+    inline std::tuple<std::vector<int>, std::vector<int>>
+    generateABMatrices(int n, int D, int k, int m, unsigned int seed = 42) {
+        std::vector<int> A((size_t) n * 2 * k);
+        std::vector<int> B((size_t) 2 * D * m);
+        std::mt19937 gen(seed);
+        std::uniform_int_distribution<int> projectionDist(0, 2 * D - 1);
+        std::uniform_int_distribution<int> pointDist(0, n - 1);
+        for (auto &a: A) a = projectionDist(gen);
+        for (auto &b: B) b = pointDist(gen);
+        return std::make_tuple(A, B);
+    }
+
+    /**
+     * Candidate distances, uniform in [0, 1). With eps = p roughly a fraction p of the candidates is a neighbour
+     */
+    inline std::vector<float> generateDistances(int n, int numCandidates, unsigned int seed = 42) {
+        std::vector<float> distances((size_t) n * numCandidates);
+        const int chunkSize = 4096;
+
+        #pragma omp parallel for schedule(static)
+        for (int chunk = 0; chunk < (n + chunkSize - 1) / chunkSize; chunk++) {
+            std::mt19937 gen(seed + chunk);
+            std::uniform_real_distribution<float> uniform(0, 1);
+            size_t begin = (size_t) chunk * chunkSize * numCandidates;
+            size_t end = std::min((size_t) n, (size_t) (chunk + 1) * chunkSize) * numCandidates;
+            for (size_t i = begin; i < end; i++) distances[i] = uniform(gen);
+        }
+
+        return distances;
+    }
+
+    /**
+     * Clustered adjacency list arrays (as produced by constructAdjacencyList) where each point has up to maxDegree
+     * neighbours, all within the same block of clusterSize consecutive points
+     *
+     * @return a tuple of the adjacency list, degree array and start index array
+     */
+    inline std::tuple<std::vector<int>, std::vector<int>, std::vector<int>>
+    generateAdjacencyList(int n, int maxDegree, int clusterSize = 1000, unsigned int seed = 42) {
+        std::vector<int> degArray(n);
+        const int chunkSize = 4096;
+        const int numChunks = (n + chunkSize - 1) / chunkSize;
+
+        #pragma omp parallel for schedule(static)
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            std::mt19937 gen(seed + chunk);
+            std::uniform_int_distribution<int> degreeDist(0, maxDegree);
+            for (int i = chunk * chunkSize; i < std::min(n, (chunk + 1) * chunkSize); i++) {
+                degArray[i] = degreeDist(gen);
+            }
+        }
+
+        std::vector<int> startIdxArray(n);
+        int total = GsDBSCAN::algo_utils::parallelExclusiveScan(degArray.data(), startIdxArray.data(), n);
+        std::vector<int> adjacencyList(total);
+
+        #pragma omp parallel for schedule(static)
+        for (int chunk = 0; chunk < numChunks; chunk++) {
+            std::mt19937 gen(seed + numChunks + chunk);
+            for (int i = chunk * chunkSize; i < std::min(n, (chunk + 1) * chunkSize); i++) {
+                int clusterStart = (i / clusterSize) * clusterSize;
+                int clusterEnd = std::min(n, clusterStart + clusterSize);
+                std::uniform_int_distribution<int> neighbourDist(clusterStart, clusterEnd - 1);
+                for (int j = 0; j < degArray[i]; j++) {
+                    adjacencyList[startIdxArray[i] + j] = neighbourDist(gen);
+                }
+            }
+        }
+
+        return std::make_tuple(adjacencyList, degArray, startIdxArray);
+    }
+}
+
+#endif //SDBSCAN_BENCHUTILS_H
@@ -20,6 +20,7 @@ namespace testUtils {
 
     void printDurationSinceStart(Time start, const std::string& msg = "");
 
+#ifndef GS_DBSCAN_CPU_ONLY
     template <typename T>
     inline auto createMockMnistDatasetMatX(int n = 70000, int d = 784, matx::matxMemorySpace_t space = matx::MATX_DEVICE_MEMORY) {
 
@@ -72,6 +73,7 @@ namespace testUtils {
 
         return B_i;
     }
+#endif
 
     std::vector<std::vector<float>> readCSV(const std::string &filename);
 
@@ -6,6 +6,7 @@
 #define DBSCANCEOS_GSDBSCAN_H
 
 #include <chrono>
+#include <optional>
 #include <tuple>
 
 #include "../pch.h"
@@ -13,69 +14,96 @@
 #include "distances.h"
 #include "algo_utils.h"
 #include "clustering.h"
+#include "tracing.h"
 #include "GsDBSCAN_Params.h"
 
 using json = nlohmann::json;
 
+#ifndef GS_DBSCAN_CPU_ONLY
 template<typename T>
 using thrustDVec = thrust::device_vector<T>;
+#endif
 
 namespace au = GsDBSCAN::algo_utils;
 
 namespace GsDBSCAN {
 
-    inline std::tuple<thrustDVec<int>, thrustDVec<int>, thrustDVec<int>>
-    batchCreateClusteringVecs(torch::Tensor X, torch::Tensor A, torch::Tensor B, nlohmann::ordered_json &times, GsDBSCAN_Params &params)  {
-        thrustDVec<int> adjacencyListVec(0);
-        thrustDVec<int> degVec(params.n);
-        thrustDVec<int> startIdxVec(params.n);
+#ifndef GS_DBSCAN_CPU_ONLY
+
+    /**
+     * Creates the (device) clustering arrays for the query vectors in [startIdx, endIdx)
+     *
+     * Either via a batch of the distances matrix, or fused (see clustering::createClusteringArraysFused)
+     */
+    inline std::tuple<int *, int, int *, int *>
+    createClusteringArraysForBatch(torch::Tensor &X, torch::Tensor &A, torch::Tensor &B, int startIdx, int endIdx,
+                                   int64_t &totalTimeDistances, nlohmann::ordered_json &times, GsDBSCAN_Params &params) {
+        if (params.useFusedDistances) {
+            return clustering::createClusteringArraysFused(X, A, B, params.eps, params.distanceMetric,
+                                                           params.clusterBlockSize, times, params.timeIt,
+                                                           startIdx, endIdx);
+        }
 
         auto A_matx = au::torchTensorToMatX<int>(A);
         auto B_matx = au::torchTensorToMatX<int>(B);
 
-        int currAdjacencyListSize = 0;
+        /*
+         * Get the batch distances
+         */
 
-        int totalTimeDistances = 0;
-        int totalTimeCopyMerge = 0;
+        auto distanceBatchStart = au::timeNow();
+        tracing::ScopedSpan distancesSpan("distancesBatch");
 
-        int startIdxArrayInitialValue = 0;
+        auto distancesBatch = distances::findDistancesTorch(X, A, B, params.alpha, params.distancesBatchSize, params.distanceMetric, startIdx,
+                                                            endIdx);
 
-        for (int i = 0; i < params.n; i += params.miniBatchSize) {
-            int endIdx = std::min(i + params.miniBatchSize, params.n);
+//        auto distancesBatch = distances::findDistancesTorchWithScripts(X, A, B, params.alpha, params.distancesBatchSize, params.distanceMetric, startIdx,
+//                                                    endIdx);
 
-            /*
-             * Get the batch distances
-             */
+        cudaDeviceSynchronize();
 
-            auto distanceBatchStart = au::timeNow();
+        distancesSpan.end();
+        totalTimeDistances += au::duration(distanceBatchStart, au::timeNow());
 
-            auto distancesBatch = distances::findDistancesTorch(X, A, B, params.alpha, params.distancesBatchSize, params.distanceMetric, i,
-                                                                endIdx);
+        auto distancesBatchMatx = au::torchTensorToMatX<float>(distancesBatch);
 
-//            auto distancesBatch = distances::findDistancesTorchWithScripts(X, A, B, params.alpha, params.distancesBatchSize, params.distanceMetric, i,
-//                                                        endIdx);
+        /*
+         * Get the clustering arrays
+         */
 
-            cudaDeviceSynchronize();
+        return clustering::createClusteringArrays(distancesBatchMatx, A_matx, B_matx,
+                                                  params.eps, params.clusterBlockSize, params.distanceMetric,
+                                                  times, params.timeIt, startIdx);
+    }
 
-            totalTimeDistances += au::duration(distanceBatchStart, au::timeNow());
+    inline std::tuple<thrustDVec<int>, thrustDVec<int>, thrustDVec<int>>
+    batchCreateClusteringVecs(torch::Tensor X, torch::Tensor A, torch::Tensor B, nlohmann::ordered_json &times, GsDBSCAN_Params &params)  {
+        thrustDVec<int> adjacencyListVec(0);
+        thrustDVec<int> degVec(params.n);
+        thrustDVec<int> startIdxVec(params.n);
 
-            auto thisN = distancesBatch.size(0);
+        int currAdjacencyListSize = 0;
 
-            auto distancesBatchMatx = au::torchTensorToMatX<float>(distancesBatch);
+        int64_t totalTimeDistances = 0;
+        int64_t totalTimeCopyMerge = 0;
 
-            /*
-             * Get the clustering arrays
-             */
+        int startIdxArrayInitialValue = 0;
+
+        for (int i = 0; i < params.n; i += params.miniBatchSize) {
+            int endIdx = std::min(i + params.miniBatchSize, params.n);
+
+            int thisN = endIdx - i;
+
+            tracing::ScopedSpan batchSpan("clusteringArraysBatch", {{"startIdx", i}, {"endIdx", endIdx}});
 
             auto [adjacencyListBatch_d,
                   adjacencyListBatchSize,
                   degArrayBatch_d,
                   startIdxArrayBatch_d
-              ] = clustering::createClusteringArrays(distancesBatchMatx, A_matx, B_matx,
-                                                     params.eps, params.clusterBlockSize, params.distanceMetric,
-                                                     times, params.timeIt, i);
+              ] = createClusteringArraysForBatch(X, A, B, i, endIdx, totalTimeDistances, times, params);
 
             auto copyMergeStart = au::timeNow();
+            tracing::ScopedSpan copyMergeSpan("copyMerge");
 
             /*
              * Copy Results
@@ -102,6 +130,7 @@ namespace GsDBSCAN {
             // Set the last element in degArrayBatch_d to startIdxArrayInitialValue
             startIdxArrayInitialValue = currAdjacencyListSize;
 
+            copyMergeSpan.end();
             totalTimeCopyMerge += au::duration(copyMergeStart, au::timeNow());
 
             // Free memory
@@ -123,9 +152,169 @@ namespace GsDBSCAN {
         return std::make_tuple(adjacencyListVec, degVec, startIdxVec);
     }
 
-    inline std::tuple<int *, int>
-    performClusteringBatch(torch::Tensor X, torch::Tensor A, torch::Tensor B, nlohmann::ordered_json &times, GsDBSCAN_Params &params) {
+#endif
+
+    /**
+     * The int8 copy of the dataset for the first pass of the distances matrix if params.quantisedDistances is set, see
+     * distances::findDistancesQuantisedCpu
+     */
+    inline std::optional<distances::QuantisedFilter>
+    quantiseForDistances(torch::Tensor &X, GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
+        if (!params.quantisedDistances) return std::nullopt;
+
+        if (params.verbose) std::cout << "Quantising dataset" << std::endl;
+
+        auto startQuantise = au::timeNow();
+        tracing::ScopedSpan quantiseSpan("quantise");
+
+        distances::QuantisedFilter filter{distances::quantiseDataset(X), params.eps};
+
+        quantiseSpan.end();
+
+        if (params.timeIt) times["quantise"] = au::duration(startQuantise, au::timeNow());
+
+        return filter;
+    }
+
+    /**
+     * Empty SimHash sketches of the dataset if params.sketchBits is set, packed from the projections as they are made
+     * (see distances::SimHashSketches)
+     */
+    inline std::optional<distances::SimHashSketches> createSketches(GsDBSCAN_Params &params) {
+        if (params.sketchBits == 0) return std::nullopt;
+        return distances::SimHashSketches(params.n, params.sketchBits, params.eps, params.sketchFalseNegativeRate);
+    }
+
+    /**
+     * Host equivalent of batchCreateClusteringVecs
+     */
+    inline std::tuple<std::vector<int>, std::vector<int>, std::vector<int>>
+    batchCreateClusteringVecsCpu(torch::Tensor X, torch::Tensor A, torch::Tensor B, nlohmann::ordered_json &times, GsDBSCAN_Params &params,
+                                 distances::SimHashSketches *sketches = nullptr) {
+        std::vector<int> adjacencyListVec;
+        std::vector<int> degVec(params.n);
+        std::vector<int> startIdxVec(params.n);
+
+        int64_t totalTimeDistances = 0;
+        int64_t totalTimeCopyMerge = 0;
+        distances::CandidateCounts candidateCounts;
+
+        // The fused path tests eps directly (quantised distances are rejected with it), the quantised first pass is for
+        // the distances matrix
+        std::optional<distances::QuantisedFilter> quantised;
+        if (!params.useFusedDistances) quantised = quantiseForDistances(X, params, times);
+
+        int startIdxArrayInitialValue = 0;
+
+        for (int i = 0; i < params.n; i += params.miniBatchSize) {
+            int endIdx = std::min(i + params.miniBatchSize, params.n);
+
+            tracing::ScopedSpan batchSpan("clusteringArraysBatch", {{"startIdx", i}, {"endIdx", endIdx}});
+
+            std::vector<int> adjacencyListBatch, degArrayBatch, startIdxArrayBatch;
+
+            if (params.useFusedDistances) {
+                std::tie(adjacencyListBatch, degArrayBatch, startIdxArrayBatch) = clustering::createClusteringArraysFusedCpu(
+                        X, A, B, params.eps, params.distanceMetric, times, params.timeIt, i, endIdx,
+                        params.dedupCandidates, &candidateCounts, sketches);
+            } else {
+                auto distanceBatchStart = au::timeNow();
+                tracing::ScopedSpan distancesSpan("distancesBatch");
+
+                auto distancesBatch = distances::findDistancesTorch(X, A, B, params.alpha, params.distancesBatchSize, params.distanceMetric, i,
+                                                                    endIdx, params.dedupCandidates, &candidateCounts,
+                                                                    params.bucketedDistances, quantised ? &*quantised : nullptr,
+                                                                    sketches);
+
+                distancesSpan.end();
+                totalTimeDistances += au::duration(distanceBatchStart, au::timeNow());
+
+                std::tie(adjacencyListBatch, degArrayBatch, startIdxArrayBatch) = clustering::createClusteringArraysCpu(
+                        distancesBatch, A, B, params.eps, params.distanceMetric, times, params.timeIt, i);
+            }
+
+            auto copyMergeStart = au::timeNow();
+            tracing::ScopedSpan copyMergeSpan("copyMerge");
+
+            std::copy(degArrayBatch.begin(), degArrayBatch.end(), degVec.begin() + i);
+
+            // For startIdx, need to account for the current start idx
+            std::transform(startIdxArrayBatch.begin(), startIdxArrayBatch.end(), startIdxVec.begin() + i,
+                           [startIdxArrayInitialValue](int x) { return x + startIdxArrayInitialValue; });
+
+            adjacencyListVec.insert(adjacencyListVec.end(), adjacencyListBatch.begin(), adjacencyListBatch.end());
+
+            startIdxArrayInitialValue = adjacencyListVec.size();
+
+            copyMergeSpan.end();
+            totalTimeCopyMerge += au::duration(copyMergeStart, au::timeNow());
+
+            if (params.verbose) std::cout << "Curr adjacency list size: " << adjacencyListVec.size() << std::endl;
+            if (params.verbose) std::cout << "Batch adj list size: " << adjacencyListBatch.size() << std::endl;
+        }
+
+        if (params.dedupCandidates) distances::recordCandidateCounts(times, candidateCounts);
+        if (quantised) distances::recordQuantisedCounts(times, *quantised);
+
+        if (params.timeIt) {
+            times["totalTimeDistances"] = totalTimeDistances;
+            times["totalTimeCopyMerge"] = totalTimeCopyMerge;
+        }
+        return std::make_tuple(adjacencyListVec, degVec, startIdxVec);
+    }
+
+    inline std::tuple<int *, int *, int>
+    performClusteringBatchCpu(torch::Tensor X, torch::Tensor A, torch::Tensor B, nlohmann::ordered_json &times, GsDBSCAN_Params &params,
+                              distances::SimHashSketches *sketches = nullptr) {
+
+        if (params.symmetricPairs) {
+            // The pairs are deduplicated globally, bucketed by owner, instead of over mini batches of queries
+            if (params.verbose) std::cout << "Performing clustering (symmetric pairs)" << std::endl;
+            return clustering::performClusteringPairsCpu(X, A, B, params, times, sketches);
+        }
+
+        if (params.verbose) std::cout << "Creating clustering vecs (batching, CPU)" << std::endl;
+        auto [adjacencyListVec, degVec, startIdxVec] = batchCreateClusteringVecsCpu(X, A, B, times, params, sketches);
+
+        if (params.verbose) std::cout << "Adjacency List Size: " << adjacencyListVec.size() << std::endl;
+
+        auto processAdjacencyListStart = au::timeNow();
+        tracing::ScopedSpan processAdjacencyListSpan("processAdjacencyList");
+
+        auto [neighbourhoodMatrix, corePoints] = clustering::processAdjacencyListHost(adjacencyListVec.data(),
+                                                                                      degVec.data(),
+                                                                                      startIdxVec.data(), params);
+
+        processAdjacencyListSpan.end();
+
+        if (params.timeIt)
+            times["processAdjacencyList"] = au::duration(processAdjacencyListStart, au::timeNow());
+
+        auto startFormClusters = au::timeNow();
+        tracing::ScopedSpan formClustersSpan("formClusters");
+
+        auto [clusterLabels, numClusters] = clustering::formClustersHost(neighbourhoodMatrix, corePoints, params);
+        int *typeLabels = clustering::createTypeLabelsCpu(clusterLabels, corePoints, params.n);
+
+        formClustersSpan.end();
+
+        if (params.timeIt)
+            times["formClusters"] = au::duration(startFormClusters, au::timeNow());
+
+        return std::make_tuple(clusterLabels, typeLabels, numClusters);
+    }
+
+    inline std::tuple<int *, int *, int>
+    performClusteringBatch(torch::Tensor X, torch::Tensor A, torch::Tensor B, nlohmann::ordered_json &times, GsDBSCAN_Params &params,
+                           distances::SimHashSketches *sketches = nullptr) {
+
+        if (params.isCpu()) {
+            return performClusteringBatchCpu(X, A, B, times, params, sketches);
+        }
 
+#ifdef GS_DBSCAN_CPU_ONLY
+        throw std::runtime_error("CUDA clustering is not available in a CPU-only build");
+#else
         if (params.verbose) std::cout << "Creating clustering vecs (batching)" << std::endl;
         auto [adjacencyListVec, degVec, startIdxVec] = batchCreateClusteringVecs(X, A, B, times, params);
 
@@ -140,6 +329,7 @@ namespace GsDBSCAN {
         if (params.verbose) std::cout << "Adjacency List Size: " << adjacencyListSize << std::endl;
 
         auto processAdjacencyListStart = au::timeNow();
+        tracing::ScopedSpan processAdjacencyListSpan("processAdjacencyList");
 
         if (params.verbose) std::cout << "Processing adjacency list" << std::endl;
 
@@ -149,21 +339,75 @@ namespace GsDBSCAN {
 
         if (params.verbose) std::cout << "Adjacency list processed" << std::endl;
 
+        processAdjacencyListSpan.end();
+
         if (params.timeIt)
             times["processAdjacencyList"] = au::duration(processAdjacencyListStart, au::timeNow());
 
         auto startFormClusters = au::timeNow();
+        tracing::ScopedSpan formClustersSpan("formClusters");
 
         if (params.verbose) std::cout << "Forming clusters (CPU)" << std::endl;
 
-        auto result = clustering::formClustersCPU(neighbourhoodMatrix, corePoints, params.n);
+        auto [clusterLabels, numClusters] = clustering::formClustersHost(neighbourhoodMatrix, corePoints, params);
+        int *typeLabels = clustering::createTypeLabelsCpu(clusterLabels, corePoints, params.n);
 
         if (params.verbose) std::cout << "Clusters formed" << std::endl;
 
+        formClustersSpan.end();
+
         if (params.timeIt)
             times["formClusters"] = au::duration(startFormClusters, au::timeNow());
 
-        return result;
+        return std::make_tuple(clusterLabels, typeLabels, numClusters);
+#endif
+    }
+
+    /**
+     * Orders the dimensions of the dataset by decreasing variance if params.orderDimsByVariance is set, see
+     * projections::getVarianceOrder
+     */
+    inline void orderDimensions(torch::Tensor &X, GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
+        if (!params.orderDimsByVariance) return;
+
+        if (params.verbose) std::cout << "Ordering dimensions by variance" << std::endl;
+
+        auto startOrderDims = au::timeNow();
+        tracing::ScopedSpan orderDimsSpan("orderDimensions");
+
+        X = X.index_select(1, projections::getVarianceOrder(X));
+
+        au::synchroniseDevice(X.device());
+        orderDimsSpan.end();
+
+        if (params.timeIt) times["orderDimensions"] = au::duration(startOrderDims, au::timeNow());
+    }
+
+    /**
+     * Reorders the dataset in place if params.reorder is set, see projections::getLocalityOrder. Everything after this
+     * (A, B, the adjacency list) uses the reordered ids
+     *
+     * @return the permutation, empty if the dataset wasn't reordered
+     */
+    inline std::vector<int64_t> reorderDataset(torch::Tensor &X, GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
+        if (params.reorder == "none") return {};
+
+        if (params.verbose) std::cout << "Reordering dataset (" << params.reorder << ")" << std::endl;
+
+        auto startReorder = au::timeNow();
+        tracing::ScopedSpan reorderSpan("reorder");
+
+        auto permutation = projections::getLocalityOrder(X, params.reorder);
+        auto permutation_torch = torch::from_blob(permutation.data(), {(int64_t) permutation.size()},
+                                                  torch::TensorOptions().dtype(torch::kInt64)).to(X.device());
+        X = X.index_select(0, permutation_torch);
+
+        au::synchroniseDevice(X.device());
+        reorderSpan.end();
+
+        if (params.timeIt) times["reorder"] = au::duration(startReorder, au::timeNow());
+
+        return permutation;
     }
 
     /**
@@ -174,28 +418,35 @@ namespace GsDBSCAN {
     * @param params a GsDBSCAN_Params object containing the parameters for the algorithm
     * @return a tuple containing:
     *  An integer array of size n containing the cluster labels for each point in the X dataset
-    *  An integer array of size n containing the type labels for each point in the X dataset - e.g. Noise, Core, Border // TODO decide on how this will work?
+    *  An integer array of size n containing the type labels for each point in the X dataset - 1 for Core, 0 for Border and -1 for Noise
+    *  The number of clusters found
     *  A nlohmann json object containing the timing information
     */
     template <typename XType, typename torch::Dtype TorchType>
-    inline std::tuple<int *, int, nlohmann::ordered_json>
+    inline std::tuple<int *, int *, int, nlohmann::ordered_json>
     performGsDbscan(XType *X, GsDBSCAN_Params &params) {
 
         nlohmann::ordered_json times;
 
         au::Time startOverAll = au::timeNow();
+        tracing::ScopedSpan overallSpan("performGsDbscan", {{"n", params.n}, {"d", params.d}});
 
         // Normalise and perform projections
 
         au::Time startCopyingToDevice = au::timeNow();
+        tracing::ScopedSpan copyingSpan("copyingAndConvertData");
 
         if (params.verbose) std::cout << "Preparing the X tensor" << std::endl;
 
+        auto device = params.getTorchDevice();
+
         torch::TensorOptions XOptions = torch::TensorOptions().dtype(TorchType).device(torch::kCPU);
         auto XTorchCpu = torch::from_blob(X, {params.n, params.d}, XOptions);
-        auto XTorchGPU = XTorchCpu.to(torch::kCUDA);
+        auto XTorchGPU = XTorchCpu.to(device); // A no-op if running on the CPU
 
-        cudaDeviceSynchronize();
+        au::synchroniseDevice(device);
+
+        copyingSpan.end();
 
         if (params.timeIt)
             times["copyingAndConvertData"] = au::duration(startCopyingToDevice, au::timeNow());
@@ -203,86 +454,355 @@ namespace GsDBSCAN {
         // Normalise dataset
 
         auto startNormalise = au::timeNow();
+        tracing::ScopedSpan normaliseSpan("normalise");
 
         if (params.needToNormalise) {
             if (params.verbose) std::cout << "Normalising dataset" << std::endl;
             XTorchGPU = projections::normaliseDataset(XTorchGPU, params);
         }
 
+        normaliseSpan.end();
+
         if (params.timeIt) times["normalise"] = au::duration(startNormalise, au::timeNow());
 
+        orderDimensions(XTorchGPU, params, times);
+        auto permutation = reorderDataset(XTorchGPU, params, times);
+
         int *clusterLabels = nullptr;
+        int *typeLabels = nullptr;
         int numClusters = -1;
 
+        auto sketches = createSketches(params);
+
         if (params.useBatchClustering) {
             if (params.verbose) std::cout << "Using batch clustering" << std::endl;
 
             auto startABMatrices = au::timeNow();
+            tracing::ScopedSpan ABMatricesSpan("constructABMatricesBatch");
 
-            auto [A_torch, B_torch] = projections::constructABMatricesBatch(XTorchGPU, params);
+            auto [A_torch, B_torch] = projections::constructABMatricesBatch(XTorchGPU, params,
+                                                                            sketches ? &*sketches : nullptr);
 
-            if (params.timeIt)
-                times["constructABMatrices"] = au::duration(startABMatrices, au::timeNow());
+            au::synchroniseDevice(device);
+            ABMatricesSpan.end();
 
-            cudaDeviceSynchronize();
+            if (params.timeIt) times["constructABMatrices"] = au::duration(startABMatrices, au::timeNow());
 
             // Calculate distances and cluster at the same time
 
             if (params.verbose) std::cout << "Performing clustering (batching)" << std::endl;
 
-            std::tie(clusterLabels, numClusters) = performClusteringBatch(XTorchGPU, A_torch, B_torch, times, params);
+            tracing::ScopedSpan clusteringSpan("clusteringBatch");
+
+            std::tie(clusterLabels, typeLabels, numClusters) = performClusteringBatch(XTorchGPU, A_torch, B_torch, times, params,
+                                                                                      sketches ? &*sketches : nullptr);
 
         } else {
             if (params.verbose) std::cout << "Not using batch clustering" << std::endl;
 
-            au::Time startProjections = au::timeNow();
+            torch::Tensor A_torch, B_torch;
 
-            if (params.verbose) std::cout << "Performing projections" << std::endl;
+            if (params.useBatchABMatrices) {
+                // The projections are only held a batch of rows at a time
+                auto startABMatrices = au::timeNow();
+                tracing::ScopedSpan ABMatricesSpan("constructABMatricesBatch");
 
-            auto projections_torch = projections::projectDataset(XTorchGPU, params.D, params.distanceMetric, params.fourierEmbedDim, params.sigmaEmbed);
+                std::tie(A_torch, B_torch) = projections::constructABMatricesBatch(XTorchGPU, params,
+                                                                                   sketches ? &*sketches : nullptr);
 
-            if (params.timeIt) times["projections"] = au::duration(startProjections, au::timeNow());
+                au::synchroniseDevice(device);
+                ABMatricesSpan.end();
 
-            // AB matrices
+                if (params.timeIt) times["constructABMatrices"] = au::duration(startABMatrices, au::timeNow());
+            } else {
+                au::Time startProjections = au::timeNow();
+                tracing::ScopedSpan projectionsSpan("projections");
 
-            auto startABMatrices = au::timeNow();
+                if (params.verbose) std::cout << "Performing projections" << std::endl;
 
-            if (params.verbose) std::cout << "Constructing AB matrices" << std::endl;
+                auto projections_torch = projections::projectDataset(XTorchGPU, params.D, params.distanceMetric, params.fourierEmbedDim, params.sigmaEmbed,
+                                                                     std::nullopt, params.verbose, std::nullopt, params.projectionType);
 
-            auto [A_torch, B_torch] = projections::constructABMatrices(projections_torch, params.k, params.m,
-                                                                       params.distanceMetric);
+                au::synchroniseDevice(device);
+                projectionsSpan.end();
 
-            if (params.timeIt) times["constructABMatrices"] = au::duration(startABMatrices, au::timeNow());
+                if (params.timeIt) times["projections"] = au::duration(startProjections, au::timeNow());
 
-            // Distances
+                if (sketches) {
+                    auto startSketches = au::timeNow();
+                    tracing::ScopedSpan sketchesSpan("sketches");
 
-            auto startDistances = au::timeNow();
+                    sketches->addProjections(projections_torch, 0);
 
-            if (params.verbose) std::cout << "Calculating distances" << std::endl;
+                    sketchesSpan.end();
 
-            auto distances_torch = distances::findDistancesTorch(XTorchGPU, A_torch, B_torch, params.alpha, params.distancesBatchSize, params.distanceMetric);
+                    if (params.timeIt) times["sketches"] = au::duration(startSketches, au::timeNow());
+                }
 
-            cudaDeviceSynchronize();
+                // AB matrices
+
+                auto startABMatrices = au::timeNow();
+                tracing::ScopedSpan ABMatricesSpan("constructABMatrices");
+
+                if (params.verbose) std::cout << "Constructing AB matrices" << std::endl;
+
+                std::tie(A_torch, B_torch) = projections::constructABMatrices(projections_torch, params.k, params.m,
+                                                                              params.distanceMetric);
+
+                au::synchroniseDevice(device);
+                ABMatricesSpan.end();
+
+                if (params.timeIt) times["constructABMatrices"] = au::duration(startABMatrices, au::timeNow());
+            }
 
-            if (params.timeIt) times["distances"] = au::duration(startDistances, au::timeNow());
+            if (params.symmetricPairs && params.isCpu()) {
+                // Each distinct candidate pair is evaluated once, giving the undirected edges directly
 
-            auto distances_matx = matx::make_tensor<float>(distances_torch.data_ptr<float>(), {params.n, 2*params.k*params.m}, matx::MATX_DEVICE_MEMORY);
-            auto A_t = matx::make_tensor<int>(A_torch.data_ptr<int>(), {params.n, 2*params.k}, matx::MATX_DEVICE_MEMORY);
-            auto B_t = matx::make_tensor<int>(B_torch.data_ptr<int>(), {2*params.D, params.m}, matx::MATX_DEVICE_MEMORY);
+                if (params.verbose) std::cout << "Performing clustering (symmetric pairs)" << std::endl;
 
-            if (params.verbose) std::cout << "Performing clustering" << std::endl;
+                auto startClustering = au::timeNow();
+                tracing::ScopedSpan clusteringSpan("clusteringPairs");
 
-            std::tie(clusterLabels, numClusters) = clustering::performClustering(distances_matx, A_t, B_t, params, times);
+                std::tie(clusterLabels, typeLabels, numClusters) = clustering::performClusteringPairsCpu(
+                        XTorchGPU, A_torch, B_torch, params, times, sketches ? &*sketches : nullptr);
+
+                clusteringSpan.end();
+
+                if (params.timeIt) times["clusteringOverall"] = au::duration(startClustering, au::timeNow());
+            } else if (params.useFusedDistances) {
+                // Distances are computed on the fly when creating the clustering arrays
+
+                if (params.verbose) std::cout << "Performing clustering (fused distances)" << std::endl;
+
+                auto startClustering = au::timeNow();
+                tracing::ScopedSpan clusteringSpan("clusteringFused");
+
+                if (params.isCpu()) {
+                    distances::CandidateCounts candidateCounts;
+                    auto [adjacencyList, degArray, startIdxArray] = clustering::createClusteringArraysFusedCpu(
+                            XTorchGPU, A_torch, B_torch, params.eps, params.distanceMetric, times, params.timeIt, 0, -1,
+                            params.dedupCandidates, &candidateCounts, sketches ? &*sketches : nullptr);
+                    if (params.dedupCandidates) distances::recordCandidateCounts(times, candidateCounts);
+
+                    std::tie(clusterLabels, typeLabels, numClusters) = clustering::formClustersFromArraysCpu(
+                            adjacencyList, degArray, startIdxArray, params, times);
+                } else {
+#ifndef GS_DBSCAN_CPU_ONLY
+                    auto [adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d] = clustering::createClusteringArraysFused(
+                            XTorchGPU, A_torch, B_torch, params.eps, params.distanceMetric, params.clusterBlockSize,
+                            times, params.timeIt);
+
+                    std::tie(clusterLabels, typeLabels, numClusters) = clustering::formClustersFromArrays(
+                            adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d, params, times);
+#endif
+                }
+
+                clusteringSpan.end();
+
+                if (params.timeIt) times["clusteringOverall"] = au::duration(startClustering, au::timeNow());
+            } else {
+                // Distances
+
+                auto startDistances = au::timeNow();
+                tracing::ScopedSpan distancesSpan("distances");
+
+                if (params.verbose) std::cout << "Calculating distances" << std::endl;
+
+                distances::CandidateCounts candidateCounts;
+                auto quantised = quantiseForDistances(XTorchGPU, params, times);
+                auto distances_torch = distances::findDistancesTorch(XTorchGPU, A_torch, B_torch, params.alpha, params.distancesBatchSize, params.distanceMetric,
+                                                                     0, -1, params.dedupCandidates, &candidateCounts, params.bucketedDistances,
+                                                                     quantised ? &*quantised : nullptr, sketches ? &*sketches : nullptr);
+                if (params.dedupCandidates && params.isCpu()) distances::recordCandidateCounts(times, candidateCounts);
+                if (quantised) distances::recordQuantisedCounts(times, *quantised);
+
+                au::synchroniseDevice(device);
+
+                distancesSpan.end();
+
+                if (params.timeIt) times["distances"] = au::duration(startDistances, au::timeNow());
+
+                tracing::ScopedSpan clusteringSpan("clustering");
+
+                if (params.isCpu()) {
+                    if (params.verbose) std::cout << "Performing clustering (CPU)" << std::endl;
+
+                    std::tie(clusterLabels, typeLabels, numClusters) = clustering::performClusteringCpu(distances_torch, A_torch, B_torch, params, times);
+                } else {
+#ifndef GS_DBSCAN_CPU_ONLY
+                    auto distances_matx = matx::make_tensor<float>(distances_torch.data_ptr<float>(), {params.n, 2*params.k*params.m}, matx::MATX_DEVICE_MEMORY);
+                    auto A_t = matx::make_tensor<int>(A_torch.data_ptr<int>(), {params.n, 2*params.k}, matx::MATX_DEVICE_MEMORY);
+                    auto B_t = matx::make_tensor<int>(B_torch.data_ptr<int>(), {2*params.D, params.m}, matx::MATX_DEVICE_MEMORY);
+
+                    if (params.verbose) std::cout << "Performing clustering" << std::endl;
+
+                    std::tie(clusterLabels, typeLabels, numClusters) = clustering::performClustering(distances_matx, A_t, B_t, params, times);
+#endif
+                }
+            }
+        }
+
+        if (sketches) distances::recordSketchCounts(times, *sketches);
+
+        // Back to the original order
+        if (!permutation.empty()) {
+            au::inversePermute(clusterLabels, permutation);
+            au::inversePermute(typeLabels, permutation);
         }
 
         if (params.timeIt)
             times["overall"] = au::duration(startOverAll, au::timeNow());
 
-        cudaDeviceSynchronize();
+        au::synchroniseDevice(device);
 
         if (params.verbose) std::cout << "Finished" << std::endl;
 
-        return std::tie(clusterLabels, numClusters, times);
+        return std::tie(clusterLabels, typeLabels, numClusters, times);
+    }
+
+    /**
+     * The clustering of one (eps, minPts) config of a sweep
+     */
+    struct SweepResult {
+        float eps; // As given, i.e. not adjusted for the distance metric
+        int minPts;
+        int *clusterLabels;
+        int *typeLabels;
+        int numClusters;
+        nlohmann::ordered_json times;
+    };
+
+    /**
+     * Performs the gs dbscan algorithm for each (eps, minPts) config in params.sweepConfigs
+     *
+     * The normalisation, projections, A/B matrices and candidate distances don't depend on eps or minPts, so they are
+     * computed once. Only the clustering arrays and the clusters are redone for each config
+     *
+     * @param X an array of size n * d containing the data points, see performGsDbscan
+     * @param params a GsDBSCAN_Params object containing the parameters for the algorithm, eps and minPts are ignored
+     * @return a tuple containing:
+     *  The result of each config, in the order of params.sweepConfigs
+     *  A nlohmann json object containing the timing information of the shared stages
+     */
+    template <typename XType, typename torch::Dtype TorchType>
+    inline std::tuple<std::vector<SweepResult>, nlohmann::ordered_json>
+    performGsDbscanSweep(XType *X, GsDBSCAN_Params &params) {
+
+        nlohmann::ordered_json times;
+
+        au::Time startOverAll = au::timeNow();
+        tracing::ScopedSpan overallSpan("performGsDbscanSweep", {{"n", params.n}, {"numConfigs", (int64_t) params.sweepConfigs.size()}});
+
+        auto device = params.getTorchDevice();
+
+        // Everything up to the distances is shared by all the configs
+
+        au::Time startCopyingToDevice = au::timeNow();
+
+        torch::TensorOptions XOptions = torch::TensorOptions().dtype(TorchType).device(torch::kCPU);
+        auto XTorchGPU = torch::from_blob(X, {params.n, params.d}, XOptions).to(device);
+
+        au::synchroniseDevice(device);
+
+        if (params.timeIt) times["copyingAndConvertData"] = au::duration(startCopyingToDevice, au::timeNow());
+
+        auto startNormalise = au::timeNow();
+
+        if (params.needToNormalise) {
+            XTorchGPU = projections::normaliseDataset(XTorchGPU, params);
+        }
+
+        au::synchroniseDevice(device);
+
+        if (params.timeIt) times["normalise"] = au::duration(startNormalise, au::timeNow());
+
+        orderDimensions(XTorchGPU, params, times);
+        auto permutation = reorderDataset(XTorchGPU, params, times);
+
+        au::Time startProjections = au::timeNow();
+        tracing::ScopedSpan projectionsSpan("projections");
+
+        torch::Tensor A_torch, B_torch;
+
+        if (params.useBatchABMatrices) {
+            std::tie(A_torch, B_torch) = projections::constructABMatricesBatch(XTorchGPU, params);
+        } else {
+            auto projections_torch = projections::projectDataset(XTorchGPU, params.D, params.distanceMetric,
+                                                                 params.fourierEmbedDim, params.sigmaEmbed,
+                                                                 std::nullopt, params.verbose, std::nullopt,
+                                                                 params.projectionType);
+            std::tie(A_torch, B_torch) = projections::constructABMatrices(projections_torch, params.k, params.m,
+                                                                          params.distanceMetric);
+        }
+
+        au::synchroniseDevice(device);
+        projectionsSpan.end();
+
+        if (params.timeIt) times["projectionsAndABMatrices"] = au::duration(startProjections, au::timeNow());
+
+        auto startDistances = au::timeNow();
+        tracing::ScopedSpan distancesSpan("distances");
+
+        distances::CandidateCounts candidateCounts;
+        auto distances_torch = distances::findDistancesTorch(XTorchGPU, A_torch, B_torch, params.alpha,
+                                                             params.distancesBatchSize, params.distanceMetric, 0, -1,
+                                                             params.dedupCandidates, &candidateCounts,
+                                                             params.bucketedDistances);
+        if (params.dedupCandidates && params.isCpu()) distances::recordCandidateCounts(times, candidateCounts);
+
+        au::synchroniseDevice(device);
+        distancesSpan.end();
+
+        if (params.timeIt) times["distances"] = au::duration(startDistances, au::timeNow());
+
+        // Then cluster with each config
+
+        std::vector<SweepResult> results;
+
+        for (size_t i = 0; i < params.sweepConfigs.size(); i++) {
+            auto [eps, minPts] = params.sweepConfigs[i];
+
+            tracing::ScopedSpan configSpan("sweepConfig", {{"configIdx", (int64_t) i}, {"minPts", minPts}});
+
+            if (params.verbose) std::cout << "Clustering with eps: " << eps << ", minPts: " << minPts << std::endl;
+
+            GsDBSCAN_Params configParams = params;
+            configParams.setEps(eps);
+            configParams.minPts = minPts;
+
+            SweepResult result{eps, minPts, nullptr, nullptr, -1, nlohmann::ordered_json::object()};
+
+            auto startConfig = au::timeNow();
+
+            if (params.isCpu()) {
+                std::tie(result.clusterLabels, result.typeLabels, result.numClusters) = clustering::performClusteringCpu(
+                        distances_torch, A_torch, B_torch, configParams, result.times);
+            } else {
+#ifndef GS_DBSCAN_CPU_ONLY
+                auto distances_matx = matx::make_tensor<float>(distances_torch.data_ptr<float>(), {params.n, 2*params.k*params.m}, matx::MATX_DEVICE_MEMORY);
+                auto A_t = matx::make_tensor<int>(A_torch.data_ptr<int>(), {params.n, 2*params.k}, matx::MATX_DEVICE_MEMORY);
+                auto B_t = matx::make_tensor<int>(B_torch.data_ptr<int>(), {2*params.D, params.m}, matx::MATX_DEVICE_MEMORY);
+
+                std::tie(result.clusterLabels, result.typeLabels, result.numClusters) = clustering::performClustering(
+                        distances_matx, A_t, B_t, configParams, result.times);
+#endif
+            }
+
+            au::synchroniseDevice(device);
+
+            if (!permutation.empty()) {
+                au::inversePermute(result.clusterLabels, permutation);
+                au::inversePermute(result.typeLabels, permutation);
+            }
+
+            if (params.timeIt) result.times["overall"] = au::duration(startConfig, au::timeNow());
+
+            results.push_back(result);
+        }
+
+        if (params.timeIt) times["overall"] = au::duration(startOverAll, au::timeNow());
+
+        return std::make_tuple(results, times);
     }
 
 };
@@ -6,6 +6,7 @@
 #include "../pch.h"
 #include <iostream>
 #include <sstream>
+#include <vector>
 
 #ifndef SDBSCAN_GSDBSCAN_PARAMS_H
 #define SDBSCAN_GSDBSCAN_PARAMS_H
@@ -38,6 +39,64 @@ namespace GsDBSCAN {
 
     inline std::string DATASET_DTYPE_DEFAULT = "f32";
 
+    inline std::string OUTPUT_FORMAT_DEFAULT = "json";
+
+    inline bool USE_FUSED_DISTANCES_DEFAULT = false;
+    inline bool USE_UNION_FIND_DEFAULT = false;
+
+    inline std::string TRACE_FILENAME_DEFAULT = "";
+
+    inline bool AUTO_BATCH_SIZES_DEFAULT = false;
+    inline int MEMORY_BUDGET_MB_DEFAULT = 0;
+
+    inline std::string SWEEP_DEFAULT = "";
+
+    /**
+     * Parses the (eps, minPts) pairs of a sweep, given as "eps:minPts,eps:minPts,..."
+     */
+    inline std::vector<std::pair<float, int>> parseSweepConfigs(const std::string &sweep) {
+        std::vector<std::pair<float, int>> configs;
+        std::stringstream ss(sweep);
+        std::string config;
+
+        while (std::getline(ss, config, ',')) {
+            auto sep = config.find(':');
+            if (sep == std::string::npos) {
+                throw std::runtime_error("Invalid sweep config '" + config + "'. Must be 'eps:minPts'");
+            }
+            configs.emplace_back(std::stof(config.substr(0, sep)), std::stoi(config.substr(sep + 1)));
+        }
+
+        return configs;
+    }
+
+    inline std::string PROJECTION_TYPE_DEFAULT = "gaussian";
+
+    inline bool DEDUP_CANDIDATES_DEFAULT = false;
+
+    inline bool SYMMETRIC_PAIRS_DEFAULT = false;
+
+    inline bool BUCKETED_DISTANCES_DEFAULT = false;
+
+    inline std::string REORDER_DEFAULT = "none";
+
+    inline bool ORDER_DIMS_BY_VARIANCE_DEFAULT = false;
+
+    inline bool QUANTISED_DISTANCES_DEFAULT = false;
+
+    inline int SKETCH_BITS_DEFAULT = 0;
+    inline float SKETCH_FALSE_NEGATIVE_RATE_DEFAULT = 0.001;
+
+    inline bool USE_MMAP_DEFAULT = false;
+    inline bool MMAP_POPULATE_DEFAULT = false;
+    inline bool MMAP_HUGE_PAGES_DEFAULT = false;
+
+#ifdef GS_DBSCAN_CPU_ONLY
+    inline std::string DEVICE_DEFAULT = "cpu";
+#else
+    inline std::string DEVICE_DEFAULT = "cuda";
+#endif
+
     class GsDBSCAN_Params {
     private:
 
@@ -50,6 +109,13 @@ namespace GsDBSCAN {
 
 
     public:
+        /**
+         * Sets eps, adjusting it for the distance metric like the constructor does
+         */
+        void setEps(float _eps) {
+            this->eps = adjustEps(_eps);
+        }
+
         std::string dataFilename;
         std::string outputFilename;
         int n;
@@ -78,6 +144,26 @@ namespace GsDBSCAN {
         bool useBatchABMatrices;
         bool ignoreAdjListSymmetry;
         std::string datasetDType;
+        std::string device;
+        bool useMmap;
+        bool mmapPopulate;
+        bool mmapHugePages;
+        std::string outputFormat;
+        bool useFusedDistances;
+        bool useUnionFind;
+        std::string traceFilename;
+        bool autoBatchSizes;
+        int memoryBudgetMB;
+        std::vector<std::pair<float, int>> sweepConfigs; // (eps, minPts), eps not adjusted
+        std::string projectionType;
+        bool dedupCandidates;
+        bool symmetricPairs;
+        bool bucketedDistances;
+        std::string reorder;
+        bool orderDimsByVariance;
+        bool quantisedDistances;
+        int sketchBits;
+        float sketchFalseNegativeRate;
 
 
         GsDBSCAN_Params(std::string dataFilename, std::string outputFilename, int n, int d, int D, int minPts, int k,
@@ -98,7 +184,27 @@ namespace GsDBSCAN {
                         bool useBatchABMatrices = USE_BATCH_AB_MATRICES_DEFAULT,
                         bool useBatchNorm = USE_BATCH_NORM_DEFAULT,
                         std::string datasetDType = DATASET_DTYPE_DEFAULT,
-                        bool ignoreAdjListSymmetry = IGNORE_ADJACENCY_LIST_SYMMETRY_DEFAULT
+                        bool ignoreAdjListSymmetry = IGNORE_ADJACENCY_LIST_SYMMETRY_DEFAULT,
+                        std::string device = DEVICE_DEFAULT,
+                        bool useMmap = USE_MMAP_DEFAULT,
+                        bool mmapPopulate = MMAP_POPULATE_DEFAULT,
+                        bool mmapHugePages = MMAP_HUGE_PAGES_DEFAULT,
+                        std::string outputFormat = OUTPUT_FORMAT_DEFAULT,
+                        bool useFusedDistances = USE_FUSED_DISTANCES_DEFAULT,
+                        bool useUnionFind = USE_UNION_FIND_DEFAULT,
+                        std::string traceFilename = TRACE_FILENAME_DEFAULT,
+                        bool autoBatchSizes = AUTO_BATCH_SIZES_DEFAULT,
+                        int memoryBudgetMB = MEMORY_BUDGET_MB_DEFAULT,
+                        const std::string &sweep = SWEEP_DEFAULT,
+                        const std::string &projectionType = PROJECTION_TYPE_DEFAULT,
+                        bool dedupCandidates = DEDUP_CANDIDATES_DEFAULT,
+                        bool symmetricPairs = SYMMETRIC_PAIRS_DEFAULT,
+                        bool bucketedDistances = BUCKETED_DISTANCES_DEFAULT,
+                        const std::string &reorder = REORDER_DEFAULT,
+                        bool orderDimsByVariance = ORDER_DIMS_BY_VARIANCE_DEFAULT,
+                        bool quantisedDistances = QUANTISED_DISTANCES_DEFAULT,
+                        int sketchBits = SKETCH_BITS_DEFAULT,
+                        float sketchFalseNegativeRate = SKETCH_FALSE_NEGATIVE_RATE_DEFAULT
         ) {
 
             this->dataFilename = dataFilename;
@@ -129,11 +235,181 @@ namespace GsDBSCAN {
             this->useBatchNorm = useBatchNorm;
             this->ignoreAdjListSymmetry = ignoreAdjListSymmetry;
 
-            if (datasetDType != "f16" && datasetDType != "f32") {
-                throw std::runtime_error("Invalid dataset dtype. Must be either 'f16' or 'f32'");
+            if (datasetDType != "f16" && datasetDType != "bf16" && datasetDType != "f32" && datasetDType != "u8" &&
+                datasetDType != "i8") {
+                throw std::runtime_error("Invalid dataset dtype. Must be one of 'f16', 'bf16', 'f32', 'u8' or 'i8'");
             }
 
             this->datasetDType = datasetDType;
+
+            if (is8BitDataset()) {
+                if (device != "cpu") {
+                    throw std::runtime_error("8-bit datasets are only supported on the CPU");
+                }
+                if (distanceMetric == "COSINE" && !needToNormalise) {
+                    throw std::runtime_error("8-bit datasets are normalised on the fly for COSINE, it needs --needToNormalize");
+                }
+                if (quantisedDistances) {
+                    throw std::runtime_error("8-bit datasets can't be used with quantised distances, they are already 8-bit");
+                }
+            }
+
+            if (device != "cpu" && device != "cuda") {
+                throw std::runtime_error("Invalid device. Must be either 'cpu' or 'cuda'");
+            }
+
+#ifdef GS_DBSCAN_CPU_ONLY
+            if (device == "cuda") {
+                throw std::runtime_error("This is a CPU-only build, device must be 'cpu'");
+            }
+#endif
+
+            this->device = device;
+            this->useMmap = useMmap;
+            this->mmapPopulate = mmapPopulate;
+            this->mmapHugePages = mmapHugePages;
+
+            if (outputFormat != "json" && outputFormat != "npy" && outputFormat != "bin") {
+                throw std::runtime_error("Invalid output format. Must be either 'json', 'npy' or 'bin'");
+            }
+
+            this->outputFormat = outputFormat;
+            this->useFusedDistances = useFusedDistances;
+            this->useUnionFind = useUnionFind;
+            this->traceFilename = traceFilename;
+            this->autoBatchSizes = autoBatchSizes;
+            this->memoryBudgetMB = memoryBudgetMB;
+            this->sweepConfigs = parseSweepConfigs(sweep);
+
+            if (!sweepConfigs.empty() && (useBatchClustering || useFusedDistances)) {
+                throw std::runtime_error("A sweep reuses the whole distances matrix, it can't be used with batch clustering or fused distances");
+            }
+
+            if (projectionType != "gaussian" && projectionType != "hadamard") {
+                throw std::runtime_error("Invalid projection type. Must be either 'gaussian' or 'hadamard'");
+            }
+
+            this->projectionType = projectionType;
+
+            this->dedupCandidates = dedupCandidates;
+
+            this->symmetricPairs = symmetricPairs;
+
+            if (bucketedDistances && dedupCandidates) {
+                throw std::runtime_error("Bucketed distances evaluate every candidate, they can't be used with candidate dedup");
+            }
+
+            this->bucketedDistances = bucketedDistances;
+
+            if (reorder != "none" && reorder != "projection" && reorder != "morton") {
+                throw std::runtime_error("Invalid reorder. Must be either 'none', 'projection' or 'morton'");
+            }
+
+            this->reorder = reorder;
+
+            if (device != "cpu") {
+                if (useUnionFind) {
+                    throw std::runtime_error("Union-find clustering is only implemented on the CPU");
+                }
+                if (dedupCandidates) {
+                    throw std::runtime_error("Candidate dedup is only implemented on the CPU");
+                }
+                if (bucketedDistances) {
+                    throw std::runtime_error("Bucketed distances are only implemented on the CPU");
+                }
+                if (reorder != "none") {
+                    throw std::runtime_error("Reordering the dataset is only implemented on the CPU");
+                }
+                if (symmetricPairs) {
+                    throw std::runtime_error("Symmetric pairs are only implemented on the CPU");
+                }
+                if (orderDimsByVariance) {
+                    throw std::runtime_error("Ordering the dimensions by variance is only implemented on the CPU");
+                }
+            }
+
+            if (orderDimsByVariance) {
+                // Only the bounded eps tests gain from it, and it copies the dataset
+                if (distanceMetric == "COSINE") {
+                    throw std::runtime_error("Ordering the dimensions by variance only helps the L1 and L2 metrics");
+                }
+                if (!useFusedDistances && !symmetricPairs) {
+                    throw std::runtime_error("Ordering the dimensions by variance only helps the fused distances and symmetric pairs paths");
+                }
+            }
+
+            this->orderDimsByVariance = orderDimsByVariance;
+
+            if (quantisedDistances) {
+                if (distanceMetric == "L1") {
+                    throw std::runtime_error("Quantised distances only support the L2 and COSINE metrics");
+                }
+                if (device != "cpu") {
+                    throw std::runtime_error("Quantised distances are only implemented on the CPU");
+                }
+                if (bucketedDistances) {
+                    throw std::runtime_error("Quantised distances can't be used with bucketed distances");
+                }
+                if (useFusedDistances) {
+                    throw std::runtime_error("Quantised distances are a pass over the distances matrix, they can't be used with fused distances");
+                }
+                if (!sweepConfigs.empty()) {
+                    throw std::runtime_error("A sweep needs exact distances, it can't be used with quantised distances");
+                }
+            }
+
+            this->quantisedDistances = quantisedDistances;
+
+            if (symmetricPairs) {
+                if (quantisedDistances) {
+                    throw std::runtime_error("Symmetric pairs need exact distances, they can't be used with quantised distances");
+                }
+                if (dedupCandidates || bucketedDistances) {
+                    throw std::runtime_error("Symmetric pairs already dedup the candidates, they can't be used with candidate dedup or bucketed distances");
+                }
+                if (useFusedDistances) {
+                    throw std::runtime_error("Symmetric pairs evaluate the pairs instead of the candidates of each query, they can't be used with fused distances");
+                }
+                if (!sweepConfigs.empty()) {
+                    throw std::runtime_error("A sweep reuses the whole distances matrix, it can't be used with symmetric pairs");
+                }
+            }
+
+            if (sketchBits != 0) {
+                if (sketchBits < 0 || sketchBits % 64 != 0 || sketchBits > D) {
+                    throw std::runtime_error("Invalid sketch bits. Must be a multiple of 64, at most D");
+                }
+                if (distanceMetric != "COSINE") {
+                    throw std::runtime_error("Sketches only support the COSINE metric");
+                }
+                if (device != "cpu") {
+                    throw std::runtime_error("Sketches are only implemented on the CPU");
+                }
+                if (bucketedDistances || quantisedDistances) {
+                    throw std::runtime_error("Sketches can't be used with bucketed or quantised distances");
+                }
+                if (!sweepConfigs.empty()) {
+                    throw std::runtime_error("A sweep needs every distance, it can't be used with sketches");
+                }
+                if (sketchFalseNegativeRate <= 0 || sketchFalseNegativeRate >= 1) {
+                    throw std::runtime_error("Invalid sketch false negative rate. Must be in (0, 1)");
+                }
+            }
+
+            this->sketchBits = sketchBits;
+            this->sketchFalseNegativeRate = sketchFalseNegativeRate;
+        }
+
+        inline bool is8BitDataset() const {
+            return datasetDType == "u8" || datasetDType == "i8";
+        }
+
+        inline bool isCpu() const {
+            return this->device == "cpu";
+        }
+
+        inline torch::Device getTorchDevice() const {
+            return isCpu() ? torch::Device(torch::kCPU) : torch::Device(torch::kCUDA);
         }
 
         inline std::string toString() const {
@@ -169,6 +445,28 @@ namespace GsDBSCAN {
             oss << "Use batch normalisation: " << (useBatchNorm ? "true" : "false") << "\n";
             oss << "Ignore Adjacency List Symmetry: " << (ignoreAdjListSymmetry ? "true" : "false") << "\n";
             oss << "Dataset DType: " << datasetDType << "\n";
+            oss << "Device: " << device << "\n";
+            oss << "Use mmap: " << (useMmap ? "true" : "false") << "\n";
+            oss << "mmap Populate: " << (mmapPopulate ? "true" : "false") << "\n";
+            oss << "mmap Huge Pages: " << (mmapHugePages ? "true" : "false") << "\n";
+            oss << "Output Format: " << outputFormat << "\n";
+            oss << "Use Fused Distances: " << (useFusedDistances ? "true" : "false") << "\n";
+            oss << "Use Union Find: " << (useUnionFind ? "true" : "false") << "\n";
+            oss << "Trace Filename: " << (traceFilename.empty() ? "none" : traceFilename) << "\n";
+            oss << "Auto Batch Sizes: " << (autoBatchSizes ? "true" : "false") << "\n";
+            oss << "Memory Budget (MB): " << (memoryBudgetMB > 0 ? std::to_string(memoryBudgetMB) : "detect") << "\n";
+            oss << "Sweep Configs (eps:minPts): ";
+            for (const auto &[sweepEps, sweepMinPts]: sweepConfigs) oss << sweepEps << ":" << sweepMinPts << " ";
+            oss << "\n";
+            oss << "Projection Type: " << projectionType << "\n";
+            oss << "Dedup Candidates: " << (dedupCandidates ? "true" : "false") << "\n";
+            oss << "Symmetric Pairs: " << (symmetricPairs ? "true" : "false") << "\n";
+            oss << "Bucketed Distances: " << (bucketedDistances ? "true" : "false") << "\n";
+            oss << "Reorder: " << reorder << "\n";
+            oss << "Order Dims By Variance: " << (orderDimsByVariance ? "true" : "false") << "\n";
+            oss << "Quantised Distances: " << (quantisedDistances ? "true" : "false") << "\n";
+            oss << "Sketch Bits: " << sketchBits << "\n";
+            oss << "Sketch False Negative Rate: " << sketchFalseNegativeRate << "\n";
 
             return oss.str();
         }
@@ -231,7 +529,7 @@ namespace GsDBSCAN {
                 .default_value(A_BATCH_SIZE_DEFAULT);
 
         parser.add_argument("--BBatchSize", "-bbs")
-                .help("What batch size to use when creating the B matrix")
+                .help("Unused, B is now built in the same pass as A (see --ABatchSize)")
                 .scan<'i', int>()
                 .default_value(B_BATCH_SIZE_DEFAULT);
 
@@ -266,7 +564,7 @@ namespace GsDBSCAN {
                 .implicit_value(true);
 
         parser.add_argument("--useBatchABMatrices", "-ubd")
-                .help("Whether to use the batch creation of the AB matrices (unimplemented)")
+                .help("Whether to build the A/B matrices in batches of --ABatchSize rows, instead of projecting the whole dataset at once. Always on with --useBatchClustering")
                 .default_value(false)
                 .implicit_value(true);
 
@@ -281,9 +579,106 @@ namespace GsDBSCAN {
                 .implicit_value(true);
 
         parser.add_argument("--datasetDType", "-ddt")
-                .help("What dtype the dataset is in. Options: 'f16' or 'f32'")
+                .help("What dtype the dataset is in. Options: 'f16', 'bf16', 'f32', 'u8' or 'i8'. 8-bit datasets are widened on the fly (CPU only)")
                 .default_value(DATASET_DTYPE_DEFAULT);
 
+        parser.add_argument("--device", "-dev")
+                .help("What device to run the algorithm on. Options: 'cuda' or 'cpu'")
+                .default_value(DEVICE_DEFAULT);
+
+        parser.add_argument("--useMmap", "-mmap")
+                .help("Whether to memory map the dataset file instead of reading it into memory")
+                .default_value(USE_MMAP_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--mmapPopulate", "-mmp")
+                .help("Whether to pre-fault the whole memory mapped dataset (MAP_POPULATE)")
+                .default_value(MMAP_POPULATE_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--mmapHugePages", "-mmh")
+                .help("Whether to advise the kernel to back the memory mapped dataset with huge pages")
+                .default_value(MMAP_HUGE_PAGES_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--outputFormat", "-of")
+                .help("How to write the labels. Options: 'json' (labels inside the output file), 'npy' or 'bin' (raw int32). "
+                      "For 'npy' and 'bin' the cluster and type labels are written next to a small JSON output file")
+                .default_value(OUTPUT_FORMAT_DEFAULT);
+
+        parser.add_argument("--useFusedDistances", "-ufd")
+                .help("Whether to compute the candidate distances and eps test on the fly while creating the adjacency list, "
+                      "instead of materialising the distances matrix")
+                .default_value(USE_FUSED_DISTANCES_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--useUnionFind", "-uuf")
+                .help("Whether to form the clusters on the CPU with a parallel union find, instead of a serial BFS")
+                .default_value(USE_UNION_FIND_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--traceFilename", "-tf")
+                .help("If given, writes a Chrome trace (JSON, open in Perfetto) of the stages and batches to this file")
+                .default_value(TRACE_FILENAME_DEFAULT);
+
+        parser.add_argument("--autoBatchSizes", "-auto")
+                .help("Whether to pick all the batch sizes from the memory budget, overriding the given ones")
+                .default_value(AUTO_BATCH_SIZES_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--memoryBudgetMB", "-mem")
+                .help("Memory budget in MB for --autoBatchSizes. 0 detects it (free device memory, or available host memory within the cgroup limit)")
+                .default_value(MEMORY_BUDGET_MB_DEFAULT)
+                .scan<'i', int>();
+
+        parser.add_argument("--sweep")
+                .help("(eps, minPts) pairs to cluster with, as 'eps:minPts,eps:minPts,...'. The projections and distances "
+                      "are computed once and every config is written to the output file")
+                .default_value(SWEEP_DEFAULT);
+
+        parser.add_argument("--projectionType", "-pt")
+                .help("Random projections to use, 'gaussian' (a dense Gaussian matrix) or 'hadamard' (randomised Hadamard transforms, O(D log D) per point and no stored matrix)")
+                .default_value(PROJECTION_TYPE_DEFAULT);
+
+        parser.add_argument("--dedupCandidates", "-dc")
+                .help("Evaluate each distinct candidate of a query once on the CPU, and count the duplicates")
+                .default_value(DEDUP_CANDIDATES_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--symmetricPairs", "-sp")
+                .help("Evaluate each candidate pair (i, j) once on the CPU, as an undirected edge list, instead of the candidates of each query")
+                .default_value(SYMMETRIC_PAIRS_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--bucketedDistances", "-bd")
+                .help("Compute the distances on the CPU per B row, each row's m candidates are gathered once and tested against all the queries referencing it")
+                .default_value(BUCKETED_DISTANCES_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--reorder", "-ro")
+                .help("Reorder the dataset so likely candidates are close in memory, 'none', 'projection' (by a random projection) or 'morton' (by a Z order curve over a few random projections). Labels are in the original order")
+                .default_value(REORDER_DEFAULT);
+
+        parser.add_argument("--orderDimsByVariance", "-odv")
+                .help("Order the dimensions by decreasing variance, so the bounded L1/L2 eps tests of the CPU fused and pair paths exit earlier")
+                .default_value(ORDER_DIMS_BY_VARIANCE_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--quantisedDistances", "-qd")
+                .help("Filter the candidates of the distances matrix with an int8 copy of the dataset first, only those near eps are computed in full precision (CPU, L2 and COSINE only)")
+                .default_value(QUANTISED_DISTANCES_DEFAULT)
+                .implicit_value(true);
+
+        parser.add_argument("--sketchBits", "-skb")
+                .help("Bits of the SimHash sketches that reject COSINE candidates before their distances (CPU, 0 to disable, a multiple of 64 up to D)")
+                .default_value(SKETCH_BITS_DEFAULT)
+                .scan<'i', int>();
+
+        parser.add_argument("--sketchFalseNegativeRate", "-skf")
+                .help("Largest chance of a sketch rejecting a candidate within eps")
+                .default_value(SKETCH_FALSE_NEGATIVE_RATE_DEFAULT)
+                .scan<'f', float>();
+
         return parser;
     }
 
@@ -327,7 +722,27 @@ namespace GsDBSCAN {
                     parser.get<bool>("--useBatchABMatrices"),
                     parser.get<bool>("--useBatchNorm"),
                     parser.get<std::string>("--datasetDType"),
-                    parser.get<bool>("--ignoreAdjListSymmetry")
+                    parser.get<bool>("--ignoreAdjListSymmetry"),
+                    parser.get<std::string>("--device"),
+                    parser.get<bool>("--useMmap"),
+                    parser.get<bool>("--mmapPopulate"),
+                    parser.get<bool>("--mmapHugePages"),
+                    parser.get<std::string>("--outputFormat"),
+                    parser.get<bool>("--useFusedDistances"),
+                    parser.get<bool>("--useUnionFind"),
+                    parser.get<std::string>("--traceFilename"),
+                    parser.get<bool>("--autoBatchSizes"),
+                    parser.get<int>("--memoryBudgetMB"),
+                    parser.get<std::string>("--sweep"),
+                    parser.get<std::string>("--projectionType"),
+                    parser.get<bool>("--dedupCandidates"),
+                    parser.get<bool>("--symmetricPairs"),
+                    parser.get<bool>("--bucketedDistances"),
+                    parser.get<std::string>("--reorder"),
+                    parser.get<bool>("--orderDimsByVariance"),
+                    parser.get<bool>("--quantisedDistances"),
+                    parser.get<int>("--sketchBits"),
+                    parser.get<float>("--sketchFalseNegativeRate")
             );
         } catch (const std::bad_cast &e) {
             std::cerr << "Error: Invalid type in argument conversion. " << e.what() << std::endl;
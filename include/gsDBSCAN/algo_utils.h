@@ -13,6 +13,13 @@
  * This file contains util functions that don't belong in a single file
  */
 
+// Lets small helpers (e.g. distance functions) be shared between kernels and host code
+#ifdef __CUDACC__
+#define GS_HOST_DEVICE __host__ __device__
+#else
+#define GS_HOST_DEVICE
+#endif
+
 
 namespace GsDBSCAN::algo_utils {
 
@@ -24,14 +31,135 @@ namespace GsDBSCAN::algo_utils {
         return std::chrono::high_resolution_clock::now();
     }
 
-    inline int duration(Time start, Time stop) {
+    // 64 bit, microseconds overflow an int after ~35 minutes
+    inline int64_t duration(Time start, Time stop) {
         return std::chrono::duration_cast<std::chrono::microseconds>(stop - start).count();
     }
 
-    inline int durationSinceStart(Time start) {
+    inline int64_t durationSinceStart(Time start) {
         return duration(start, timeNow());
     }
 
+    /**
+     * Exclusive prefix sum on the host using OpenMP. Each thread scans its own chunk after the chunk totals are summed
+     *
+     * @param in input array
+     * @param out output array, can be the same as in
+     * @param n length of the arrays
+     * @param initialValue value the scan starts from
+     * @return the total, i.e. initialValue plus the sum of in
+     */
+    template<typename InType, typename OutType>
+    inline OutType parallelExclusiveScan(const InType *in, OutType *out, size_t n, OutType initialValue = 0) {
+        int maxThreads = omp_get_max_threads();
+        std::vector<OutType> chunkOffsets(maxThreads + 1, 0);
+        OutType total = initialValue;
+
+        #pragma omp parallel
+        {
+            int threadIdx = omp_get_thread_num();
+            int numThreads = omp_get_num_threads();
+
+            size_t chunkSize = (n + numThreads - 1) / numThreads;
+            size_t chunkStart = std::min(threadIdx * chunkSize, n);
+            size_t chunkEnd = std::min(chunkStart + chunkSize, n);
+
+            OutType chunkSum = 0;
+            for (size_t i = chunkStart; i < chunkEnd; i++) {
+                chunkSum += in[i];
+            }
+            chunkOffsets[threadIdx + 1] = chunkSum;
+
+            #pragma omp barrier
+            #pragma omp single
+            {
+                chunkOffsets[0] = initialValue;
+                for (int t = 1; t <= numThreads; t++) {
+                    chunkOffsets[t] += chunkOffsets[t - 1];
+                }
+                total = chunkOffsets[numThreads];
+            }
+
+            OutType running = chunkOffsets[threadIdx];
+            for (size_t i = chunkStart; i < chunkEnd; i++) {
+                OutType value = in[i];
+                out[i] = running;
+                running += value;
+            }
+        }
+
+        return total;
+    }
+
+    /**
+     * Sorts 64 bit keys on the host using OpenMP, an LSD radix sort over 8 bit digits. Each pass counts the digits of
+     * each thread's chunk, then scatters the chunks in order, so the passes are stable
+     *
+     * @param keys keys to sort, in place
+     * @param numBits number of low bits the keys use, only these are sorted on
+     */
+    inline void parallelRadixSort(std::vector<uint64_t> &keys, int numBits = 64) {
+        constexpr int DIGIT_BITS = 8;
+        constexpr int RADIX = 1 << DIGIT_BITS;
+
+        size_t n = keys.size();
+        std::vector<uint64_t> buffer(n);
+        int maxThreads = omp_get_max_threads();
+        std::vector<size_t> digitOffsets((size_t) maxThreads * RADIX);
+
+        for (int shift = 0; shift < numBits; shift += DIGIT_BITS) {
+            #pragma omp parallel
+            {
+                int threadIdx = omp_get_thread_num();
+                int numThreads = omp_get_num_threads();
+
+                size_t chunkSize = (n + numThreads - 1) / numThreads;
+                size_t chunkStart = std::min(threadIdx * chunkSize, n);
+                size_t chunkEnd = std::min(chunkStart + chunkSize, n);
+
+                size_t *threadOffsets = digitOffsets.data() + (size_t) threadIdx * RADIX;
+                std::fill(threadOffsets, threadOffsets + RADIX, 0);
+
+                for (size_t i = chunkStart; i < chunkEnd; i++) {
+                    threadOffsets[(keys[i] >> shift) & (RADIX - 1)]++;
+                }
+
+                #pragma omp barrier
+                #pragma omp single
+                {
+                    // Digit major, then thread, so the chunks keep their order within each digit
+                    size_t offset = 0;
+                    for (int digit = 0; digit < RADIX; digit++) {
+                        for (int t = 0; t < numThreads; t++) {
+                            size_t count = digitOffsets[(size_t) t * RADIX + digit];
+                            digitOffsets[(size_t) t * RADIX + digit] = offset;
+                            offset += count;
+                        }
+                    }
+                }
+
+                for (size_t i = chunkStart; i < chunkEnd; i++) {
+                    buffer[threadOffsets[(keys[i] >> shift) & (RADIX - 1)]++] = keys[i];
+                }
+            }
+
+            keys.swap(buffer);
+        }
+    }
+
+    /**
+     * Undoes a permutation of an array in place, i.e. values[permutation[i]] becomes the old values[i]
+     */
+    template<typename T>
+    inline void inversePermute(T *values, const std::vector<int64_t> &permutation) {
+        std::vector<T> permuted(values, values + permutation.size());
+
+        #pragma omp parallel for
+        for (size_t i = 0; i < permutation.size(); i++) {
+            values[permutation[i]] = permuted[i];
+        }
+    }
+
     inline void printStackTrace() {
         void *array[10];
         size_t size;
@@ -45,6 +173,19 @@ namespace GsDBSCAN::algo_utils {
         free(symbols);
     }
 
+    /**
+     * Waits for any outstanding work on the given device to finish. A no-op for the CPU
+     *
+     * @param device the device the algorithm is running on
+     */
+    inline void synchroniseDevice(const torch::Device &device) {
+#ifndef GS_DBSCAN_CPU_ONLY
+        if (device.is_cuda()) cudaDeviceSynchronize();
+#endif
+    }
+
+#ifndef GS_DBSCAN_CPU_ONLY
+
     inline void throwCudaError(const std::string &msg, cudaError_t err) {
         std::cout << "An error occurred" << std::endl;
         printStackTrace();
@@ -238,6 +379,8 @@ namespace GsDBSCAN::algo_utils {
         return matx::make_tensor<T>(tensor.data_ptr<T>(), {rows, cols},
                                     matx::MATX_DEVICE_MEMORY);
     }
+
+#endif
 }
 
 
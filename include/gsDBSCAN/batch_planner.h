@@ -0,0 +1,277 @@
+//
+// Picks the batch sizes of every stage from a memory budget
+//
+
+#ifndef SDBSCAN_BATCH_PLANNER_H
+#define SDBSCAN_BATCH_PLANNER_H
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <unistd.h>
+#include "../pch.h"
+#include "GsDBSCAN_Params.h"
+#include "projections.h"
+
+namespace GsDBSCAN::batch_planner {
+
+    // Only plan with part of the budget, leaves room for the allocator, Torch's caching and what isn't modelled
+    inline constexpr float BUDGET_FRACTION = 0.8;
+
+    // Bytes per selected index (int64 indices, then converted to int32)
+    inline constexpr size_t SELECTED_INDEX_BYTES = 12;
+
+    /**
+     * A value read from a cgroup file, or 0 if the file doesn't exist or has no limit ("max")
+     */
+    inline size_t readCgroupValue(const std::string &filename) {
+        std::ifstream file(filename);
+        std::string value;
+        if (!(file >> value) || value == "max") return 0;
+        try {
+            return std::stoull(value);
+        } catch (const std::exception &) {
+            return 0;
+        }
+    }
+
+    /**
+     * Detects the memory available to this process on the host, i.e. MemAvailable (or the free pages from sysconf if
+     * it can't be read), capped by the remaining cgroup (v2, then v1) limit
+     *
+     * @param source set to where the budget came from
+     */
+    inline size_t detectHostMemoryBudget(std::string &source) {
+        size_t budget = 0;
+        source = "sysconf";
+
+        std::ifstream meminfo("/proc/meminfo");
+        std::string key;
+        size_t valueKB;
+        std::string unit;
+        while (meminfo >> key >> valueKB >> unit) {
+            if (key == "MemAvailable:") {
+                budget = valueKB * 1024;
+                source = "meminfo";
+                break;
+            }
+        }
+
+        if (budget == 0) {
+            budget = (size_t) sysconf(_SC_AVPHYS_PAGES) * (size_t) sysconf(_SC_PAGE_SIZE);
+        }
+
+        size_t limit = readCgroupValue("/sys/fs/cgroup/memory.max");
+        size_t usage = readCgroupValue("/sys/fs/cgroup/memory.current");
+        if (limit == 0) {
+            limit = readCgroupValue("/sys/fs/cgroup/memory/memory.limit_in_bytes");
+            usage = readCgroupValue("/sys/fs/cgroup/memory/memory.usage_in_bytes");
+        }
+
+        // cgroup v1 reports 'no limit' as a huge number
+        if (limit > 0 && limit > usage && limit - usage < budget) {
+            budget = limit - usage;
+            source = "cgroup";
+        }
+
+        return budget;
+    }
+
+    /**
+     * Detects the memory budget of the device the pipeline runs on
+     */
+    inline size_t detectMemoryBudget(const GsDBSCAN_Params &params, std::string &source) {
+#ifndef GS_DBSCAN_CPU_ONLY
+        if (!params.isCpu()) {
+            size_t freeBytes, totalBytes;
+            if (cudaMemGetInfo(&freeBytes, &totalBytes) == cudaSuccess) {
+                source = "cudaMemGetInfo";
+                return freeBytes;
+            }
+        }
+#endif
+        return detectHostMemoryBudget(source);
+    }
+
+    /**
+     * Largest batch (of rows, or columns) that fits, then balanced so the batches are of (nearly) equal size and only
+     * the final remainder batch is smaller
+     *
+     * @param bytes bytes available for the batch
+     * @param bytesPerItem bytes needed per row (or column) of the batch
+     * @param numItems total number of rows (or columns)
+     * @return the batch size, in [1, numItems]
+     */
+    inline int fitBatchSize(double bytes, double bytesPerItem, int numItems) {
+        long long batchSize = bytes > 0 ? (long long) (bytes / bytesPerItem) : 1;
+        batchSize = std::clamp(batchSize, 1LL, (long long) numItems);
+
+        long long numBatches = (numItems + batchSize - 1) / batchSize;
+        return (int) ((numItems + numBatches - 1) / numBatches);
+    }
+
+    inline nlohmann::ordered_json stagePlan(int batchSize, int numItems, double fixedBytes, double bytesPerItem) {
+        return {
+                {"batchSize", batchSize},
+                {"numBatches", (numItems + batchSize - 1) / batchSize},
+                {"peakBytes", (size_t) (fixedBytes + bytesPerItem * batchSize)}
+        };
+    }
+
+    /**
+     * Models the peak footprint of each stage from n, d, D, k, m and the dataset dtype, and picks the batch sizes that
+     * fit in the budget. Larger batches are always preferred, as they are faster
+     *
+     * The model counts the dataset, the A and B matrices, and per batch the Torch temporaries of the projections (the
+     * Fourier embedding for L1/L2), the A/B selections and the gathered candidate vectors of the distances (on GPU). The
+     * adjacency list is counted at its worst case (all candidates are neighbours) for the mini batches
+     *
+     * @param params the params, the batch sizes are not read
+     * @param budgetBytes memory budget, 0 to detect it
+     * @return the plan, as JSON, with the batch sizes under "<stage>.batchSize"
+     */
+    inline nlohmann::ordered_json planBatchSizes(const GsDBSCAN_Params &params, size_t budgetBytes = 0) {
+        nlohmann::ordered_json plan;
+        nlohmann::ordered_json warnings = nlohmann::ordered_json::array();
+
+        std::string budgetSource = "flag";
+        if (budgetBytes == 0) budgetBytes = detectMemoryBudget(params, budgetSource);
+
+        const double n = params.n;
+        const double d = params.d;
+        const double D = params.D;
+        const double k = params.k;
+        const double m = params.m;
+        const double numCandidates = 2 * k * m;
+        const double F = params.fourierEmbedDim;
+        const double s = params.datasetDType == "f32" ? 4 : (params.is8BitDataset() ? 1 : 2);
+        // 16-bit CPU and 8-bit datasets are projected in float, a widened tile of rows at a time (see
+        // projections::projectDataset)
+        const double ps = params.isCpu() || params.is8BitDataset() ? 4 : s;
+        const double widenTileBytes = ps != s ? projections::EMBED_ROW_TILE * d * ps : 0;
+        const bool useEmbedding = params.distanceMetric != "COSINE";
+
+        // Resident for the whole run: X (and its normalised copy, 8-bit datasets are normalised on the fly), A, B, the
+        // labels, the quantised copy of X and the sketches if any
+        bool isNormalisedCopy = params.needToNormalise && !params.useBatchNorm && !params.is8BitDataset();
+        double datasetBytes = n * d * s * (isNormalisedCopy ? 2 : 1);
+        double ABBytes = n * 2 * k * 4 + 2 * D * m * 4;
+        double labelsBytes = n * 2 * 4;
+        double quantisedBytes = params.quantisedDistances ? n * (d + 3 * 4) : 0;
+        double sketchBytes = n * params.sketchBits / 8.0;
+        double residentBytes = datasetBytes + ABBytes + labelsBytes + quantisedBytes + sketchBytes;
+
+        double usableBytes = (double) budgetBytes * BUDGET_FRACTION;
+        double availableBytes = usableBytes - residentBytes;
+
+        plan["budgetBytes"] = budgetBytes;
+        plan["budgetSource"] = budgetSource;
+        plan["usableBytes"] = (size_t) usableBytes;
+        plan["residentBytes"] = (size_t) residentBytes;
+
+        if (availableBytes <= 0) {
+            throw std::runtime_error("Memory budget of " + std::to_string(budgetBytes) +
+                                     " bytes is too small, the dataset and A/B matrices alone need " +
+                                     std::to_string((size_t) residentBytes) + " bytes");
+        }
+
+        // Normalisation, a slice and its norms per row
+        double normBytesPerRow = 2 * d * s;
+        int normBatchSize = fitBatchSize(availableBytes, normBytesPerRow, params.n);
+        plan["normalise"] = stagePlan(normBatchSize, params.n, 0, normBytesPerRow);
+
+        // Projections, Y, W and the embedding tiles are shared, then per row the projections, their transposed copy and
+        // the A selection. B is built in the same pass, from up to 2m candidates per side of each column
+        double YBytes = (useEmbedding ? 2 * F : d) * D * ps;
+        double hadamardBytesPerRow = 0;
+        if (params.projectionType == "hadamard") {
+            // Y is only the signs, but each transform pass holds a few copies of the padded blocks of a row
+            int P = projections::nextPowerOfTwo(useEmbedding ? 2 * params.fourierEmbedDim : params.d);
+            double numBlocks = (params.D + P - 1) / P;
+            YBytes = 0;
+            hadamardBytesPerRow = 3 * numBlocks * P * ps;
+        }
+        double WBytes = useEmbedding ? F * d * ps : 0;
+        double BCandidatesBytes = 2 * D * 2 * m * 8;
+        // The embedding is blocked, two tiles of it at a time whatever the batch size
+        double embedTileBytes = useEmbedding ? 2.0 * projections::EMBED_ROW_TILE * projections::EMBED_DIM_TILE * ps : 0;
+        double projectionBytesPerRow = 2 * D * ps + hadamardBytesPerRow + 2 * k * SELECTED_INDEX_BYTES;
+
+        double ABFixedBytes = YBytes + WBytes + embedTileBytes + widenTileBytes + BCandidatesBytes;
+        int ABatchSize = fitBatchSize(availableBytes - ABFixedBytes, projectionBytesPerRow, params.n);
+        plan["ABatch"] = stagePlan(ABatchSize, params.n, ABFixedBytes, projectionBytesPerRow);
+
+        if (availableBytes < ABFixedBytes + projectionBytesPerRow) {
+            warnings.push_back("The A/B matrix batches do not fit, even with a batch size of 1");
+        }
+
+        double unbatchedProjectionBytes = YBytes + WBytes + embedTileBytes + widenTileBytes + n * projectionBytesPerRow;
+        // A/B are built in batches (of the planned ABatch size) with either flag, see performGsDbscan
+        bool isABatched = params.useBatchClustering || params.useBatchABMatrices;
+        if (!isABatched && unbatchedProjectionBytes > availableBytes) {
+            warnings.push_back("The projections need ~" + std::to_string((size_t) unbatchedProjectionBytes) +
+                               " bytes without batching, use --useBatchABMatrices or --useBatchClustering");
+        }
+
+        // Distances, per row the gathered candidates, their difference to the query (or product) and the result. The
+        // host engine reads the candidates in place, so there are no such temporaries (and no distance batches) on CPU
+        double distanceBytesPerRow = params.isCpu() ? 0 : 2 * numCandidates * d * s + numCandidates * (4 + 8);
+        // Mini batches hold the distances of the batch and (at worst) as many neighbours, plus the degree/start arrays
+        double miniBatchBytesPerRow = (params.useFusedDistances ? 1 : 2) * numCandidates * 4 + 2 * 4;
+
+        int miniBatchSize, distancesBatchSize;
+
+        if (params.useBatchClustering) {
+            if (params.useFusedDistances || params.isCpu()) {
+                miniBatchSize = fitBatchSize(availableBytes, miniBatchBytesPerRow, params.n);
+                distancesBatchSize = miniBatchSize;
+            } else {
+                // Split the budget between the mini batch arrays and the distance temporaries inside each mini batch
+                miniBatchSize = fitBatchSize(availableBytes / 2, miniBatchBytesPerRow, params.n);
+                distancesBatchSize = fitBatchSize(availableBytes / 2, distanceBytesPerRow, miniBatchSize);
+            }
+        } else {
+            // The whole distances matrix is resident
+            miniBatchSize = params.n;
+            double distancesMatrixBytes = params.useFusedDistances ? 0 : n * numCandidates * 4;
+            distancesBatchSize = params.isCpu() ? params.n
+                                                : fitBatchSize(availableBytes - distancesMatrixBytes, distanceBytesPerRow,
+                                                               params.n);
+
+            if (!params.symmetricPairs && distancesMatrixBytes + distanceBytesPerRow > availableBytes) {
+                warnings.push_back("The distances matrix needs ~" + std::to_string((size_t) distancesMatrixBytes) +
+                                   " bytes, use --useBatchClustering or --useFusedDistances");
+            }
+        }
+
+        if (params.symmetricPairs) {
+            // Symmetric pairs aren't batched, every key is resident with its owner offsets and cursors, and (at worst)
+            // as many edges (see clustering::performClusteringPairsCpu)
+            double pairsBytes = n * (2 * numCandidates * 8 + 2 * 8);
+            plan["candidatePairs"] = {{"peakBytes", (size_t) pairsBytes}};
+
+            if (pairsBytes > availableBytes) {
+                warnings.push_back("The candidate pairs need ~" + std::to_string((size_t) pairsBytes) +
+                                   " bytes, they aren't batched, drop --symmetricPairs");
+            }
+        }
+
+        plan["miniBatch"] = stagePlan(miniBatchSize, params.n, 0, miniBatchBytesPerRow);
+        plan["distancesBatch"] = stagePlan(distancesBatchSize, miniBatchSize, 0, distanceBytesPerRow);
+        plan["warnings"] = warnings;
+
+        return plan;
+    }
+
+    /**
+     * Sets the batch sizes of the params from a plan (see planBatchSizes)
+     */
+    inline void applyBatchPlan(GsDBSCAN_Params &params, const nlohmann::ordered_json &plan) {
+        params.normBatchSize = plan["normalise"]["batchSize"];
+        params.ABatchSize = plan["ABatch"]["batchSize"];
+        params.miniBatchSize = plan["miniBatch"]["batchSize"];
+        params.distancesBatchSize = plan["distancesBatch"]["batchSize"];
+    }
+}
+
+#endif //SDBSCAN_BATCH_PLANNER_H
@@ -8,9 +8,13 @@
 #include <unordered_set>
 #include <vector>
 #include <tuple>
+#include <numeric>
+#include <atomic>
+#include <limits>
+#include <optional>
 #include <unordered_set>
+#ifndef GS_DBSCAN_CPU_ONLY
 #include "cuda_runtime.h"
-#include "algo_utils.h"
 #include <thrust/device_vector.h>
 #include <thrust/device_ptr.h>
 #include <thrust/reduce.h>
@@ -19,15 +23,19 @@
 #include <thrust/scan.h>
 #include <cub/cub.cuh>
 #include <cuda/std/atomic>
+#endif
 #include "algo_utils.h"
+#include "distances.h"
+#include "tracing.h"
 #include "GsDBSCAN_Params.h"
 #include "../pch.h"
-#include <mutex>
 
 namespace au = GsDBSCAN::algo_utils;
 
 namespace GsDBSCAN::clustering {
 
+#ifndef GS_DBSCAN_CPU_ONLY
+
     /**
      * Calculates the degree of the query vectors as per the G-DBSCAN algorithm.
      *
@@ -87,6 +95,7 @@ namespace GsDBSCAN::clustering {
     /**
      * Kernel for constructing part of the cluster graph adjacency list for a particular vector
      *
+     * @tparam Metric the distance metric, the eps test is inlined for it (see distances::distanceWithinEps)
      * @param distances matrix containing the distances between each query vector and it's candidate vectors
      * @param adjacencyList
      * @param startIdxArray vector containing the degree of each query vector (how many candidate vectors are within eps distance of it)
@@ -95,13 +104,12 @@ namespace GsDBSCAN::clustering {
      * @param n number of query vectors in the dataset
      * @param eps epsilon DBSCAN density param
      */
+    template<DistanceMetric Metric>
     __global__ void
-    inline
     constructAdjacencyListForQueryVector(const float *distances, int *adjacencyList, const int *startIdxArray,
                                          const int *A, const int *B, const float eps,
                                          const int n,
-                                         const int k, const int m, bool(*pointInCluster)(const float, const float),
-                                         int AStartIdx) {
+                                         const int k, const int m, int AStartIdx) {
         // We assume one thread per query vector
 
         // TODO Make sure that the startIdx thing works
@@ -117,7 +125,7 @@ namespace GsDBSCAN::clustering {
 
         for (int j = 0; j < distances_rows; j++) {
 
-            if (pointInCluster(distances[idx * distances_rows + j], eps)) {
+            if (distances::distanceWithinEps<Metric>(distances[idx * distances_rows + j], eps)) {
                 ACol = j / m;
                 BCol = j % m;
                 BRow = A[(AStartIdx + idx) * 2 * k + ACol];
@@ -129,48 +137,6 @@ namespace GsDBSCAN::clustering {
         }
     }
 
-    inline __device__ bool pointInClusterL1L2(const float distance, const float eps) {
-        return distance < eps;
-    }
-
-    inline __global__ void setPointInClusterL1L2(bool(**pointInCluster)(const float, const float)) {
-        *pointInCluster = pointInClusterL1L2;
-    }
-
-
-    inline __device__ bool pointInClusterCosine(const float distance, const float eps) {
-        return distance > eps;
-    }
-
-
-    inline __global__ void setPointInClusterCosine(bool(**pointInCluster)(const float, const float)) {
-        *pointInCluster = pointInClusterCosine;
-    }
-
-    inline auto getPointInCluster_h(const std::string &distanceMetric) {
-        /*
-         * Basically the problem is that I can't reference a device function from the host,
-         *
-         * SO I need to do a slight of hand to get around this.
-         *
-         * I don't fully understand it, but I used the below link:
-         *
-         * https://stackoverflow.com/questions/26738079/cuda-kernel-with-function-pointer-and-variadic-templates
-         */
-        unsigned long long *pointInCluster_d, *pointInCluster_h;
-        cudaMalloc(&pointInCluster_d, sizeof(unsigned long long));
-
-        if (distanceMetric == "L1" || distanceMetric == "L2") {
-            setPointInClusterL1L2<<<1, 1>>>((bool (**)(const float, const float)) pointInCluster_d);
-        } else if (distanceMetric == "COSINE") {
-            setPointInClusterCosine<<<1, 1>>>((bool (**)(const float, const float)) pointInCluster_d);
-        }
-
-        cudaMemcpy(&pointInCluster_h, pointInCluster_d, sizeof(unsigned long long), cudaMemcpyDeviceToHost);
-
-        return (bool (*)(const float, const float)) pointInCluster_h;
-    }
-
     inline std::tuple<int *, int>
     constructAdjacencyList(const float *distances_d, const int *degArray_d, const int *startIdxArray_d, int *A_d,
                            int *B_d, const int n, const int k,
@@ -189,92 +155,260 @@ namespace GsDBSCAN::clustering {
         int gridSize = (n + blockSize - 1) / blockSize;
         blockSize = std::min(n, blockSize);
 
-        auto pointInCluster_h = getPointInCluster_h(distanceMetric);
-
-        constructAdjacencyListForQueryVector<<<gridSize, blockSize>>>(distances_d,
-                                                                      adjacencyList_d,
-                                                                      startIdxArray_d,
-                                                                      A_d, B_d, eps, n, k, m,
-                                                                      pointInCluster_h, AStartNIdx
-        );
+        distances::dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+            constructAdjacencyListForQueryVector<Metric><<<gridSize, blockSize>>>(distances_d,
+                                                                                  adjacencyList_d,
+                                                                                  startIdxArray_d,
+                                                                                  A_d, B_d, eps, n, k, m,
+                                                                                  AStartNIdx);
+        });
         cudaDeviceSynchronize();
         return std::tie(adjacencyList_d, adjacencyList_size);
     }
 
 
-    inline std::tuple<std::vector<std::vector<int>>, boost::dynamic_bitset<>>
-    processAdjacencyListCpu(int *adjacencyList_d, int *degArray_d, int *startIdxArray_d,
-                            GsDBSCAN::GsDBSCAN_Params &params, int adjacencyList_size,
-                            nlohmann::ordered_json *times = nullptr) {
-        if (params.verbose) std::cout << "Processing the adj list(CPU)" << std::endl;
+#endif
 
-        auto neighbourhoodMatrix = std::vector<std::vector<int>>(params.n, std::vector<int>());
-        auto corePoints = boost::dynamic_bitset<>(params.n);
+    /**
+     * Calculates the degree of the query vectors on the host, see constructQueryVectorDegreeArrayMatx
+     *
+     * @param distances host array containing the distances between the query and candidate vectors. Shape (n, numCandidates), row major
+     * @param n number of query vectors
+     * @param numCandidates number of candidate vectors per query vector (2*k*m)
+     * @param eps epsilon DBSCAN density param
+     * @param distanceMetric the distance metric to use. Can be "L1", "L2" or "COSINE"
+     * @return vector of size n containing the degree of each query vector
+     */
+    inline std::vector<int>
+    constructQueryVectorDegreeArrayCpu(const float *distances, const int n, const int numCandidates, const float eps,
+                                       const std::string &distanceMetric) {
+        std::vector<int> degArray(n);
+
+        distances::dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+
+            #pragma omp parallel for
+            for (int i = 0; i < n; i++) {
+                const float *distancesRow = distances + (size_t) i * numCandidates;
+                int degree = 0;
+                for (int j = 0; j < numCandidates; j++) {
+                    degree += distances::distanceWithinEps<Metric>(distancesRow[j], eps);
+                }
+                degArray[i] = degree;
+            }
+        });
 
-        auto timeCopyClusteringArraysStart = au::timeNow();
+        return degArray;
+    }
 
-        auto adjacencyList_h = algo_utils::copyDeviceToHost(adjacencyList_d, adjacencyList_size);
-        auto startIdxArray_h = algo_utils::copyDeviceToHost(startIdxArray_d, params.n);
-        auto degArray_h = algo_utils::copyDeviceToHost(degArray_d, params.n);
+    inline std::vector<int> constructStartIdxArrayCpu(const std::vector<int> &degArray, int initialStartIdx = 0) {
+        std::vector<int> startIdxArray(degArray.size());
+        std::exclusive_scan(degArray.begin(), degArray.end(), startIdxArray.begin(), initialStartIdx);
+        return startIdxArray;
+    }
 
-        auto timeCopyClusteringArrays = au::duration(timeCopyClusteringArraysStart, au::timeNow());
+    /**
+     * Constructs the cluster graph adjacency list on the host, see constructAdjacencyList
+     *
+     * @param distances host array containing the distances between the query and candidate vectors. Shape (n, 2*k*m), row major
+     * @param degArray degree of each query vector
+     * @param startIdxArray start index of each query vector in the adjacency list
+     * @param A A matrix, row major with shape (totalN, 2*k)
+     * @param B B matrix, row major with shape (2*D, m)
+     * @param n number of query vectors
+     * @param k k parameter of the DBSCAN algorithm
+     * @param m m parameter of the DBSCAN algorithm
+     * @param eps epsilon DBSCAN density param
+     * @param distanceMetric the distance metric to use. Can be "L1", "L2" or "COSINE"
+     * @param AStartIdx row of A corresponding to the first query vector, allows for batching
+     * @return the adjacency list
+     */
+    inline std::vector<int>
+    constructAdjacencyListCpu(const float *distances, const std::vector<int> &degArray,
+                              const std::vector<int> &startIdxArray, const int *A, const int *B, const int n,
+                              const int k, const int m, const float eps, const std::string &distanceMetric,
+                              int AStartIdx = 0) {
+        int numCandidates = 2 * k * m;
+
+        std::vector<int> adjacencyList(n > 0 ? (size_t) startIdxArray[n - 1] + degArray[n - 1] : 0);
+
+        distances::dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+
+            #pragma omp parallel for
+            for (int i = 0; i < n; i++) {
+                const float *distancesRow = distances + (size_t) i * numCandidates;
+                const int *ARow = A + (size_t) (AStartIdx + i) * 2 * k;
+                int currIdx = startIdxArray[i];
+
+                for (int j = 0; j < numCandidates; j++) {
+                    if (distances::distanceWithinEps<Metric>(distancesRow[j], eps)) {
+                        adjacencyList[currIdx++] = B[(size_t) ARow[j / m] * m + j % m];
+                    }
+                }
+            }
+        });
 
-        if (times != nullptr && params.timeIt) {
-            (*times)["copyClusteringArrays"] = timeCopyClusteringArrays;
+        return adjacencyList;
+    }
+
+    /**
+     * Neighbourhood matrix in CSR format. The neighbours of point i are neighbours[offsets[i]] to neighbours[offsets[i + 1]]
+     */
+    struct NeighbourhoodCSR {
+        std::vector<size_t> offsets;
+        std::vector<int> neighbours;
+
+        inline int degree(int i) const {
+            return static_cast<int>(offsets[i + 1] - offsets[i]);
         }
 
-        std::vector<std::mutex> rowLocks(params.n);
+        inline const int *begin(int i) const {
+            return neighbours.data() + offsets[i];
+        }
 
-        std::function<void(int i)> processPoint;
+        inline const int *end(int i) const {
+            return neighbours.data() + offsets[i + 1];
+        }
+    };
+
+    /**
+     * Processes the adjacency list on the host, creating a (symmetric) neighbourhood matrix and core points bitset
+     *
+     * Doesn't take any locks, instead counts the (symmetric) degree of each point with atomics, prefix sums these into
+     * the row offsets, and fills the rows via atomic slots. Each row is then sorted and deduplicated in parallel.
+     *
+     * @param adjacencyList_h host adjacency list
+     * @param degArray_h host degree array
+     * @param startIdxArray_h host start index array
+     * @param params parameters of the algorithm
+     * @return a tuple containing the neighbourhood matrix and the core points bitset
+     */
+    inline std::tuple<NeighbourhoodCSR, boost::dynamic_bitset<>>
+    processAdjacencyListHost(const int *adjacencyList_h, const int *degArray_h, const int *startIdxArray_h,
+                             GsDBSCAN::GsDBSCAN_Params &params) {
+        int n = params.n;
+
+        // Symmetric degree of each point
+        std::vector<size_t> rowSizes(n, 0);
 
         if (params.ignoreAdjListSymmetry) {
             if (params.verbose) std::cout << "Not ensuring adj list symmetry" << std::endl;
-            processPoint = [&](int i) {
-                neighbourhoodMatrix[i] = std::vector<int>(adjacencyList_h + startIdxArray_h[i],
-                                                          (adjacencyList_h + startIdxArray_h[i]) + degArray_h[i] / sizeof(int)
-                );
-            };
+
+            #pragma omp parallel for
+            for (int i = 0; i < n; i++) {
+                rowSizes[i] = degArray_h[i];
+            }
         } else {
             if (params.verbose) std::cout << "Ensuring adj list symmetry" << std::endl;
-            processPoint = [&](int i) {
+
+            #pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < n; i++) {
+                for (int j = startIdxArray_h[i]; j < startIdxArray_h[i] + degArray_h[i]; j++) {
+                    #pragma omp atomic
+                    rowSizes[i]++;
+                    #pragma omp atomic
+                    rowSizes[adjacencyList_h[j]]++;
+                }
+            }
+        }
+
+        std::vector<size_t> rowOffsets(n + 1);
+        rowOffsets[n] = algo_utils::parallelExclusiveScan(rowSizes.data(), rowOffsets.data(), n);
+
+        // Fill the rows, each edge gets its slot via an atomic cursor on its row
+        std::vector<int> rowNeighbours(rowOffsets[n]);
+        std::vector<size_t> rowCursors(rowOffsets.begin(), rowOffsets.end() - 1);
+
+        if (params.ignoreAdjListSymmetry) {
+            #pragma omp parallel for
+            for (int i = 0; i < n; i++) {
+                std::copy(adjacencyList_h + startIdxArray_h[i], adjacencyList_h + startIdxArray_h[i] + degArray_h[i],
+                          rowNeighbours.begin() + rowOffsets[i]);
+            }
+        } else {
+            #pragma omp parallel for schedule(dynamic, 1024)
+            for (int i = 0; i < n; i++) {
                 for (int j = startIdxArray_h[i]; j < startIdxArray_h[i] + degArray_h[i]; j++) {
                     int candidateIdx = adjacencyList_h[j];
-                    {
-                        std::lock_guard<std::mutex> lock_i(rowLocks[i]);
-                        neighbourhoodMatrix[i].push_back(candidateIdx);
-                    }
-                    {
-                        std::lock_guard<std::mutex> lock_j(rowLocks[candidateIdx]);
-                        neighbourhoodMatrix[candidateIdx].push_back(i);
-                    }
+                    size_t slot_i, slot_j;
+
+                    #pragma omp atomic capture
+                    slot_i = rowCursors[i]++;
+                    #pragma omp atomic capture
+                    slot_j = rowCursors[candidateIdx]++;
+
+                    rowNeighbours[slot_i] = candidateIdx;
+                    rowNeighbours[slot_j] = i;
                 }
-            };
+            }
         }
 
-        #pragma omp parallel for
-        for (int i = 0; i < params.n; i++) {
-            processPoint(i);
+        // Sort and dedup each row in place, then compact the rows
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            auto rowBegin = rowNeighbours.begin() + rowOffsets[i];
+            auto rowEnd = rowNeighbours.begin() + rowOffsets[i + 1];
+            std::sort(rowBegin, rowEnd);
+            rowSizes[i] = std::unique(rowBegin, rowEnd) - rowBegin;
         }
 
-        #pragma omp parallel for
-        for (int i = 0; i < params.n; i++) {
-            std::sort(neighbourhoodMatrix[i].begin(), neighbourhoodMatrix[i].end());
-            auto last_iter = std::unique(neighbourhoodMatrix[i].begin(), neighbourhoodMatrix[i].end());
-            neighbourhoodMatrix[i].erase(last_iter, neighbourhoodMatrix[i].end());
-            if ((int) neighbourhoodMatrix[i].size() >= params.minPts - 1) {
+        NeighbourhoodCSR neighbourhoodMatrix;
+        neighbourhoodMatrix.offsets.resize(n + 1);
+        neighbourhoodMatrix.offsets[n] = algo_utils::parallelExclusiveScan(rowSizes.data(),
+                                                                           neighbourhoodMatrix.offsets.data(), n);
+        neighbourhoodMatrix.neighbours.resize(neighbourhoodMatrix.offsets[n]);
+
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            std::copy(rowNeighbours.begin() + rowOffsets[i], rowNeighbours.begin() + rowOffsets[i] + rowSizes[i],
+                      neighbourhoodMatrix.neighbours.begin() + neighbourhoodMatrix.offsets[i]);
+        }
+
+        // Bits of a dynamic_bitset share blocks, so these can't be set in parallel
+        auto corePoints = boost::dynamic_bitset<>(n);
+
+        for (int i = 0; i < n; i++) {
+            if ((int) rowSizes[i] >= params.minPts - 1) {
                 corePoints[i] = true;
             }
         }
 
+        return std::make_tuple(std::move(neighbourhoodMatrix), std::move(corePoints));
+    }
+
+#ifndef GS_DBSCAN_CPU_ONLY
+    inline std::tuple<NeighbourhoodCSR, boost::dynamic_bitset<>>
+    processAdjacencyListCpu(int *adjacencyList_d, int *degArray_d, int *startIdxArray_d,
+                            GsDBSCAN::GsDBSCAN_Params &params, int adjacencyList_size,
+                            nlohmann::ordered_json *times = nullptr) {
+        if (params.verbose) std::cout << "Processing the adj list(CPU)" << std::endl;
+
+        auto timeCopyClusteringArraysStart = au::timeNow();
+
+        auto adjacencyList_h = algo_utils::copyDeviceToHost(adjacencyList_d, adjacencyList_size);
+        auto startIdxArray_h = algo_utils::copyDeviceToHost(startIdxArray_d, params.n);
+        auto degArray_h = algo_utils::copyDeviceToHost(degArray_d, params.n);
+
+        auto timeCopyClusteringArrays = au::duration(timeCopyClusteringArraysStart, au::timeNow());
+
+        if (times != nullptr && params.timeIt) {
+            (*times)["copyClusteringArrays"] = timeCopyClusteringArrays;
+        }
+
+        auto result = processAdjacencyListHost(adjacencyList_h, degArray_h, startIdxArray_h, params);
+
         delete[] adjacencyList_h;
         delete[] startIdxArray_h;
         delete[] degArray_h;
 
-        return std::tie(neighbourhoodMatrix, corePoints);
+        return result;
     }
+#endif
 
     inline std::tuple<int *, int>
-    formClustersCPU(std::vector<std::vector<int>> &neighbourhoodMatrix, boost::dynamic_bitset<> &corePoints, int n) {
+    formClustersCPU(const NeighbourhoodCSR &neighbourhoodMatrix, boost::dynamic_bitset<> &corePoints, int n) {
         int *clusterLabels = new int[n];
         std::fill(clusterLabels, clusterLabels + n, -1);
         auto numClusters = 0;
@@ -298,9 +432,9 @@ namespace GsDBSCAN::clustering {
                 int currSeed = *seedSet.begin();
                 seedSet.erase(seedSet.begin());
 
-                auto thisNeighbourhood = neighbourhoodMatrix[currSeed];
-
-                for (auto const &neighbourIdx: thisNeighbourhood) {
+                for (const int *neighbourIt = neighbourhoodMatrix.begin(currSeed);
+                     neighbourIt != neighbourhoodMatrix.end(currSeed); neighbourIt++) {
+                    int neighbourIdx = *neighbourIt;
                     if (corePoints[neighbourIdx]) {
                         if (!connectedPoints[neighbourIdx]) {
                             connectedPoints[neighbourIdx] = true;
@@ -331,6 +465,178 @@ namespace GsDBSCAN::clustering {
         return std::make_tuple(clusterLabels, numClusters);
     }
 
+    /**
+     * Finds the root of a point in the disjoint set forest, halving the path as it goes. Safe to call concurrently
+     */
+    inline int findRootConcurrent(std::vector<std::atomic<int>> &parents, int i) {
+        while (true) {
+            int parent = parents[i].load(std::memory_order_relaxed);
+            int grandParent = parents[parent].load(std::memory_order_relaxed);
+            if (parent == grandParent) return parent;
+            // Fine if this fails, another thread has already moved i closer to the root
+            parents[i].compare_exchange_weak(parent, grandParent, std::memory_order_relaxed);
+            i = grandParent;
+        }
+    }
+
+    /**
+     * Joins the sets of two points. Always links the larger root under the smaller one, so the root of a set is its
+     * smallest point whatever order the unions happen in. Safe to call concurrently
+     */
+    inline void unionConcurrent(std::vector<std::atomic<int>> &parents, int a, int b) {
+        while (true) {
+            a = findRootConcurrent(parents, a);
+            b = findRootConcurrent(parents, b);
+            if (a == b) return;
+            if (a < b) std::swap(a, b);
+            int expected = a;
+            if (parents[a].compare_exchange_strong(expected, b, std::memory_order_relaxed)) return;
+        }
+    }
+
+    /**
+     * Forms the clusters with a lock-free disjoint set instead of a (serial) BFS, see formClustersCPU
+     *
+     * Core points are unioned with their core neighbours in parallel, then each border point takes the smallest
+     * cluster label amongst its core neighbours. Clusters are numbered in the order of their smallest core point, so
+     * the labels are deterministic whatever the thread count, and match formClustersCPU for a symmetric neighbourhood matrix.
+     * With ignoreAdjListSymmetry an edge may only be stored on one of its ends, so every row of a core point is walked in
+     * full, for its core neighbours and its border neighbours alike, as well as the rows of the border points
+     *
+     * @param neighbourhoodMatrix neighbourhood matrix of the points
+     * @param corePoints bitset marking the core points
+     * @param n number of points
+     * @return a tuple containing the cluster labels (-1 for noise) and the number of clusters
+     */
+    inline std::tuple<int *, int>
+    formClustersUnionFindCPU(const NeighbourhoodCSR &neighbourhoodMatrix, const boost::dynamic_bitset<> &corePoints,
+                             int n) {
+        std::vector<std::atomic<int>> parents(n);
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            parents[i].store(i, std::memory_order_relaxed);
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            if (!corePoints[i]) continue;
+
+            for (const int *neighbourIt = neighbourhoodMatrix.begin(i);
+                 neighbourIt != neighbourhoodMatrix.end(i); neighbourIt++) {
+                int neighbourIdx = *neighbourIt;
+                if (corePoints[neighbourIdx]) {
+                    unionConcurrent(parents, i, neighbourIdx);
+                }
+            }
+        }
+
+        // Number the clusters by their roots (the smallest core point of each)
+        std::vector<int> isRoot(n);
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            isRoot[i] = corePoints[i] && findRootConcurrent(parents, i) == i;
+        }
+
+        std::vector<int> rootClusterIds(n);
+        int numClusters = algo_utils::parallelExclusiveScan(isRoot.data(), rootClusterIds.data(), n);
+
+        int *clusterLabels = new int[n];
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            clusterLabels[i] = corePoints[i] ? rootClusterIds[findRootConcurrent(parents, i)] : -1;
+        }
+
+        // Border points, the smallest label of their core neighbours. The sets are done with, so parents holds the
+        // labels, from both the border point's row and the rows of the core points that list it
+        constexpr int NO_LABEL = std::numeric_limits<int>::max();
+
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            if (corePoints[i]) continue;
+
+            int label = NO_LABEL;
+
+            for (const int *neighbourIt = neighbourhoodMatrix.begin(i);
+                 neighbourIt != neighbourhoodMatrix.end(i); neighbourIt++) {
+                int neighbourIdx = *neighbourIt;
+                if (corePoints[neighbourIdx]) {
+                    label = std::min(label, clusterLabels[neighbourIdx]);
+                }
+            }
+
+            parents[i].store(label, std::memory_order_relaxed);
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            if (!corePoints[i]) continue;
+
+            int label = clusterLabels[i];
+
+            for (const int *neighbourIt = neighbourhoodMatrix.begin(i);
+                 neighbourIt != neighbourhoodMatrix.end(i); neighbourIt++) {
+                int neighbourIdx = *neighbourIt;
+                if (corePoints[neighbourIdx]) continue;
+
+                // Atomic min
+                int current = parents[neighbourIdx].load(std::memory_order_relaxed);
+                while (label < current &&
+                       !parents[neighbourIdx].compare_exchange_weak(current, label, std::memory_order_relaxed)) {}
+            }
+        }
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            if (corePoints[i]) continue;
+
+            int label = parents[i].load(std::memory_order_relaxed);
+            clusterLabels[i] = label == NO_LABEL ? -1 : label;
+        }
+
+        return std::make_tuple(clusterLabels, numClusters);
+    }
+
+    /**
+     * Forms the clusters on the CPU with the engine chosen in the params
+     */
+    inline std::tuple<int *, int>
+    formClustersHost(const NeighbourhoodCSR &neighbourhoodMatrix, boost::dynamic_bitset<> &corePoints,
+                     GsDBSCAN::GsDBSCAN_Params &params) {
+        if (params.useUnionFind) {
+            if (params.verbose) std::cout << "Forming clusters with union find" << std::endl;
+            return formClustersUnionFindCPU(neighbourhoodMatrix, corePoints, params.n);
+        }
+        return formClustersCPU(neighbourhoodMatrix, corePoints, params.n);
+    }
+
+    /**
+     * Creates the type labels of the points after forming clusters on the CPU. Matches the labels of formClusters
+     *
+     * @param clusterLabels cluster labels of the points, -1 for noise
+     * @param corePoints bitset marking the core points
+     * @param n number of points
+     * @return an array of size n, 1 for core points, 0 for border points and -1 for noise
+     */
+    inline int *createTypeLabelsCpu(const int *clusterLabels, const boost::dynamic_bitset<> &corePoints, int n) {
+        int *typeLabels = new int[n];
+
+        #pragma omp parallel for
+        for (int i = 0; i < n; i++) {
+            if (corePoints[i]) {
+                typeLabels[i] = 1;
+            } else {
+                typeLabels[i] = clusterLabels[i] == -1 ? -1 : 0;
+            }
+        }
+
+        return typeLabels;
+    }
+
+#ifndef GS_DBSCAN_CPU_ONLY
+
     __global__ void
     inline
     breadthFirstSearchKernel(int *adjacencyList_d, int *startIdxArray_d, bool *visited_d, bool *border_d, bool *visited,
@@ -448,22 +754,27 @@ namespace GsDBSCAN::clustering {
 
         // Deg array
         auto degArrayStart = au::timeNow();
+        tracing::ScopedSpan degArraySpan("degArray");
 
         auto degArray_d = clustering::constructQueryVectorDegreeArrayMatx(distances, eps, distanceMetric,
                                                                           matx::MATX_DEVICE_MEMORY);
 
+        degArraySpan.end();
         auto degArrayDuration = au::durationSinceStart(degArrayStart);
 
         // Start Idx array
         auto startIdxArrayStart = au::timeNow();
+        tracing::ScopedSpan startIdxArraySpan("startIdxArray");
 
         auto startIdxArray_d = clustering::constructStartIdxArray(degArray_d, thisN);
 
+        startIdxArraySpan.end();
         auto startIdxArrayDuration = au::durationSinceStart(startIdxArrayStart);
 
         // Adj list
 
         auto adjListStart = au::timeNow();
+        tracing::ScopedSpan adjListSpan("adjList");
 
         auto [adjacencyList_d, adjacencyListSize] = clustering::constructAdjacencyList(
                 distances.Data(), degArray_d,
@@ -471,71 +782,811 @@ namespace GsDBSCAN::clustering {
                 B_t.Data(), thisN, k, m, eps,
                 clusterBlockSize, distanceMetric, startIdx);
 
+        adjListSpan.end();
         auto adjListDuration = au::durationSinceStart(adjListStart);
 
         // Set times, allows for batching by accommodating for existing times
         if (timeIt) {
-            times.contains("degArray") ? times["degArray"] = static_cast<int>(times["degArray"]) + degArrayDuration
+            times.contains("degArray") ? times["degArray"] = static_cast<int64_t>(times["degArray"]) + degArrayDuration
                                        : times["degArray"] = degArrayDuration;
             times.contains("startIdxArray") ? times["startIdxArray"] =
-                                                      static_cast<int>(times["startIdxArray"]) + startIdxArrayDuration
+                                                      static_cast<int64_t>(times["startIdxArray"]) + startIdxArrayDuration
                                             : times["startIdxArray"] = startIdxArrayDuration;
-            times.contains("adjList") ? times["adjList"] = static_cast<int>(times["adjList"]) + adjListDuration
+            times.contains("adjList") ? times["adjList"] = static_cast<int64_t>(times["adjList"]) + adjListDuration
                                       : times["adjList"] = adjListDuration;
         }
         return std::make_tuple(adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d);
     }
 
-    inline std::tuple<int *, int>
-    performClustering(matx::tensor_t<float, 2> &distances, matx::tensor_t<int, 2> &A_t, matx::tensor_t<int, 2> &B_t,
-                      GsDBSCAN::GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
-
-        auto startClustering = au::timeNow();
-
-        auto [adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d] = createClusteringArrays(distances, A_t,
-                                                                                                        B_t, params.eps,
-                                                                                                        params.clusterBlockSize,
-                                                                                                        params.distanceMetric,
-                                                                                                        times,
-                                                                                                        params.timeIt);
-
-        std::tuple<int *, int> result;
+    /**
+     * Forms the clusters from the (device) clustering arrays, either on the CPU or GPU. Frees the clustering arrays
+     */
+    inline std::tuple<int *, int *, int>
+    formClustersFromArrays(int *adjacencyList_d, int adjacencyListSize, int *degArray_d, int *startIdxArray_d,
+                           GsDBSCAN::GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
+        std::tuple<int *, int *, int> result;
 
         if (params.clusterOnCpu) {
             auto startProcessAdjacencyList = au::timeNow();
+            tracing::ScopedSpan processAdjacencyListSpan("processAdjacencyList");
 
             auto [neighbourhoodMatrix, corePoints] = processAdjacencyListCpu(adjacencyList_d, degArray_d,
                                                                              startIdxArray_d, params,
                                                                              adjacencyListSize, &times);
 
+            processAdjacencyListSpan.end();
             if (params.timeIt) times["processAdjacencyList"] = au::duration(startProcessAdjacencyList, au::timeNow());
 
             auto startFormClusters = au::timeNow();
+            tracing::ScopedSpan formClustersSpan("formClusters");
 
-            result = formClustersCPU(neighbourhoodMatrix, corePoints, params.n);
+            auto [clusterLabels, numClusters] = formClustersHost(neighbourhoodMatrix, corePoints, params);
+            int *typeLabels = createTypeLabelsCpu(clusterLabels, corePoints, params.n);
 
+            result = std::make_tuple(clusterLabels, typeLabels, numClusters);
+
+            formClustersSpan.end();
             if (params.timeIt) times["formClusters"] = au::duration(startFormClusters, au::timeNow());
         } else {
             auto startFormClusters = au::timeNow();
+            tracing::ScopedSpan formClustersSpan("formClusters");
 
-            auto tup = clustering::formClusters(adjacencyList_d, degArray_d,
-                                                startIdxArray_d, params.n,
-                                                params.minPts, params.clusterBlockSize);
+            result = clustering::formClusters(adjacencyList_d, degArray_d,
+                                              startIdxArray_d, params.n,
+                                              params.minPts, params.clusterBlockSize);
 
 
+            formClustersSpan.end();
             if (params.timeIt) times["formClusters"] = au::duration(startFormClusters, au::timeNow());
-
-            result = std::make_tuple(std::get<0>(tup), std::get<2>(tup));
         }
 
         cudaFree(adjacencyList_d);
         cudaFree(degArray_d);
         cudaFree(startIdxArray_d);
 
+        return result;
+    }
+
+    inline std::tuple<int *, int *, int>
+    performClustering(matx::tensor_t<float, 2> &distances, matx::tensor_t<int, 2> &A_t, matx::tensor_t<int, 2> &B_t,
+                      GsDBSCAN::GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
+
+        auto startClustering = au::timeNow();
+
+        auto [adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d] = createClusteringArrays(distances, A_t,
+                                                                                                        B_t, params.eps,
+                                                                                                        params.clusterBlockSize,
+                                                                                                        params.distanceMetric,
+                                                                                                        times,
+                                                                                                        params.timeIt);
+
+        auto result = formClustersFromArrays(adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d, params,
+                                             times);
+
         if (params.timeIt) times["clusteringOverall"] = au::duration(startClustering, au::timeNow());
 
         return result;
     }
+
+    /**
+     * Kernel counting the eps neighbours of each query vector, computing the candidate distances on the fly
+     *
+     * Launch with one block per query vector, the threads of a block stride over its 2*k*m candidates
+     */
+    template<DistanceMetric Metric, typename T>
+    __global__ void
+    countNeighboursFusedKernel(const T *X, const int *A, const int *B, int *degArray, const int d, const int k,
+                               const int m, const float eps, const int XStartIdx, const int thisN) {
+        int i = blockIdx.x;
+        if (i >= thisN) return;
+
+        int queryIdx = XStartIdx + i;
+        const T *query = X + (size_t) queryIdx * d;
+
+        int count = 0;
+
+        for (int j = threadIdx.x; j < 2 * k * m; j += blockDim.x) {
+            int candidateIdx = B[A[queryIdx * 2 * k + j / m] * m + j % m];
+            count += distances::withinEps<Metric>(query, X + (size_t) candidateIdx * d, d, eps);
+        }
+
+        if (count > 0) atomicAdd(&degArray[i], count);
+    }
+
+    /**
+     * Kernel filling the adjacency list of each query vector, see countNeighboursFusedKernel
+     *
+     * The order of the neighbours within a row is not deterministic
+     */
+    template<DistanceMetric Metric, typename T>
+    __global__ void
+    fillAdjacencyListFusedKernel(const T *X, const int *A, const int *B, const int *startIdxArray, int *rowCursor,
+                                 int *adjacencyList, const int d, const int k, const int m, const float eps,
+                                 const int XStartIdx, const int thisN) {
+        int i = blockIdx.x;
+        if (i >= thisN) return;
+
+        int queryIdx = XStartIdx + i;
+        const T *query = X + (size_t) queryIdx * d;
+
+        for (int j = threadIdx.x; j < 2 * k * m; j += blockDim.x) {
+            int candidateIdx = B[A[queryIdx * 2 * k + j / m] * m + j % m];
+            if (distances::withinEps<Metric>(query, X + (size_t) candidateIdx * d, d, eps)) {
+                adjacencyList[startIdxArray[i] + atomicAdd(&rowCursor[i], 1)] = candidateIdx;
+            }
+        }
+    }
+
+    /**
+     * Creates the clustering arrays straight from X, A and B without materialising the distances matrix
+     *
+     * Does a count pass and a fill pass over the candidates, computing each candidate distance and eps test on the fly
+     *
+     * @param X tensor for the dataset (on the GPU)
+     * @param A tensor for the A matrix (on the GPU)
+     * @param B tensor for the B matrix (on the GPU)
+     * @param eps epsilon DBSCAN density param
+     * @param distanceMetric the distance metric to use. Can be "L1", "L2" or "COSINE"
+     * @param blockSize block size to use for the kernels
+     * @param times json object to write the times to
+     * @param timeIt whether to time the steps
+     * @param XStartIdx index of the first query vector, allows for batching
+     * @param XEndIdx index after the last query vector, -1 for the end of X
+     * @return a tuple containing the adjacency list, its size, the degree array and the start index array
+     */
+    inline std::tuple<int *, int, int *, int *>
+    createClusteringArraysFused(const torch::Tensor &X, const torch::Tensor &A, const torch::Tensor &B, float eps,
+                                const std::string &distanceMetric, int blockSize, nlohmann::ordered_json &times,
+                                bool timeIt, int XStartIdx = 0, int XEndIdx = -1) {
+        if (XEndIdx == -1) {
+            XEndIdx = X.size(0);
+        }
+
+        int thisN = XEndIdx - XStartIdx;
+        int d = X.size(1);
+        int k = A.size(1) / 2;
+        int m = B.size(1);
+
+        auto start = au::timeNow();
+
+        int *degArray_d = algo_utils::allocateCudaArray<int>(thisN);
+        int *rowCursor_d = algo_utils::allocateCudaArray<int>(thisN);
+        int *startIdxArray_d = nullptr;
+        int *adjacencyList_d = nullptr;
+        int adjacencyListSize = 0;
+
+        auto launch = [&](auto metricTag, auto *X_d) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+            using T = std::remove_const_t<std::remove_pointer_t<decltype(X_d)>>;
+
+            countNeighboursFusedKernel<Metric, T><<<thisN, blockSize>>>(X_d, A.data_ptr<int>(), B.data_ptr<int>(),
+                                                                       degArray_d, d, k, m, eps, XStartIdx, thisN);
+            cudaDeviceSynchronize();
+
+            startIdxArray_d = constructStartIdxArray(degArray_d, thisN);
+
+            adjacencyListSize = algo_utils::valueAtIdxDeviceToHost(degArray_d, thisN - 1) +
+                                algo_utils::valueAtIdxDeviceToHost(startIdxArray_d, thisN - 1);
+            adjacencyList_d = algo_utils::allocateCudaArray<int>(adjacencyListSize, false, false);
+
+            fillAdjacencyListFusedKernel<Metric, T><<<thisN, blockSize>>>(X_d, A.data_ptr<int>(), B.data_ptr<int>(),
+                                                                         startIdxArray_d, rowCursor_d,
+                                                                         adjacencyList_d, d, k, m, eps, XStartIdx,
+                                                                         thisN);
+            cudaDeviceSynchronize();
+        };
+
+        distances::dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            distances::dispatchDatasetType(X, [&](auto *X_d) {
+                launch(metricTag, X_d);
+            });
+        });
+
+        cudaFree(rowCursor_d);
+
+        if (timeIt) {
+            auto fusedDuration = au::durationSinceStart(start);
+            times.contains("fusedClusteringArrays") ? times["fusedClusteringArrays"] =
+                                                              static_cast<int64_t>(times["fusedClusteringArrays"]) + fusedDuration
+                                                    : times["fusedClusteringArrays"] = fusedDuration;
+        }
+
+        return std::make_tuple(adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d);
+    }
+
+#endif
+
+    /**
+     * Host equivalent of createClusteringArrays
+     *
+     * @param distances CPU tensor containing the distances between each query vector and its candidates. Shape (thisN, 2*k*m)
+     * @param A CPU tensor for the A matrix
+     * @param B CPU tensor for the B matrix
+     * @param eps epsilon DBSCAN density param
+     * @param distanceMetric the distance metric to use. Can be "L1", "L2" or "COSINE"
+     * @param times json object to write the times to
+     * @param timeIt whether to time the steps
+     * @param startIdx row of A corresponding to the first row of distances, allows for batching
+     * @return a tuple containing the adjacency list, degree array and start index array
+     */
+    inline std::tuple<std::vector<int>, std::vector<int>, std::vector<int>>
+    createClusteringArraysCpu(const torch::Tensor &distances, const torch::Tensor &A, const torch::Tensor &B,
+                              float eps, const std::string &distanceMetric, nlohmann::ordered_json &times,
+                              bool timeIt, int startIdx = 0) {
+
+        int thisN = distances.size(0); // thisN as distances can be processed in batches - don't use A.size(0)
+        int k = A.size(1) / 2;
+        int m = B.size(1);
+
+        auto distances_c = distances.contiguous();
+        auto A_c = A.contiguous();
+        auto B_c = B.contiguous();
+
+        const float *distances_h = distances_c.data_ptr<float>();
+
+        // Deg array
+        auto degArrayStart = au::timeNow();
+        tracing::ScopedSpan degArraySpan("degArray");
+
+        auto degArray = constructQueryVectorDegreeArrayCpu(distances_h, thisN, 2 * k * m, eps, distanceMetric);
+
+        degArraySpan.end();
+        auto degArrayDuration = au::durationSinceStart(degArrayStart);
+
+        // Start Idx array
+        auto startIdxArrayStart = au::timeNow();
+        tracing::ScopedSpan startIdxArraySpan("startIdxArray");
+
+        auto startIdxArray = constructStartIdxArrayCpu(degArray);
+
+        startIdxArraySpan.end();
+        auto startIdxArrayDuration = au::durationSinceStart(startIdxArrayStart);
+
+        // Adj list
+        auto adjListStart = au::timeNow();
+        tracing::ScopedSpan adjListSpan("adjList");
+
+        auto adjacencyList = constructAdjacencyListCpu(distances_h, degArray, startIdxArray, A_c.data_ptr<int>(),
+                                                       B_c.data_ptr<int>(), thisN, k, m, eps, distanceMetric,
+                                                       startIdx);
+
+        adjListSpan.end();
+        auto adjListDuration = au::durationSinceStart(adjListStart);
+
+        // Set times, allows for batching by accommodating for existing times
+        if (timeIt) {
+            times.contains("degArray") ? times["degArray"] = static_cast<int64_t>(times["degArray"]) + degArrayDuration
+                                       : times["degArray"] = degArrayDuration;
+            times.contains("startIdxArray") ? times["startIdxArray"] =
+                                                      static_cast<int64_t>(times["startIdxArray"]) + startIdxArrayDuration
+                                            : times["startIdxArray"] = startIdxArrayDuration;
+            times.contains("adjList") ? times["adjList"] = static_cast<int64_t>(times["adjList"]) + adjListDuration
+                                      : times["adjList"] = adjListDuration;
+        }
+
+        return std::make_tuple(adjacencyList, degArray, startIdxArray);
+    }
+
+    /**
+     * Host equivalent of formClustersFromArrays, always forms the clusters on the CPU
+     */
+    inline std::tuple<int *, int *, int>
+    formClustersFromArraysCpu(const std::vector<int> &adjacencyList, const std::vector<int> &degArray,
+                              const std::vector<int> &startIdxArray, GsDBSCAN::GsDBSCAN_Params &params,
+                              nlohmann::ordered_json &times) {
+        auto startProcessAdjacencyList = au::timeNow();
+        tracing::ScopedSpan processAdjacencyListSpan("processAdjacencyList");
+
+        auto [neighbourhoodMatrix, corePoints] = processAdjacencyListHost(adjacencyList.data(), degArray.data(),
+                                                                          startIdxArray.data(), params);
+
+        processAdjacencyListSpan.end();
+        if (params.timeIt) times["processAdjacencyList"] = au::duration(startProcessAdjacencyList, au::timeNow());
+
+        auto startFormClusters = au::timeNow();
+        tracing::ScopedSpan formClustersSpan("formClusters");
+
+        auto [clusterLabels, numClusters] = formClustersHost(neighbourhoodMatrix, corePoints, params);
+        int *typeLabels = createTypeLabelsCpu(clusterLabels, corePoints, params.n);
+
+        formClustersSpan.end();
+        if (params.timeIt) times["formClusters"] = au::duration(startFormClusters, au::timeNow());
+
+        return std::make_tuple(clusterLabels, typeLabels, numClusters);
+    }
+
+    /**
+     * Host equivalent of performClustering, always forms the clusters on the CPU
+     */
+    inline std::tuple<int *, int *, int>
+    performClusteringCpu(const torch::Tensor &distances, const torch::Tensor &A, const torch::Tensor &B,
+                         GsDBSCAN::GsDBSCAN_Params &params, nlohmann::ordered_json &times) {
+
+        auto startClustering = au::timeNow();
+
+        auto [adjacencyList, degArray, startIdxArray] = createClusteringArraysCpu(distances, A, B, params.eps,
+                                                                                  params.distanceMetric, times,
+                                                                                  params.timeIt);
+
+        auto result = formClustersFromArraysCpu(adjacencyList, degArray, startIdxArray, params, times);
+
+        if (params.timeIt) times["clusteringOverall"] = au::duration(startClustering, au::timeNow());
+
+        return result;
+    }
+
+    /**
+     * Host equivalent of createClusteringArraysFused, see there for the params
+     *
+     * Makes a single pass over the candidates, each thread collects the neighbours of a contiguous chunk of query
+     * vectors into its own buffer. These are copied into the adjacency list once the start indices are known
+     *
+     * With dedup, repeats of a candidate of a query are skipped (see distances::findDistancesCpu), and with sketches
+     * the candidates they reject are (see distances::SimHashSketches)
+     */
+    template<DistanceMetric Metric, typename T>
+    inline std::tuple<std::vector<int>, std::vector<int>, std::vector<int>>
+    createClusteringArraysFusedCpu(const T *X, const int *A, const int *B, const int d, const int k, const int m,
+                                   const float eps, const int XStartIdx, const int XEndIdx, bool dedup = false,
+                                   distances::CandidateCounts *counts = nullptr,
+                                   distances::SimHashSketches *sketches = nullptr) {
+        int thisN = XEndIdx - XStartIdx;
+        int64_t numDuplicates = 0, numPruned = 0;
+
+        std::vector<int> degArray(thisN);
+
+        int maxThreads = omp_get_max_threads();
+        std::vector<std::vector<int>> threadNeighbours(maxThreads);
+        std::vector<int> threadFirstRow(maxThreads, thisN);
+
+        #pragma omp parallel reduction(+:numDuplicates, numPruned)
+        {
+            int threadIdx = omp_get_thread_num();
+            int numThreads = omp_get_num_threads();
+
+            int chunkSize = (thisN + numThreads - 1) / numThreads;
+            int rowStart = std::min(threadIdx * chunkSize, thisN);
+            int rowEnd = std::min(rowStart + chunkSize, thisN);
+
+            tracing::ScopedSpan threadSpan("fusedClusteringArraysChunk", {{"rowStart", rowStart}, {"rowEnd", rowEnd}});
+
+            threadFirstRow[threadIdx] = rowStart;
+            auto &neighbours = threadNeighbours[threadIdx];
+
+            std::optional<distances::CandidateSet> seen;
+            if (dedup) seen.emplace(2 * k * m);
+
+            for (int i = rowStart; i < rowEnd; i++) {
+                int queryIdx = XStartIdx + i;
+                const T *query = X + (size_t) queryIdx * d;
+                const int *ARow = A + (size_t) queryIdx * 2 * k;
+
+                int degree = 0;
+                if (seen) seen->clear();
+
+                for (int a = 0; a < 2 * k; a++) {
+                    const int *BRow = B + (size_t) ARow[a] * m;
+                    for (int b = 0; b < m; b++) {
+                        int candidateIdx = BRow[b];
+                        if (seen && !seen->insert(candidateIdx)) {
+                            numDuplicates++;
+                            continue;
+                        }
+                        if (sketches != nullptr && sketches->rejects(queryIdx, candidateIdx)) {
+                            numPruned++;
+                            continue;
+                        }
+                        if (distances::withinEpsCpu<Metric>(query, X + (size_t) candidateIdx * d, d, eps)) {
+                            neighbours.push_back(candidateIdx);
+                            degree++;
+                        }
+                    }
+                }
+
+                degArray[i] = degree;
+            }
+        }
+
+        if (sketches != nullptr) {
+            sketches->candidates += (int64_t) thisN * 2 * k * m - numDuplicates;
+            sketches->pruned += numPruned;
+        }
+
+        if (counts != nullptr && dedup) {
+            counts->candidates += (int64_t) thisN * 2 * k * m;
+            counts->duplicates += numDuplicates;
+        }
+
+        auto startIdxArray = constructStartIdxArrayCpu(degArray);
+
+        std::vector<int> adjacencyList(thisN > 0 ? (size_t) startIdxArray[thisN - 1] + degArray[thisN - 1] : 0);
+
+        #pragma omp parallel for
+        for (int t = 0; t < maxThreads; t++) {
+            if (threadFirstRow[t] < thisN) {
+                std::copy(threadNeighbours[t].begin(), threadNeighbours[t].end(),
+                          adjacencyList.begin() + startIdxArray[threadFirstRow[t]]);
+            }
+        }
+
+        return std::make_tuple(adjacencyList, degArray, startIdxArray);
+    }
+
+    /**
+     * Dispatches createClusteringArraysFusedCpu on the distance metric and dtype of X
+     */
+    inline std::tuple<std::vector<int>, std::vector<int>, std::vector<int>>
+    createClusteringArraysFusedCpu(const torch::Tensor &X, const torch::Tensor &A, const torch::Tensor &B, float eps,
+                                   const std::string &distanceMetric, nlohmann::ordered_json &times, bool timeIt,
+                                   int XStartIdx = 0, int XEndIdx = -1, bool dedup = false,
+                                   distances::CandidateCounts *counts = nullptr,
+                                   distances::SimHashSketches *sketches = nullptr) {
+        if (XEndIdx == -1) {
+            XEndIdx = X.size(0);
+        }
+
+        auto X_c = X.contiguous();
+        auto A_c = A.contiguous();
+        auto B_c = B.contiguous();
+
+        int d = X.size(1);
+        int k = A.size(1) / 2;
+        int m = B.size(1);
+
+        auto start = au::timeNow();
+
+        std::tuple<std::vector<int>, std::vector<int>, std::vector<int>> result;
+
+        distances::dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+            distances::dispatchDatasetType(X_c, [&](const auto *X_h) {
+                result = createClusteringArraysFusedCpu<Metric>(X_h, A_c.data_ptr<int>(), B_c.data_ptr<int>(), d, k,
+                                                                m, eps, XStartIdx, XEndIdx, dedup, counts, sketches);
+            });
+        });
+
+        if (timeIt) {
+            auto fusedDuration = au::durationSinceStart(start);
+            times.contains("fusedClusteringArrays") ? times["fusedClusteringArrays"] =
+                                                              static_cast<int64_t>(times["fusedClusteringArrays"]) + fusedDuration
+                                                    : times["fusedClusteringArrays"] = fusedDuration;
+        }
+
+        return result;
+    }
+
+    /**
+     * Emits the candidate pairs of the query vectors as canonical (min, max) keys, min * n + max. A pair is emitted
+     * once for each time it is a candidate (as (i, j) or (j, i)), so these still need to be deduplicated
+     *
+     * @param A A matrix, row major with shape (n, 2*k)
+     * @param B B matrix, row major with shape (2*D, m)
+     * @return the keys, grouped by query vector
+     */
+    inline std::vector<uint64_t> emitCandidatePairsCpu(const int *A, const int *B, const int n, const int k,
+                                                       const int m) {
+        const int numCandidates = 2 * k * m;
+        std::vector<uint64_t> pairs((size_t) n * numCandidates);
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            const int *ARow = A + (size_t) i * 2 * k;
+            uint64_t *pairsRow = pairs.data() + (size_t) i * numCandidates;
+
+            for (int a = 0; a < 2 * k; a++) {
+                const int *BRow = B + (size_t) ARow[a] * m;
+                for (int b = 0; b < m; b++) {
+                    uint64_t low = std::min(i, BRow[b]);
+                    uint64_t high = std::max(i, BRow[b]);
+                    pairsRow[a * m + b] = low * n + high;
+                }
+            }
+        }
+
+        return pairs;
+    }
+
+    /**
+     * Same keys as emitCandidatePairsCpu, but grouped by owner (the min of each pair) instead of by query vector, i.e.
+     * a counting sort on the owner. A first pass counts the pairs of each owner, a second scatters each key into its
+     * owner's bucket, so each candidate is only visited twice and no sort scratch is needed
+     *
+     * @param A A matrix, row major with shape (n, 2*k)
+     * @param B B matrix, row major with shape (2*D, m)
+     * @param ownerOffsets set to the start of each owner's bucket, n + 1 offsets
+     * @return the keys, grouped by owner, unsorted within each bucket (see sortOwnerBucketsCpu)
+     */
+    inline std::vector<uint64_t> emitCandidatePairsByOwnerCpu(const int *A, const int *B, const int n, const int k,
+                                                              const int m, std::vector<size_t> &ownerOffsets) {
+        std::vector<size_t> ownerCursors(n, 0);
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            const int *ARow = A + (size_t) i * 2 * k;
+
+            for (int a = 0; a < 2 * k; a++) {
+                const int *BRow = B + (size_t) ARow[a] * m;
+                for (int b = 0; b < m; b++) {
+                    #pragma omp atomic
+                    ownerCursors[std::min(i, BRow[b])]++;
+                }
+            }
+        }
+
+        ownerOffsets.resize(n + 1);
+        ownerOffsets[n] = algo_utils::parallelExclusiveScan(ownerCursors.data(), ownerOffsets.data(), n);
+        std::copy(ownerOffsets.begin(), ownerOffsets.end() - 1, ownerCursors.begin());
+
+        std::vector<uint64_t> pairs(ownerOffsets[n]);
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            const int *ARow = A + (size_t) i * 2 * k;
+
+            for (int a = 0; a < 2 * k; a++) {
+                const int *BRow = B + (size_t) ARow[a] * m;
+                for (int b = 0; b < m; b++) {
+                    int low = std::min(i, BRow[b]);
+                    size_t slot;
+
+                    #pragma omp atomic capture
+                    slot = ownerCursors[low]++;
+                    pairs[slot] = (uint64_t) low * n + std::max(i, BRow[b]);
+                }
+            }
+        }
+
+        return pairs;
+    }
+
+    /**
+     * Sorts the keys of each owner's bucket (see emitCandidatePairsByOwnerCpu) in place. The buckets are in order of
+     * their owners, so this sorts all the keys
+     */
+    inline void sortOwnerBucketsCpu(std::vector<uint64_t> &pairs, const std::vector<size_t> &ownerOffsets) {
+        int n = (int) ownerOffsets.size() - 1;
+
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            std::sort(pairs.begin() + ownerOffsets[i], pairs.begin() + ownerOffsets[i + 1]);
+        }
+    }
+
+    /**
+     * Evaluates each distinct pair of sorted candidate pair keys (see emitCandidatePairsCpu) once
+     *
+     * @param numUniquePairs set to the number of distinct pairs
+     * @param sketches if not null, the sketches to reject pairs with (see distances::SimHashSketches)
+     * @return the keys of the pairs within eps of each other, i.e. the undirected edges, sorted
+     */
+    template<DistanceMetric Metric, typename T>
+    inline std::vector<uint64_t>
+    evaluateCandidatePairsCpu(const T *X, const std::vector<uint64_t> &pairs, const int n, const int d,
+                              const float eps, int64_t &numUniquePairs,
+                              distances::SimHashSketches *sketches = nullptr) {
+        size_t numPairs = pairs.size();
+
+        int maxThreads = omp_get_max_threads();
+        std::vector<std::vector<uint64_t>> threadEdges(maxThreads);
+        int64_t uniquePairs = 0, numPruned = 0;
+
+        #pragma omp parallel reduction(+:uniquePairs, numPruned)
+        {
+            int threadIdx = omp_get_thread_num();
+            int numThreads = omp_get_num_threads();
+
+            size_t chunkSize = (numPairs + numThreads - 1) / numThreads;
+            size_t chunkStart = std::min(threadIdx * chunkSize, numPairs);
+            size_t chunkEnd = std::min(chunkStart + chunkSize, numPairs);
+
+            tracing::ScopedSpan threadSpan("candidatePairsChunk");
+
+            auto &edges = threadEdges[threadIdx];
+
+            for (size_t p = chunkStart; p < chunkEnd; p++) {
+                if (p > 0 && pairs[p] == pairs[p - 1]) continue;
+                uniquePairs++;
+
+                int low = (int) (pairs[p] / n);
+                int high = (int) (pairs[p] % n);
+                if (sketches != nullptr && sketches->rejects(low, high)) {
+                    numPruned++;
+                    continue;
+                }
+                if (distances::withinEpsCpu<Metric>(X + (size_t) low * d, X + (size_t) high * d, d, eps)) {
+                    edges.push_back(pairs[p]);
+                }
+            }
+        }
+
+        numUniquePairs = uniquePairs;
+
+        if (sketches != nullptr) {
+            sketches->candidates += uniquePairs;
+            sketches->pruned += numPruned;
+        }
+
+        // The chunks are in order, so concatenating them keeps the edges sorted
+        std::vector<size_t> edgeCounts(maxThreads);
+        for (int t = 0; t < maxThreads; t++) edgeCounts[t] = threadEdges[t].size();
+        std::vector<size_t> edgeOffsets(maxThreads);
+        std::vector<uint64_t> edges(algo_utils::parallelExclusiveScan(edgeCounts.data(), edgeOffsets.data(),
+                                                                      maxThreads));
+
+        #pragma omp parallel for
+        for (int t = 0; t < maxThreads; t++) {
+            std::copy(threadEdges[t].begin(), threadEdges[t].end(), edges.begin() + edgeOffsets[t]);
+        }
+
+        return edges;
+    }
+
+    /**
+     * Creates the (symmetric) neighbourhood matrix and core points bitset from an undirected edge list, equivalent to
+     * processAdjacencyListHost on the adjacency list of the same neighbours. The edges are distinct, so each only
+     * needs to be added to both of its rows, no deduplication needed
+     *
+     * @param edges distinct edge keys, min * n + max (see emitCandidatePairsCpu)
+     * @param params parameters of the algorithm
+     * @return a tuple containing the neighbourhood matrix and the core points bitset
+     */
+    inline std::tuple<NeighbourhoodCSR, boost::dynamic_bitset<>>
+    neighbourhoodFromEdgesHost(const std::vector<uint64_t> &edges, GsDBSCAN::GsDBSCAN_Params &params) {
+        int n = params.n;
+        size_t numEdges = edges.size();
+
+        std::vector<size_t> rowSizes(n, 0);
+
+        #pragma omp parallel for schedule(static)
+        for (size_t e = 0; e < numEdges; e++) {
+            int low = (int) (edges[e] / n);
+            int high = (int) (edges[e] % n);
+            #pragma omp atomic
+            rowSizes[low]++;
+            if (high != low) {
+                #pragma omp atomic
+                rowSizes[high]++;
+            }
+        }
+
+        NeighbourhoodCSR neighbourhoodMatrix;
+        neighbourhoodMatrix.offsets.resize(n + 1);
+        neighbourhoodMatrix.offsets[n] = algo_utils::parallelExclusiveScan(rowSizes.data(),
+                                                                           neighbourhoodMatrix.offsets.data(), n);
+        neighbourhoodMatrix.neighbours.resize(neighbourhoodMatrix.offsets[n]);
+
+        std::vector<size_t> rowCursors(neighbourhoodMatrix.offsets.begin(), neighbourhoodMatrix.offsets.end() - 1);
+
+        #pragma omp parallel for schedule(static)
+        for (size_t e = 0; e < numEdges; e++) {
+            int low = (int) (edges[e] / n);
+            int high = (int) (edges[e] % n);
+            size_t slot;
+
+            #pragma omp atomic capture
+            slot = rowCursors[low]++;
+            neighbourhoodMatrix.neighbours[slot] = high;
+
+            if (high != low) {
+                #pragma omp atomic capture
+                slot = rowCursors[high]++;
+                neighbourhoodMatrix.neighbours[slot] = low;
+            }
+        }
+
+        #pragma omp parallel for schedule(dynamic, 1024)
+        for (int i = 0; i < n; i++) {
+            std::sort(neighbourhoodMatrix.neighbours.begin() + neighbourhoodMatrix.offsets[i],
+                      neighbourhoodMatrix.neighbours.begin() + neighbourhoodMatrix.offsets[i + 1]);
+        }
+
+        // Bits of a dynamic_bitset share blocks, so these can't be set in parallel
+        auto corePoints = boost::dynamic_bitset<>(n);
+
+        for (int i = 0; i < n; i++) {
+            if ((int) rowSizes[i] >= params.minPts - 1) {
+                corePoints[i] = true;
+            }
+        }
+
+        return std::make_tuple(std::move(neighbourhoodMatrix), std::move(corePoints));
+    }
+
+    /**
+     * Clusters on the host by evaluating each candidate pair once, instead of the candidates of each query vector
+     *
+     * When j is a candidate of i and i one of j (or either is a candidate more than once), the per query path computes
+     * the distance of (i, j) several times and symmetrises the resulting edges. Here the candidate pairs are emitted
+     * as canonical (min, max) keys, grouped by owner and sorted within each owner (see emitCandidatePairsByOwnerCpu),
+     * deduplicated globally, and each distinct pair is evaluated once, giving an undirected edge list. The clusters are
+     * the same as the per query path
+     *
+     * @param X CPU tensor for the dataset, shape (n, d)
+     * @param A CPU tensor for the A matrix
+     * @param B CPU tensor for the B matrix
+     * @param params parameters of the algorithm
+     * @param times json object to write the times and pair counts to
+     * @param sketches if not null, the sketches to reject pairs with (see distances::SimHashSketches)
+     * @return a tuple containing the cluster labels, type labels and number of clusters
+     */
+    inline std::tuple<int *, int *, int>
+    performClusteringPairsCpu(const torch::Tensor &X, const torch::Tensor &A, const torch::Tensor &B,
+                              GsDBSCAN::GsDBSCAN_Params &params, nlohmann::ordered_json &times,
+                              distances::SimHashSketches *sketches = nullptr) {
+        auto X_c = X.contiguous();
+        auto A_c = A.contiguous();
+        auto B_c = B.contiguous();
+
+        int n = X.size(0);
+        int d = X.size(1);
+        int k = A.size(1) / 2;
+        int m = B.size(1);
+
+        // Pairs
+        auto startEmitPairs = au::timeNow();
+        tracing::ScopedSpan emitPairsSpan("emitCandidatePairs");
+
+        std::vector<size_t> ownerOffsets;
+        auto pairs = emitCandidatePairsByOwnerCpu(A_c.data_ptr<int>(), B_c.data_ptr<int>(), n, k, m, ownerOffsets);
+
+        emitPairsSpan.end();
+        if (params.timeIt) times["emitCandidatePairs"] = au::duration(startEmitPairs, au::timeNow());
+
+        // Sort
+        auto startSortPairs = au::timeNow();
+        tracing::ScopedSpan sortPairsSpan("sortCandidatePairs");
+
+        sortOwnerBucketsCpu(pairs, ownerOffsets);
+        std::vector<size_t>().swap(ownerOffsets);
+
+        sortPairsSpan.end();
+        if (params.timeIt) times["sortCandidatePairs"] = au::duration(startSortPairs, au::timeNow());
+
+        // Distances of the distinct pairs
+        auto startPairDistances = au::timeNow();
+        tracing::ScopedSpan pairDistancesSpan("candidatePairDistances");
+
+        std::vector<uint64_t> edges;
+        int64_t numUniquePairs = 0;
+
+        distances::dispatchDistanceMetric(params.distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+            distances::dispatchDatasetType(X_c, [&](const auto *X_h) {
+                edges = evaluateCandidatePairsCpu<Metric>(X_h, pairs, n, d, params.eps, numUniquePairs, sketches);
+            });
+        });
+
+        pairDistancesSpan.end();
+
+        if (params.timeIt) {
+            times["candidatePairDistances"] = au::duration(startPairDistances, au::timeNow());
+            times["candidatePairs"] = (int64_t) pairs.size();
+            times["uniqueCandidatePairs"] = numUniquePairs;
+            times["candidatePairEdges"] = (int64_t) edges.size();
+        }
+
+        std::vector<uint64_t>().swap(pairs);
+
+        // Neighbourhood matrix
+        auto startNeighbourhood = au::timeNow();
+        tracing::ScopedSpan neighbourhoodSpan("processAdjacencyList");
+
+        auto [neighbourhoodMatrix, corePoints] = neighbourhoodFromEdgesHost(edges, params);
+
+        neighbourhoodSpan.end();
+        if (params.timeIt) times["processAdjacencyList"] = au::duration(startNeighbourhood, au::timeNow());
+
+        auto startFormClusters = au::timeNow();
+        tracing::ScopedSpan formClustersSpan("formClusters");
+
+        auto [clusterLabels, numClusters] = formClustersHost(neighbourhoodMatrix, corePoints, params);
+        int *typeLabels = createTypeLabelsCpu(clusterLabels, corePoints, params.n);
+
+        formClustersSpan.end();
+        if (params.timeIt) times["formClusters"] = au::duration(startFormClusters, au::timeNow());
+
+        return std::make_tuple(clusterLabels, typeLabels, numClusters);
+    }
 }
 
 #endif //SDBSCAN_CLUSTERING_H
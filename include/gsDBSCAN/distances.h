@@ -5,17 +5,26 @@
 #ifndef SDBSCAN_DISTANCES_H
 #define SDBSCAN_DISTANCES_H
 
+#include <algorithm>
 #include <cmath>
 #include <chrono>
 #include <iostream>
+#include <limits>
+#include <optional>
 #include <vector>
+#include "../pch.h"
+
+#ifndef GS_DBSCAN_CPU_ONLY
 #include <c10/cuda/CUDAStream.h>
 #include <c10/cuda/CUDAGuard.h>
-#include "../pch.h"
+#endif
 
 #include <cstdio>
 #include "../../include/gsDBSCAN/algo_utils.h"
+#include "simd.h"
+#include "tracing.h"
 
+#ifndef GS_DBSCAN_CPU_ONLY
 //Macro for checking cuda errors following a cuda launch or api call
 #define cudaCheckError() {                                           \
         cudaError_t e = cudaGetLastError();                              \
@@ -27,6 +36,7 @@
             printf("CUDA call successful: %s:%d\n", __FILE__, __LINE__); \
         }                                                                \
     }
+#endif
 
 enum class DistanceMetric {
     L1,
@@ -35,6 +45,781 @@ enum class DistanceMetric {
 };
 
 namespace GsDBSCAN::distances {
+
+    inline DistanceMetric distanceMetricFromString(const std::string &distanceMetric) {
+        if (distanceMetric == "L1") {
+            return DistanceMetric::L1;
+        } else if (distanceMetric == "L2") {
+            return DistanceMetric::L2;
+        } else if (distanceMetric == "COSINE") {
+            return DistanceMetric::COSINE;
+        }
+        throw std::invalid_argument("Unsupported distance metric");
+    }
+
+    /**
+     * Calls func with a std::integral_constant for the given distance metric, so it can be used as a template param
+     *
+     * @param distanceMetric the distance metric, either "L1", "L2" or "COSINE"
+     * @param func generic callable taking the metric tag
+     */
+    template<typename Func>
+    inline void dispatchDistanceMetric(const std::string &distanceMetric, Func &&func) {
+        switch (distanceMetricFromString(distanceMetric)) {
+            case DistanceMetric::L1:
+                func(std::integral_constant<DistanceMetric, DistanceMetric::L1>{});
+                break;
+            case DistanceMetric::L2:
+                func(std::integral_constant<DistanceMetric, DistanceMetric::L2>{});
+                break;
+            case DistanceMetric::COSINE:
+                func(std::integral_constant<DistanceMetric, DistanceMetric::COSINE>{});
+                break;
+        }
+    }
+
+    /**
+     * Calls func with a pointer to the data of X as its element type, i.e. float, at::Half, at::BFloat16, uint8_t or
+     * int8_t, so the kernels are instantiated per dataset dtype and read the data without converting the tensor
+     */
+    template<typename Func>
+    inline void dispatchDatasetType(const torch::Tensor &X, Func &&func) {
+        switch (X.scalar_type()) {
+            case torch::kFloat16:
+                func(X.data_ptr<at::Half>());
+                break;
+            case torch::kBFloat16:
+                func(X.data_ptr<at::BFloat16>());
+                break;
+            case torch::kFloat32:
+                func(X.data_ptr<float>());
+                break;
+            case torch::kUInt8:
+                func(X.data_ptr<uint8_t>());
+                break;
+            case torch::kInt8:
+                func(X.data_ptr<int8_t>());
+                break;
+            default:
+                throw std::runtime_error("Unsupported dataset dtype: " + std::string(c10::toString(X.scalar_type())));
+        }
+    }
+
+    /**
+     * Whether T is an 8-bit dataset type. 8-bit datasets can't hold unit vectors, so instead of normalising the dataset
+     * their COSINE similarities are normalised on the fly, by the norms of the pair (see simd::cosine)
+     */
+    template<typename T>
+    GS_HOST_DEVICE constexpr bool is8Bit() {
+        return std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t>;
+    }
+
+    /**
+     * Whether a distance (a similarity for COSINE) between a query and a candidate vector is within eps. NaN never is
+     *
+     * @param eps epsilon DBSCAN density param (adjusted, see GsDBSCAN_Params)
+     */
+    template<DistanceMetric Metric>
+    GS_HOST_DEVICE inline bool distanceWithinEps(const float distance, const float eps) {
+        if constexpr (Metric == DistanceMetric::COSINE) {
+            return distance > eps;
+        } else {
+            return distance < eps;
+        }
+    }
+
+    /**
+     * Whether two vectors are within eps of each other. For COSINE, whether their similarity is above eps
+     *
+     * L2 distances are compared squared to skip the square root
+     *
+     * @param x first vector
+     * @param y second vector
+     * @param d dimension of the vectors
+     * @param eps epsilon DBSCAN density param (adjusted, see GsDBSCAN_Params)
+     */
+    template<DistanceMetric Metric, typename T>
+    GS_HOST_DEVICE inline bool withinEps(const T *x, const T *y, const int d, const float eps) {
+        float acc = 0;
+        float xx = 0, yy = 0; // Norms of 8-bit COSINE pairs
+
+        for (int t = 0; t < d; t++) {
+            float xt = static_cast<float>(x[t]);
+            float yt = static_cast<float>(y[t]);
+
+            if constexpr (Metric == DistanceMetric::L1) {
+                acc += fabsf(xt - yt);
+            } else if constexpr (Metric == DistanceMetric::L2) {
+                acc += (xt - yt) * (xt - yt);
+            } else {
+                acc += xt * yt;
+                if constexpr (is8Bit<T>()) {
+                    xx += xt * xt;
+                    yy += yt * yt;
+                }
+            }
+        }
+
+        if constexpr (Metric == DistanceMetric::L1) {
+            return acc < eps;
+        } else if constexpr (Metric == DistanceMetric::L2) {
+            return acc < eps * eps;
+        } else if constexpr (is8Bit<T>()) {
+            float normProduct = sqrtf(xx * yy);
+            return (normProduct > 0 ? acc / normProduct : 0) > eps; // See simd::cosine for zero vectors
+        } else {
+            return acc > eps;
+        }
+    }
+
+    template<DistanceMetric Metric>
+    constexpr simd::Reduction reductionFor() {
+        if constexpr (Metric == DistanceMetric::L1) {
+            return simd::Reduction::L1;
+        } else if constexpr (Metric == DistanceMetric::L2) {
+            return simd::Reduction::SquaredL2;
+        } else {
+            return simd::Reduction::Dot;
+        }
+    }
+
+    /**
+     * Host version of withinEps, vectorised (see simd::reduce)
+     *
+     * Most candidates are far outside eps, so for L1 and L2 the sum stops as soon as it passes eps (or eps^2). This
+     * exits earliest when the dimensions are ordered by decreasing variance (see projections::getVarianceOrder)
+     */
+    template<DistanceMetric Metric, typename T>
+    inline bool withinEpsCpu(const T *x, const T *y, const int d, const float eps) {
+        if constexpr (Metric == DistanceMetric::L1) {
+            return simd::reduceBounded<simd::Reduction::L1>(x, y, d, eps) < eps;
+        } else if constexpr (Metric == DistanceMetric::L2) {
+            return simd::reduceBounded<simd::Reduction::SquaredL2>(x, y, d, eps * eps) < eps * eps;
+        } else if constexpr (is8Bit<T>()) {
+            return simd::cosine(x, y, d) > eps;
+        } else {
+            return simd::reduce<simd::Reduction::Dot>(x, y, d) > eps;
+        }
+    }
+
+    /**
+     * Distance between two vectors on the host, as findDistancesTorch computes it (the L1 or L2 distance, or the
+     * cosine similarity)
+     */
+    template<DistanceMetric Metric, typename T>
+    inline float distanceCpu(const T *x, const T *y, const int d) {
+        if constexpr (Metric == DistanceMetric::COSINE && is8Bit<T>()) {
+            return simd::cosine(x, y, d);
+        }
+
+        float acc = simd::reduce<reductionFor<Metric>()>(x, y, d);
+
+        if constexpr (Metric == DistanceMetric::L2) {
+            return std::sqrt(acc);
+        } else {
+            return acc;
+        }
+    }
+
+    // Distance written for a duplicate candidate that wasn't evaluated, never within eps (comparisons with NaN are false)
+    inline constexpr float DUPLICATE_CANDIDATE = std::numeric_limits<float>::quiet_NaN();
+
+    /**
+     * Counts of the candidates seen when deduplicating them (see findDistancesCpu)
+     */
+    struct CandidateCounts {
+        int64_t candidates = 0;
+        int64_t duplicates = 0;
+    };
+
+    /**
+     * Adds candidate counts to the times JSON, with the overall duplicate rate
+     */
+    inline void recordCandidateCounts(nlohmann::ordered_json &times, const CandidateCounts &counts) {
+        int64_t candidates = counts.candidates + (times.contains("candidates") ? (int64_t) times["candidates"] : 0);
+        int64_t duplicates = counts.duplicates +
+                             (times.contains("duplicateCandidates") ? (int64_t) times["duplicateCandidates"] : 0);
+        times["candidates"] = candidates;
+        times["duplicateCandidates"] = duplicates;
+        times["duplicateCandidateRate"] = candidates > 0 ? (double) duplicates / candidates : 0.0;
+    }
+
+    /**
+     * Set of the candidates of a single query, an open addressing hash table that is cleared in O(1) by bumping a stamp
+     */
+    class CandidateSet {
+    private:
+        std::vector<int> keys;
+        std::vector<uint32_t> stamps;
+        uint32_t stamp = 0;
+        int shift;
+
+    public:
+        /**
+         * @param capacity the most candidates inserted between clears
+         */
+        explicit CandidateSet(int capacity) {
+            int logSize = 1;
+            while ((1 << logSize) < 2 * capacity) logSize++;
+            keys.resize(1 << logSize);
+            stamps.assign(1 << logSize, 0);
+            shift = 32 - logSize;
+        }
+
+        void clear() {
+            if (++stamp == 0) {
+                std::fill(stamps.begin(), stamps.end(), 0);
+                stamp = 1;
+            }
+        }
+
+        /**
+         * @return whether the key was inserted, i.e. wasn't in the set already
+         */
+        bool insert(int key) {
+            uint32_t mask = (uint32_t) keys.size() - 1;
+            // Fibonacci hashing, the high bits of the product are the well mixed ones
+            for (uint32_t slot = ((uint32_t) key * 2654435769u) >> shift;; slot = (slot + 1) & mask) {
+                if (stamps[slot] != stamp) {
+                    stamps[slot] = stamp;
+                    keys[slot] = key;
+                    return true;
+                }
+                if (keys[slot] == key) return false;
+            }
+        }
+    };
+
+    // A COSINE similarity written for a candidate rejected by its sketch (see SimHashSketches), never within eps
+    inline constexpr float PRUNED_CANDIDATE = -std::numeric_limits<float>::infinity();
+
+    // Rows of the projections whose signs are packed at a time, so only a tile of them is ever copied
+    inline constexpr int SKETCH_ROW_TILE = 16384;
+
+    /**
+     * The largest Hamming distance between the SimHash sketches of two vectors within eps of each other, bar a
+     * falseNegativeRate chance. Vectors at the eps angle theta differ in each of the numBits bits with probability
+     * theta / pi, so the distance is the smallest one that Binomial(numBits, theta / pi) exceeds with at most that chance
+     *
+     * @param eps the (adjusted) COSINE eps, i.e. a similarity
+     */
+    inline int sketchMaxHamming(int numBits, float eps, float falseNegativeRate) {
+        double p = std::acos(std::clamp((double) eps, -1.0, 1.0)) / M_PI;
+        if (p <= 0) return 0;
+        if (p >= 1) return numBits;
+
+        auto pmf = [&](int h) {
+            return std::exp(std::lgamma(numBits + 1.0) - std::lgamma(h + 1.0) - std::lgamma(numBits - h + 1.0) +
+                            h * std::log(p) + (numBits - h) * std::log1p(-p));
+        };
+
+        // tail is P(distance > maxHamming)
+        int maxHamming = numBits;
+        double tail = 0;
+        while (maxHamming > 0 && tail + pmf(maxHamming) <= falseNegativeRate) {
+            tail += pmf(maxHamming);
+            maxHamming--;
+        }
+        return maxHamming;
+    }
+
+    /**
+     * SimHash sketches for COSINE, the sign bits of the first numBits projections of each vector, packed. With
+     * Gaussian projections each bit of two vectors at an angle theta differs independently with probability
+     * theta / pi, so the popcount of their XOR estimates the angle without reading the d dimensions
+     *
+     * Candidates whose distance to the query is over sketchMaxHamming are rejected, so a candidate within eps is
+     * missed with at most falseNegativeRate chance (the Hadamard projections are only nearly independent, so it's
+     * approximate there)
+     */
+    class SimHashSketches {
+    private:
+        int numBits;
+        int numWords;
+        int maxHamming;
+        std::vector<uint64_t> bits;
+
+    public:
+        // Candidates tested against the sketches, and how many of those were rejected
+        int64_t candidates = 0;
+        int64_t pruned = 0;
+
+        /**
+         * @param n number of vectors
+         * @param numBits bits per sketch, a multiple of 64 and at most D
+         * @param eps the (adjusted) COSINE eps, i.e. a similarity
+         */
+        SimHashSketches(int n, int numBits, float eps, float falseNegativeRate)
+                : numBits(numBits), numWords(numBits / 64),
+                  maxHamming(sketchMaxHamming(numBits, eps, falseNegativeRate)), bits((size_t) n * (numBits / 64)) {}
+
+        int getMaxHamming() const {
+            return maxHamming;
+        }
+
+        /**
+         * Packs the sketches of a block of rows from their projections, shape (blockSize, D), on any device
+         */
+        void addProjections(const torch::Tensor &projections, int startIdx) {
+            int blockSize = projections.size(0);
+
+            for (int i = 0; i < blockSize; i += SKETCH_ROW_TILE) {
+                int tileEnd = std::min(i + SKETCH_ROW_TILE, blockSize);
+                auto tile = projections.slice(0, i, tileEnd).slice(1, 0, numBits)
+                        .to(torch::kCPU).to(torch::kFloat32).contiguous();
+                const float *tile_h = tile.data_ptr<float>();
+
+                #pragma omp parallel for schedule(static)
+                for (int row = 0; row < tileEnd - i; row++) {
+                    const float *values = tile_h + (size_t) row * numBits;
+                    uint64_t *sketch = bits.data() + (size_t) (startIdx + i + row) * numWords;
+                    for (int w = 0; w < numWords; w++) {
+                        uint64_t word = 0;
+                        for (int b = 0; b < 64; b++) {
+                            word |= (uint64_t) (values[w * 64 + b] >= 0) << b;
+                        }
+                        sketch[w] = word;
+                    }
+                }
+            }
+        }
+
+        /**
+         * Whether the sketches of vectors i and j are too far apart for them to be within eps
+         */
+        bool rejects(int i, int j) const {
+            const uint64_t *x = bits.data() + (size_t) i * numWords;
+            const uint64_t *y = bits.data() + (size_t) j * numWords;
+            int hamming = 0;
+            for (int w = 0; w < numWords; w++) {
+                hamming += __builtin_popcountll(x[w] ^ y[w]);
+            }
+            return hamming > maxHamming;
+        }
+    };
+
+    /**
+     * Adds the sketch counts to the times JSON, with the overall rate of candidates pruned
+     */
+    inline void recordSketchCounts(nlohmann::ordered_json &times, const SimHashSketches &sketches) {
+        times["sketchMaxHamming"] = sketches.getMaxHamming();
+        times["sketchCandidates"] = sketches.candidates;
+        times["sketchPruned"] = sketches.pruned;
+        times["sketchPruneRate"] = sketches.candidates > 0 ? (double) sketches.pruned / sketches.candidates : 0.0;
+    }
+
+    /**
+     * Gathers the 2km candidates of a query from A and B. With dedup, repeats of a candidate are replaced by -1
+     *
+     * @return the number of duplicates
+     */
+    inline int gatherCandidates(const int *ARow, const int *B, int k, int m, int *candidates, CandidateSet *seen) {
+        for (int a = 0; a < 2 * k; a++) {
+            std::copy(B + (size_t) ARow[a] * m, B + (size_t) (ARow[a] + 1) * m, candidates + a * m);
+        }
+
+        if (seen == nullptr) return 0;
+
+        int numDuplicates = 0;
+        seen->clear();
+        for (int c = 0; c < 2 * k * m; c++) {
+            if (!seen->insert(candidates[c])) {
+                candidates[c] = -1;
+                numDuplicates++;
+            }
+        }
+        return numDuplicates;
+    }
+
+    /**
+     * Host engine for the distances between each query vector and its 2km candidates. Candidate rows are read straight
+     * from X through A and B (no gathered copies), with the rows of upcoming candidates prefetched, and each distance
+     * is reduced in registers
+     *
+     * The candidates come from 2k rows of B, which overlap heavily in dense regions. With dedup, only the first
+     * occurrence of each candidate of a query is evaluated, the others get DUPLICATE_CANDIDATE. The clustering
+     * deduplicates the neighbours anyway, so this doesn't change the clusters
+     *
+     * With sketches (COSINE only), candidates they reject get PRUNED_CANDIDATE instead of being evaluated
+     *
+     * @param distances output, shape (XEndIdx - XStartIdx, 2km)
+     * @param counts if not null, gets the candidates and duplicates counted (only counted with dedup)
+     * @param sketches if not null, the sketches to reject candidates with, their counts are added to
+     */
+    template<DistanceMetric Metric, typename T>
+    inline void findDistancesCpu(const T *X, const int *A, const int *B, float *distances, const int d, const int k,
+                                 const int m, const int XStartIdx, const int XEndIdx, bool dedup = false,
+                                 CandidateCounts *counts = nullptr, SimHashSketches *sketches = nullptr) {
+        const int numCandidates = 2 * k * m;
+        int64_t numDuplicates = 0, numPruned = 0;
+
+        #pragma omp parallel reduction(+:numDuplicates, numPruned)
+        {
+            tracing::ScopedSpan threadSpan("findDistancesCpuChunk");
+            std::vector<int> candidates(numCandidates);
+            std::optional<CandidateSet> seen;
+            if (dedup) seen.emplace(numCandidates);
+
+            #pragma omp for schedule(static)
+            for (int i = XStartIdx; i < XEndIdx; i++) {
+                const T *query = X + (size_t) i * d;
+                numDuplicates += gatherCandidates(A + (size_t) i * 2 * k, B, k, m, candidates.data(),
+                                                  seen ? &*seen : nullptr);
+
+                float *distancesRow = distances + (size_t) (i - XStartIdx) * numCandidates;
+
+                for (int c = 0; c < std::min(simd::PREFETCH_DISTANCE, numCandidates); c++) {
+                    if (candidates[c] >= 0) simd::prefetchRow(X + (size_t) candidates[c] * d, d);
+                }
+
+                for (int c = 0; c < numCandidates; c++) {
+                    int ahead = c + simd::PREFETCH_DISTANCE;
+                    if (ahead < numCandidates && candidates[ahead] >= 0) {
+                        simd::prefetchRow(X + (size_t) candidates[ahead] * d, d);
+                    }
+                    if (candidates[c] < 0) {
+                        distancesRow[c] = DUPLICATE_CANDIDATE;
+                    } else if (sketches != nullptr && sketches->rejects(i, candidates[c])) {
+                        distancesRow[c] = PRUNED_CANDIDATE;
+                        numPruned++;
+                    } else {
+                        distancesRow[c] = distanceCpu<Metric>(query, X + (size_t) candidates[c] * d, d);
+                    }
+                }
+            }
+        }
+
+        if (sketches != nullptr) {
+            sketches->candidates += (int64_t) (XEndIdx - XStartIdx) * numCandidates - numDuplicates;
+            sketches->pruned += numPruned;
+        }
+
+        if (counts != nullptr && dedup) {
+            counts->candidates += (int64_t) (XEndIdx - XStartIdx) * numCandidates;
+            counts->duplicates += numDuplicates;
+        }
+    }
+
+    // Queries of a bucket are tested against its candidates in blocks of this many, so each candidate row is reused
+    // from L1 across the block
+    inline constexpr int BUCKET_QUERY_BLOCK = 16;
+
+    /**
+     * Vector centric variant of findDistancesCpu. Queries share B rows, and the per query engine reads the m vectors of
+     * a row again for every query that references it. Here the (query, A column) entries are bucketed by the B row
+     * they reference, and the m candidates of each bucket are gathered once into a contiguous tile, then tested against
+     * all the queries of the bucket. This trades the random gathers per query for a cache resident tile per bucket
+     *
+     * @param numBRows number of rows of B, i.e. 2D
+     * @param distances output, shape (XEndIdx - XStartIdx, 2km)
+     */
+    template<DistanceMetric Metric, typename T>
+    inline void findDistancesBucketedCpu(const T *X, const int *A, const int *B, float *distances, const int d,
+                                         const int k, const int m, const int numBRows, const int XStartIdx,
+                                         const int XEndIdx) {
+        const int thisN = XEndIdx - XStartIdx;
+        const int numCandidates = 2 * k * m;
+        const int64_t numEntries = (int64_t) thisN * 2 * k;
+        const int *ASlice = A + (size_t) XStartIdx * 2 * k;
+
+        // Bucket the entries by B row, entry e is row e / 2k of the slice and column e % 2k of A
+        std::vector<int64_t> bucketSizes(numBRows, 0);
+
+        #pragma omp parallel for schedule(static)
+        for (int64_t e = 0; e < numEntries; e++) {
+            #pragma omp atomic
+            bucketSizes[ASlice[e]]++;
+        }
+
+        std::vector<int64_t> bucketOffsets(numBRows + 1);
+        bucketOffsets[numBRows] = algo_utils::parallelExclusiveScan(bucketSizes.data(), bucketOffsets.data(),
+                                                                    numBRows);
+
+        std::vector<int64_t> bucketCursors(bucketOffsets.begin(), bucketOffsets.end() - 1);
+        std::vector<int64_t> entries(numEntries);
+
+        #pragma omp parallel for schedule(static)
+        for (int64_t e = 0; e < numEntries; e++) {
+            int64_t slot;
+            #pragma omp atomic capture
+            slot = bucketCursors[ASlice[e]]++;
+            entries[slot] = e;
+        }
+
+        #pragma omp parallel
+        {
+            tracing::ScopedSpan threadSpan("findDistancesBucketedChunk");
+            std::vector<T> tile((size_t) m * d);
+
+            // Bucket sizes vary a lot, the extremes of some projections are shared by many more queries
+            #pragma omp for schedule(dynamic, 1)
+            for (int r = 0; r < numBRows; r++) {
+                if (bucketSizes[r] == 0) continue;
+
+                const int *BRow = B + (size_t) r * m;
+                for (int b = 0; b < m; b++) {
+                    std::copy(X + (size_t) BRow[b] * d, X + (size_t) (BRow[b] + 1) * d, tile.data() + (size_t) b * d);
+                }
+
+                for (int64_t blockStart = bucketOffsets[r]; blockStart < bucketOffsets[r + 1];
+                     blockStart += BUCKET_QUERY_BLOCK) {
+                    int64_t blockEnd = std::min(blockStart + BUCKET_QUERY_BLOCK, bucketOffsets[r + 1]);
+
+                    for (int b = 0; b < m; b++) {
+                        const T *candidate = tile.data() + (size_t) b * d;
+                        for (int64_t slot = blockStart; slot < blockEnd; slot++) {
+                            int64_t row = entries[slot] / (2 * k);
+                            int a = (int) (entries[slot] % (2 * k));
+                            distances[row * numCandidates + a * m + b] =
+                                    distanceCpu<Metric>(X + (size_t) (XStartIdx + row) * d, candidate, d);
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    /**
+     * int8 copy of a dataset, a quarter of the size of f32. Each row is scaled by its largest magnitude, so
+     * x ~= scale * codes with an error of at most scale / 2 per dimension. The exact squared and L1 norms of the rows
+     * are kept to bound the error of the quantised distances
+     */
+    struct QuantisedDataset {
+        int d = 0;
+        std::vector<int8_t> codes;
+        std::vector<float> scales;
+        std::vector<float> sqNorms;
+        std::vector<float> l1Norms;
+    };
+
+    template<typename T>
+    inline void quantiseRows(const T *X, QuantisedDataset &quantised, int n, int d) {
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            const T *row = X + (size_t) i * d;
+            float maxAbs = 0, sqNorm = 0, l1Norm = 0;
+            for (int t = 0; t < d; t++) {
+                float value = static_cast<float>(row[t]);
+                maxAbs = std::max(maxAbs, std::fabs(value));
+                sqNorm += value * value;
+                l1Norm += std::fabs(value);
+            }
+
+            float scale = maxAbs > 0 ? maxAbs / simd::INT8_CODE_MAX : 1;
+            int8_t *codes = quantised.codes.data() + (size_t) i * d;
+            for (int t = 0; t < d; t++) {
+                codes[t] = (int8_t) std::lround(static_cast<float>(row[t]) / scale);
+            }
+
+            quantised.scales[i] = scale;
+            quantised.sqNorms[i] = sqNorm;
+            quantised.l1Norms[i] = l1Norm;
+        }
+    }
+
+    /**
+     * Quantises X (f32, f16 or bf16, on the host) to int8, see QuantisedDataset
+     */
+    inline QuantisedDataset quantiseDataset(const torch::Tensor &X) {
+        int n = X.size(0);
+        int d = X.size(1);
+
+        if (d > simd::INT8_DOT_MAX_DIM) {
+            throw std::runtime_error("Quantised distances support up to " + std::to_string(simd::INT8_DOT_MAX_DIM) +
+                                     " dimensions");
+        }
+
+        QuantisedDataset quantised;
+        quantised.d = d;
+        quantised.codes.resize((size_t) n * d);
+        quantised.scales.resize(n);
+        quantised.sqNorms.resize(n);
+        quantised.l1Norms.resize(n);
+
+        auto X_c = X.contiguous();
+        dispatchDatasetType(X_c, [&](const auto *X_h) {
+            quantiseRows(X_h, quantised, n, d);
+        });
+
+        return quantised;
+    }
+
+    /**
+     * The quantised first pass of the distances, i.e. the int8 dataset, the (adjusted) eps it filters for, and the
+     * candidates it has seen and refined at full precision
+     */
+    struct QuantisedFilter {
+        QuantisedDataset dataset;
+        float eps;
+        int64_t candidates = 0;
+        int64_t refined = 0;
+    };
+
+    /**
+     * Adds the quantised filter counts to the times JSON, with the overall rate of candidates refined in full precision
+     */
+    inline void recordQuantisedCounts(nlohmann::ordered_json &times, const QuantisedFilter &filter) {
+        times["quantisedCandidates"] = filter.candidates;
+        times["quantisedRefined"] = filter.refined;
+        times["quantisedRefineRate"] = filter.candidates > 0 ? (double) filter.refined / filter.candidates : 0.0;
+    }
+
+    /**
+     * Variant of findDistancesCpu (L2 and COSINE only) with an int8 first pass. Each candidate's distance is first
+     * approximated from the quantised dot product, whose error is bounded from the row scales and L1 norms, i.e.
+     * |x.y - sx sy qx.qy| <= (sy |x|_1 + sx |y|_1) / 2 + d sx sy / 4, plus a margin for the float rounding. Only the
+     * candidates whose band crosses eps are refined with the full precision rows
+     *
+     * So every candidate ends on the same side of eps as with findDistancesCpu, but only the refined distances are
+     * exact, the others are the approximations. The int8 rows are a quarter of the f32 ones to read
+     *
+     * @param distances output, shape (XEndIdx - XStartIdx, 2km)
+     * @param filter the quantised dataset and eps, its counts are added to
+     */
+    template<DistanceMetric Metric, typename T>
+    inline void findDistancesQuantisedCpu(const T *X, const int *A, const int *B, float *distances, const int d,
+                                          const int k, const int m, const int XStartIdx, const int XEndIdx,
+                                          QuantisedFilter &filter, bool dedup = false,
+                                          CandidateCounts *counts = nullptr) {
+        static_assert(Metric != DistanceMetric::L1, "The L1 distance has no quantised dot product form");
+
+        const int numCandidates = 2 * k * m;
+        const QuantisedDataset &quantised = filter.dataset;
+        const int8_t *codes = quantised.codes.data();
+        const float eps = filter.eps;
+        // Bounds the float rounding of both the approximation and the full precision distance, relative to the norms
+        const float roundingMargin = (float) d * std::numeric_limits<float>::epsilon();
+
+        int64_t numDuplicates = 0, numRefined = 0;
+
+        #pragma omp parallel reduction(+:numDuplicates, numRefined)
+        {
+            tracing::ScopedSpan threadSpan("findDistancesQuantisedChunk");
+            std::vector<int> candidates(numCandidates);
+            std::optional<CandidateSet> seen;
+            if (dedup) seen.emplace(numCandidates);
+
+            #pragma omp for schedule(static)
+            for (int i = XStartIdx; i < XEndIdx; i++) {
+                numDuplicates += gatherCandidates(A + (size_t) i * 2 * k, B, k, m, candidates.data(),
+                                                  seen ? &*seen : nullptr);
+
+                const int8_t *queryCodes = codes + (size_t) i * d;
+                const float queryScale = quantised.scales[i];
+                const float querySqNorm = quantised.sqNorms[i];
+                const float queryL1Norm = quantised.l1Norms[i];
+
+                float *distancesRow = distances + (size_t) (i - XStartIdx) * numCandidates;
+
+                for (int c = 0; c < std::min(simd::PREFETCH_DISTANCE, numCandidates); c++) {
+                    if (candidates[c] >= 0) simd::prefetchRow(codes + (size_t) candidates[c] * d, d);
+                }
+
+                for (int c = 0; c < numCandidates; c++) {
+                    int ahead = c + simd::PREFETCH_DISTANCE;
+                    if (ahead < numCandidates && candidates[ahead] >= 0) {
+                        simd::prefetchRow(codes + (size_t) candidates[ahead] * d, d);
+                    }
+
+                    int j = candidates[c];
+                    if (j < 0) {
+                        distancesRow[c] = DUPLICATE_CANDIDATE;
+                        continue;
+                    }
+
+                    float scale = queryScale * quantised.scales[j];
+                    float dot = scale * (float) simd::dotInt8(queryCodes, codes + (size_t) j * d, d);
+                    float dotError = 0.5f * (quantised.scales[j] * queryL1Norm + queryScale * quantised.l1Norms[j]) +
+                                     0.25f * (float) d * scale +
+                                     roundingMargin * (querySqNorm + quantised.sqNorms[j]);
+
+                    bool surelyWithin, surelyOutside;
+                    float distance;
+                    if constexpr (Metric == DistanceMetric::L2) {
+                        float sqDistance = querySqNorm + quantised.sqNorms[j] - 2 * dot;
+                        surelyWithin = sqDistance + 2 * dotError < eps * eps;
+                        surelyOutside = sqDistance - 2 * dotError >= eps * eps;
+                        distance = std::sqrt(std::max(sqDistance, 0.0f));
+                    } else {
+                        surelyWithin = dot - dotError > eps;
+                        surelyOutside = dot + dotError <= eps;
+                        distance = dot;
+                    }
+
+                    // The approximation itself must also land on the settled side (rounding at the edge of the band)
+                    if ((surelyWithin || surelyOutside) && distanceWithinEps<Metric>(distance, eps) == surelyWithin) {
+                        distancesRow[c] = distance;
+                    } else {
+                        distancesRow[c] = distanceCpu<Metric>(X + (size_t) i * d, X + (size_t) j * d, d);
+                        numRefined++;
+                    }
+                }
+            }
+        }
+
+        filter.candidates += (int64_t) (XEndIdx - XStartIdx) * numCandidates - numDuplicates;
+        filter.refined += numRefined;
+
+        if (counts != nullptr && dedup) {
+            counts->candidates += (int64_t) (XEndIdx - XStartIdx) * numCandidates;
+            counts->duplicates += numDuplicates;
+        }
+    }
+
+    /**
+     * Dispatches findDistancesCpu (or findDistancesBucketedCpu, which doesn't dedup, or findDistancesQuantisedCpu with
+     * a quantised filter) on the distance metric and dtype of X, see findDistancesTorch for the params. Sketches only
+     * apply to findDistancesCpu
+     */
+    inline torch::Tensor
+    findDistancesCpu(const torch::Tensor &X, const torch::Tensor &A, const torch::Tensor &B,
+                     const std::string &distanceMetric, int XStartIdx = 0, int XEndIdx = -1, bool dedup = false,
+                     CandidateCounts *counts = nullptr, bool bucketed = false, QuantisedFilter *quantised = nullptr,
+                     SimHashSketches *sketches = nullptr) {
+        if (XEndIdx == -1) {
+            XEndIdx = X.size(0);
+        }
+
+        auto X_c = X.contiguous();
+        auto A_c = A.to(torch::kInt32).contiguous();
+        auto B_c = B.to(torch::kInt32).contiguous();
+
+        int d = X.size(1);
+        int k = A.size(1) / 2;
+        int m = B.size(1);
+
+        torch::Tensor distances = torch::empty({XEndIdx - XStartIdx, 2 * k * m},
+                                               torch::TensorOptions().dtype(torch::kFloat32));
+
+        int numBRows = B.size(0);
+
+        dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
+            auto run = [&](const auto *X_h) {
+                if (bucketed) {
+                    findDistancesBucketedCpu<Metric>(X_h, A_c.data_ptr<int>(), B_c.data_ptr<int>(),
+                                                     distances.data_ptr<float>(), d, k, m, numBRows, XStartIdx,
+                                                     XEndIdx);
+                } else if (quantised != nullptr) {
+                    if constexpr (Metric == DistanceMetric::L1) {
+                        throw std::runtime_error("Quantised distances only support the L2 and COSINE metrics");
+                    } else {
+                        findDistancesQuantisedCpu<Metric>(X_h, A_c.data_ptr<int>(), B_c.data_ptr<int>(),
+                                                          distances.data_ptr<float>(), d, k, m, XStartIdx, XEndIdx,
+                                                          *quantised, dedup, counts);
+                    }
+                } else {
+                    findDistancesCpu<Metric>(X_h, A_c.data_ptr<int>(), B_c.data_ptr<int>(),
+                                             distances.data_ptr<float>(), d, k, m, XStartIdx, XEndIdx, dedup, counts,
+                                             sketches);
+                }
+            };
+            dispatchDatasetType(X_c, run);
+        });
+
+        return distances;
+    }
+
     /**
      * Calculates the batch size for distance calculations
      *
@@ -48,19 +833,17 @@ namespace GsDBSCAN::distances {
     inline int findDistanceBatchSize(const float alpha, const int n, const int d, const int k, const int m) {
         int batchSize = static_cast<int>((static_cast<long long>(n) * d * 2 * k * m) / (std::pow(1024, 3) * alpha));
 
-        if (batchSize == 0) {
+        if (batchSize == 0 || batchSize >= n) {
             return n;
         }
 
-        for (int div = batchSize; div > 0; div--) {
-            if (n % div == 0) {
-                return div;
-            }
-        }
-
-        return -1; // Should never reach here
+        // Balance the batches rather than searching for a divisor of n (which degrades to 1 when n is prime), the
+        // callers handle the final remainder batch
+        int numBatches = (n + batchSize - 1) / batchSize;
+        return (n + numBatches - 1) / numBatches;
     }
 
+#ifndef GS_DBSCAN_CPU_ONLY
     inline torch::Tensor
     findDistancesTorchWithScripts(torch::Tensor &X, torch::Tensor &A, torch::Tensor &B, const float alpha,
                                   int batchSize, const std::string &distanceMetric, int XStartIdx = 0,
@@ -144,10 +927,33 @@ namespace GsDBSCAN::distances {
 
         return distances;
     }
+#endif
+
+    /**
+     * Distances between a batch of query vectors, shape (batch, 1, d), and their gathered candidates, shape
+     * (batch, 2km, d)
+     */
+    template<DistanceMetric Metric>
+    inline torch::Tensor candidateDistancesTorch(const torch::Tensor &candidates, const torch::Tensor &queries) {
+        if constexpr (Metric == DistanceMetric::L1) {
+            return torch::norm(candidates - queries, 1, /*dim=*/2);
+        } else if constexpr (Metric == DistanceMetric::L2) {
+            return torch::norm(candidates - queries, 2, /*dim=*/2);
+        } else {
+            return torch::sum(candidates * queries, /*dim=*/2);
+        }
+    }
 
+    /**
+     * Distances between each query vector in [XStartIdx, XEndIdx) and its 2km candidates, shape
+     * (XEndIdx - XStartIdx, 2km). On the CPU see findDistancesCpu (dedup, counts, bucketed, quantised and sketches
+     * only apply there)
+     */
     inline torch::Tensor
     findDistancesTorch(torch::Tensor &X, torch::Tensor &A, torch::Tensor &B, const float alpha,
-                       int batchSize, const std::string &distanceMetric, int XStartIdx = 0, int XEndIdx = -1) {
+                       int batchSize, const std::string &distanceMetric, int XStartIdx = 0, int XEndIdx = -1,
+                       bool dedup = false, CandidateCounts *counts = nullptr, bool bucketed = false,
+                       QuantisedFilter *quantised = nullptr, SimHashSketches *sketches = nullptr) {
 
 
         if (XEndIdx == -1) {
@@ -161,46 +967,37 @@ namespace GsDBSCAN::distances {
         int effectiveN = XEndIdx - XStartIdx;
         int actualN = X.size(0);
 
+        // The host engine reads the candidates in place, so it needs no batches
+        if (X.device().is_cpu()) {
+            return findDistancesCpu(X, A, B, distanceMetric, XStartIdx, XEndIdx, dedup, counts, bucketed, quantised,
+                                    sketches);
+        }
+
         batchSize = (batchSize != -1) ? batchSize : findDistanceBatchSize(alpha, actualN, d, k, m);
 
         torch::Tensor distances = torch::empty({effectiveN, 2 * k * m},
-                                               torch::device(torch::kCUDA).dtype(torch::kFloat32));
-
-        std::function<torch::Tensor(const torch::Tensor &, const torch::Tensor &)> calculate_distance;
+                                               torch::device(X.device()).dtype(torch::kFloat32));
 
-        if (distanceMetric == "L2") {
-            calculate_distance = [](const torch::Tensor &Z_batch_adj, const torch::Tensor &X_batch) {
-                return torch::norm(Z_batch_adj - X_batch, 2, /*dim=*/2);
-            };
-        } else if (distanceMetric == "L1") {
-            calculate_distance = [](const torch::Tensor &X_subset_adj, const torch::Tensor &X_batch) {
-                return torch::norm(X_subset_adj - X_batch, 1, /*dim=*/2);
-            };
-        } else if (distanceMetric == "COSINE") {
-            calculate_distance = [](const torch::Tensor &Z_batch_adj, const torch::Tensor &X_batch) {
-                torch::Tensor product = Z_batch_adj * X_batch;
-                return torch::sum(product, /*dim=*/2);
-            };
-        } else {
-            throw std::invalid_argument("Unsupported distance metric");
-        }
+        dispatchDistanceMetric(distanceMetric, [&](auto metricTag) {
+            constexpr DistanceMetric Metric = decltype(metricTag)::value;
 
-        for (int i = 0; i < effectiveN; i += batchSize) {
-            int maxDistancesIdx = std::min(i + batchSize, effectiveN);
-            int thisBatchSize = maxDistancesIdx - i;
+            for (int i = 0; i < effectiveN; i += batchSize) {
+                int maxDistancesIdx = std::min(i + batchSize, effectiveN);
+                int thisBatchSize = maxDistancesIdx - i;
 
-            int thisXStartIdx = i + XStartIdx;
-            int thisXMaxIdx = thisXStartIdx + thisBatchSize;
+                int thisXStartIdx = i + XStartIdx;
+                int thisXMaxIdx = thisXStartIdx + thisBatchSize;
 
-            // Equivalent to X[B[A[i:max_batch_idx]]] in Python
-            torch::Tensor X_subset = X.index_select(0, B.index_select(0, A.slice(0, thisXStartIdx,
-                                                                                 thisXMaxIdx).flatten()).flatten());
-            torch::Tensor X_subset_adj = X_subset.view({thisBatchSize, 2 * k * m, d});
+                // Equivalent to X[B[A[i:max_batch_idx]]] in Python
+                torch::Tensor X_subset = X.index_select(0, B.index_select(0, A.slice(0, thisXStartIdx,
+                                                                                     thisXMaxIdx).flatten()).flatten());
+                torch::Tensor X_subset_adj = X_subset.view({thisBatchSize, 2 * k * m, d});
 
-            torch::Tensor X_batch = X.slice(0, thisXStartIdx, thisXMaxIdx).unsqueeze(1);
+                torch::Tensor X_batch = X.slice(0, thisXStartIdx, thisXMaxIdx).unsqueeze(1);
 
-            distances.slice(0, i, maxDistancesIdx) = calculate_distance(X_subset_adj, X_batch);
-        }
+                distances.slice(0, i, maxDistancesIdx) = candidateDistancesTorch<Metric>(X_subset_adj, X_batch);
+            }
+        });
 
         return distances;
     }
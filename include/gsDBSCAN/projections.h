@@ -7,10 +7,15 @@
 
 #include <tuple>
 #include <cmath>
+#include <algorithm>
+#include <limits>
+#include <vector>
 #include "../pch.h"
 #include <optional>
 
 #include "algo_utils.h"
+#include "distances.h"
+#include "tracing.h"
 #include "GsDBSCAN_Params.h"
 
 template<typename T>
@@ -28,6 +33,119 @@ namespace GsDBSCAN::projections {
         }
     }
 
+    /**
+     * Two-sided selection of the count smallest and count largest values of a small array (e.g. a row of the
+     * projections, D values with count = k), kept in insertion sorted buffers. Most values are rejected by a single
+     * comparison with the current worst of each buffer
+     *
+     * Ties are broken like a stable ascending argsort, so the result matches argsort(values).slice(0, count) and
+     * argsort(values).slice(len - count, len)
+     *
+     * @param lowIdx output, the indices of the count smallest values in ascending order
+     * @param highIdx output, the indices of the count largest values in ascending order
+     * @param lowVals scratch space of size count
+     * @param highVals scratch space of size count
+     */
+    inline void selectExtremesSmall(const float *values, int len, int count, int *lowIdx, int *highIdx,
+                                    float *lowVals, float *highVals) {
+        // The high buffer is descending while selecting, reversed at the end
+        int numLow = 0, numHigh = 0;
+
+        for (int i = 0; i < len; i++) {
+            float v = values[i];
+
+            if (numLow < count || v < lowVals[count - 1]) {
+                int j = numLow < count ? numLow++ : count - 1;
+                for (; j > 0 && v < lowVals[j - 1]; j--) {
+                    lowVals[j] = lowVals[j - 1];
+                    lowIdx[j] = lowIdx[j - 1];
+                }
+                lowVals[j] = v;
+                lowIdx[j] = i;
+            }
+
+            // Later indices come later in a stable ascending argsort, so they win ties on this side
+            if (numHigh < count || v >= highVals[count - 1]) {
+                int j = numHigh < count ? numHigh++ : count - 1;
+                for (; j > 0 && v >= highVals[j - 1]; j--) {
+                    highVals[j] = highVals[j - 1];
+                    highIdx[j] = highIdx[j - 1];
+                }
+                highVals[j] = v;
+                highIdx[j] = i;
+            }
+        }
+
+        std::reverse(highIdx, highIdx + count);
+    }
+
+    /**
+     * Same as selectExtremesSmall, but for long arrays with a larger count (e.g. a column of the projections, n values
+     * with count = m). A strided sample of the array gives a pair of thresholds that (with a safety margin) keep a bit
+     * more than count values on each side, so only those candidates are sorted. Falls back to selecting from the whole
+     * array if the sample was unlucky
+     *
+     * @param candidates scratch space, reused between calls
+     */
+    inline void selectExtremesLarge(const float *values, int len, int count, int *lowIdx, int *highIdx,
+                                    std::vector<std::pair<float, int>> &candidates) {
+        auto ascending = [](const std::pair<float, int> &a, const std::pair<float, int> &b) {
+            return a.first < b.first || (a.first == b.first && a.second < b.second);
+        };
+
+        auto select = [&](float lowThreshold, float highThreshold, bool useThresholds) {
+            candidates.clear();
+            for (int i = 0; i < len; i++) {
+                if (!useThresholds || values[i] <= lowThreshold) candidates.emplace_back(values[i], i);
+            }
+            if ((int) candidates.size() < count) return false;
+            std::partial_sort(candidates.begin(), candidates.begin() + count, candidates.end(), ascending);
+            for (int j = 0; j < count; j++) lowIdx[j] = candidates[j].second;
+
+            candidates.clear();
+            for (int i = 0; i < len; i++) {
+                if (!useThresholds || values[i] >= highThreshold) candidates.emplace_back(values[i], i);
+            }
+            if ((int) candidates.size() < count) return false;
+            auto highBegin = candidates.end() - count;
+            std::nth_element(candidates.begin(), highBegin, candidates.end(), ascending);
+            std::sort(highBegin, candidates.end(), ascending);
+            for (int j = 0; j < count; j++) highIdx[j] = (highBegin + j)->second;
+            return true;
+        };
+
+        const int sampleSize = 16 * count + 1024;
+
+        if (len > 4 * sampleSize) {
+            std::vector<float> sample(sampleSize);
+            size_t stride = len / sampleSize;
+            for (int s = 0; s < sampleSize; s++) {
+                // Jitter the sample within its stride, so it doesn't alias with any periodicity of the data
+                size_t jitter = ((size_t) s * 2654435761u) % stride;
+                sample[s] = values[(size_t) s * stride + jitter];
+            }
+
+            // Expected rank of the count-th value in the sample, with a margin of a few standard deviations
+            int rank = std::min(sampleSize - 1, (int) (1.5 * count * sampleSize / len) + 32);
+
+            std::nth_element(sample.begin(), sample.begin() + rank, sample.end());
+            float lowThreshold = sample[rank];
+            std::nth_element(sample.begin(), sample.end() - 1 - rank, sample.end());
+            float highThreshold = *(sample.end() - 1 - rank);
+
+            if (select(lowThreshold, highThreshold, true)) return;
+        }
+
+        select(0, 0, false);
+    }
+
+    /**
+     * Projections as a contiguous float32 CPU tensor, so the selections can read them directly
+     */
+    inline torch::Tensor toSelectableCPU(const torch::Tensor &projections) {
+        return projections.to(torch::kFloat32).contiguous();
+    }
+
     inline torch::Tensor
     constructAMatrix(const torch::Tensor &projections, int k, bool sortDescending = false,
                      opt <torch::Tensor> A = std::nullopt, int startIdx = 0) {
@@ -36,20 +154,49 @@ namespace GsDBSCAN::projections {
         int D = projections.size(1);
 
         if (!A.has_value()) {
-            A = torch::empty({n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32).device(torch::kCUDA));
+            A = torch::empty({n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32).device(projections.device()));
+        }
+
+        if (projections.device().is_cpu()) {
+            auto values = toSelectableCPU(projections);
+            const float *values_h = values.data_ptr<float>();
+            int *A_h = A->data_ptr<int>() + (size_t) startIdx * 2 * k;
+
+            #pragma omp parallel
+            {
+                std::vector<int> lowIdx(k), highIdx(k);
+                std::vector<float> lowVals(k), highVals(k);
+
+                #pragma omp for schedule(static)
+                for (int i = 0; i < n; i++) {
+                    selectExtremesSmall(values_h + (size_t) i * D, D, k, lowIdx.data(), highIdx.data(),
+                                        lowVals.data(), highVals.data());
+
+                    int *ARow = A_h + (size_t) i * 2 * k;
+                    int *closeIdx = sortDescending ? highIdx.data() : lowIdx.data();
+                    int *farIdx = sortDescending ? lowIdx.data() : highIdx.data();
+                    for (int j = 0; j < k; j++) {
+                        // A descending sort is the reverse of an ascending one
+                        ARow[j] = 2 * closeIdx[sortDescending ? k - 1 - j : j]; // Closest
+                        ARow[k + j] = 2 * farIdx[sortDescending ? k - 1 - j : j] + 1; // Furthest
+                    }
+                }
+            }
+
+            return *A;
         }
 
-        auto dataToRandomIdxSorted = projections.argsort(1, sortDescending).toType(torch::kInt32);
+        // Only the k closest and furthest projections are needed, a partial selection beats sorting all D of them
+        auto closeProjectionsIdx = std::get<1>(projections.topk(k, 1, sortDescending, true));
+        // topk returns the furthest first, flip them to the order of the tail of a full sort
+        auto farProjectionsIdx = std::get<1>(projections.topk(k, 1, !sortDescending, true)).flip({1});
 
         auto AColCloseSlice = torch::indexing::Slice(0, k);
         auto AColFarSlice = torch::indexing::Slice(k, 2 * k);
         auto ARowSlice = torch::indexing::Slice(startIdx, startIdx + n);
 
-        auto closeProjectionsIdx = 2 * dataToRandomIdxSorted.slice(1, 0, k);
-        auto farProjectionsIdx = 2 * dataToRandomIdxSorted.slice(1, D - k, D) + 1;
-
-        A->index_put_({ARowSlice, AColCloseSlice}, closeProjectionsIdx); // Closest
-        A->index_put_({ARowSlice, AColFarSlice}, farProjectionsIdx); // Furthest
+        A->index_put_({ARowSlice, AColCloseSlice}, 2 * closeProjectionsIdx.toType(torch::kInt32)); // Closest
+        A->index_put_({ARowSlice, AColFarSlice}, 2 * farProjectionsIdx.toType(torch::kInt32) + 1); // Furthest
 
         return *A;
     }
@@ -62,19 +209,46 @@ namespace GsDBSCAN::projections {
         int D = projections.size(1);
 
         if (!B.has_value()) {
-            B = torch::empty({2 * D, m}, torch::TensorOptions().dtype(torch::kInt32).device(torch::kCUDA));
+            B = torch::empty({2 * D, m}, torch::TensorOptions().dtype(torch::kInt32).device(projections.device()));
         }
 
-        auto randomToDataIdxSorted = projections.argsort(0, sortDescending).toType(torch::kInt32);
+        if (projections.device().is_cpu()) {
+            // Each column is selected by one thread, so make the columns contiguous first
+            auto values = toSelectableCPU(projections.t());
+            const float *values_h = values.data_ptr<float>();
+            int *B_h = B->data_ptr<int>();
+
+            #pragma omp parallel
+            {
+                std::vector<std::pair<float, int>> candidates;
+                std::vector<int> lowIdx(m), highIdx(m);
+
+                #pragma omp for schedule(dynamic)
+                for (int j = 0; j < D; j++) {
+                    selectExtremesLarge(values_h + (size_t) j * n, n, m, lowIdx.data(), highIdx.data(), candidates);
+
+                    int *closeIdx = sortDescending ? highIdx.data() : lowIdx.data();
+                    int *farIdx = sortDescending ? lowIdx.data() : highIdx.data();
+                    int *BCloseRow = B_h + (size_t) 2 * (startIdx + j) * m;
+                    int *BFarRow = BCloseRow + m;
+                    for (int l = 0; l < m; l++) {
+                        BCloseRow[l] = closeIdx[sortDescending ? m - 1 - l : l]; // Close -> close
+                        BFarRow[l] = farIdx[sortDescending ? m - 1 - l : l]; // Far -> far
+                    }
+                }
+            }
+
+            return *B;
+        }
+
+        auto closeProjectionsIdx = std::get<1>(projections.topk(m, 0, sortDescending, true)).transpose(0, 1);
+        auto farProjectionsIdx = std::get<1>(projections.topk(m, 0, !sortDescending, true)).flip({0}).transpose(0, 1);
 
         auto BRowEvenIdx = torch::arange(2 * startIdx + 0, 2 * (startIdx + D), 2);
         auto BRowOddIdx = BRowEvenIdx + 1;
 
-        auto closeProjectionsIdx = randomToDataIdxSorted.slice(0, 0, m).transpose(0, 1);
-        auto farProjectionsIdx = randomToDataIdxSorted.slice(0, n - m, n).transpose(0, 1);
-
-        B->index_put_({BRowEvenIdx, torch::indexing::Ellipsis}, closeProjectionsIdx); // Close -> close
-        B->index_put_({BRowOddIdx, torch::indexing::Ellipsis}, farProjectionsIdx); // Far -> far
+        B->index_put_({BRowEvenIdx, torch::indexing::Ellipsis}, closeProjectionsIdx.toType(torch::kInt32)); // Close -> close
+        B->index_put_({BRowOddIdx, torch::indexing::Ellipsis}, farProjectionsIdx.toType(torch::kInt32)); // Far -> far
 
         return *B;
     }
@@ -89,7 +263,21 @@ namespace GsDBSCAN::projections {
         return std::tie(A, B);
     }
 
+    /**
+     * Whether X is an 8-bit (uint8 or int8) dataset, see distances::is8Bit
+     */
+    inline bool is8Bit(const torch::Tensor &X) {
+        return X.scalar_type() == torch::kUInt8 || X.scalar_type() == torch::kInt8;
+    }
+
+    /**
+     * Normalises the rows of X. 8-bit datasets are returned as they are, they are normalised on the fly by the
+     * projections and the distances instead (see projectDataset and distances::is8Bit)
+     */
     inline torch::Tensor normaliseDataset(torch::Tensor &X, GsDBSCAN_Params params) {
+        if (is8Bit(X)) {
+            return X;
+        }
         if (params.useBatchNorm) {
             int normBatchSize = params.normBatchSize;
             for (int i = 0; i < X.size(0); i += normBatchSize) {
@@ -105,20 +293,99 @@ namespace GsDBSCAN::projections {
         }
     }
 
+    // Rounds of (random signs, Hadamard transform) per block of the structured projections, three are enough for
+    // the projections to behave like Gaussian ones (as in structured orthogonal random features)
+    inline constexpr int HADAMARD_ROUNDS = 3;
+
+    inline int nextPowerOfTwo(int x) {
+        int p = 1;
+        while (p < x) p *= 2;
+        return p;
+    }
+
+    /**
+     * The random signs of the structured projections, which replace the dense random vectors. The input is padded to a
+     * power of two P, then ceil(D / P) blocks of P projections are stacked until there are D of them
+     *
+     * @return +-1 signs, with shape (ceil(D / P) * HADAMARD_ROUNDS, P)
+     */
+    inline torch::Tensor getHadamardSigns(int inputDim, int D, torch::Device device) {
+        int P = nextPowerOfTwo(inputDim);
+        int numBlocks = (D + P - 1) / P;
+        auto bits = torch::randint(0, 2, {numBlocks * HADAMARD_ROUNDS, P}, torch::TensorOptions().device(device));
+        return 2 * bits.to(torch::kFloat32) - 1;
+    }
+
+    /**
+     * Unnormalised fast Walsh-Hadamard transform of each row of x, as log2(P) butterfly passes, in O(P log P) per row
+     *
+     * @param x shape (rows, P), P a power of two
+     */
+    inline torch::Tensor fastWalshHadamard(torch::Tensor x) {
+        int rows = x.size(0);
+        int P = x.size(1);
+        for (int h = 1; h < P; h *= 2) {
+            auto pairs = x.reshape({rows, P / (2 * h), 2, h});
+            auto a = pairs.select(2, 0);
+            auto b = pairs.select(2, 1);
+            x = torch::stack({a + b, a - b}, 2).reshape({rows, P});
+        }
+        return x;
+    }
+
+    /**
+     * Structured random projections of the rows of input, i.e. for each block HD_3 HD_2 HD_1 x with D_i the random sign
+     * flips and H the Hadamard transform. Costs O(D log P) per row instead of the O(inputDim * D) of a dense projection
+     *
+     * @param input shape (rows, inputDim)
+     * @param signs see getHadamardSigns
+     * @param D the number of projections
+     * @return the projections, shape (rows, D), scaled like Gaussian projections
+     */
+    inline torch::Tensor hadamardProject(const torch::Tensor &input, const torch::Tensor &signs, int D) {
+        int rows = input.size(0);
+        int P = signs.size(1);
+        int numBlocks = signs.size(0) / HADAMARD_ROUNDS;
+
+        auto blockSigns = signs.to(input.scalar_type()).reshape({numBlocks, HADAMARD_ROUNDS, P});
+
+        auto z = input;
+        if (input.size(1) < P) {
+            z = torch::cat({input, torch::zeros({rows, P - input.size(1)}, input.options())}, 1);
+        }
+        z = z.unsqueeze(1).expand({rows, numBlocks, P});
+
+        for (int r = 0; r < HADAMARD_ROUNDS; r++) {
+            z = fastWalshHadamard((z * blockSigns.select(1, r)).reshape({rows * numBlocks, P}))
+                    .reshape({rows, numBlocks, P});
+        }
+
+        // Each unnormalised transform scales norms by sqrt(P), a Gaussian projection has the input's norm as std
+        return z.reshape({rows, numBlocks * P}).slice(1, 0, D) / (float) P;
+    }
+
     inline torch::Tensor
     getRandomVectorsMatrix(int d, int D, const std::string &distanceMetric = "L2", int fourierEmbedDim = 1024,
-                           std::optional<torch::Dtype> castToType = std::nullopt) {
+                           std::optional<torch::Dtype> castToType = std::nullopt,
+                           torch::Device device = torch::kCUDA, const std::string &projectionType = "gaussian") {
 
         torch::Tensor Y;
 
+        int inputDim;
         if (distanceMetric == "L1" || distanceMetric == "L2") {
-            Y = torch::randn({2 * fourierEmbedDim, D}, torch::TensorOptions().device(torch::kCUDA));
+            inputDim = 2 * fourierEmbedDim;
         } else if (distanceMetric == "COSINE") {
-            Y = torch::randn({d, D}, torch::TensorOptions().device(torch::kCUDA));
+            inputDim = d;
         } else {
             throw std::runtime_error("Unknown distanceMetric: '" + distanceMetric + "'");
         }
 
+        if (projectionType == "hadamard") {
+            Y = getHadamardSigns(inputDim, D, device);
+        } else {
+            Y = torch::randn({inputDim, D}, torch::TensorOptions().device(device));
+        }
+
         if (castToType.has_value()) {
             Y = Y.to(castToType.value());
         }
@@ -126,41 +393,149 @@ namespace GsDBSCAN::projections {
         return Y;
     }
 
+    /**
+     * The random matrix W of the Fourier embedding (cos(WX), sin(WX)) used by L1 and L2, with shape
+     * (fourierEmbedDim, d). Batches of the same dataset must share it, as they must share Y
+     */
+    inline torch::Tensor
+    getEmbeddingMatrix(int d, const std::string &distanceMetric, int fourierEmbedDim, float sigmaEmbed,
+                       torch::Dtype castToType, torch::Device device, bool verbose = false) {
+        torch::Tensor W;
+        float std = 1 / sigmaEmbed;
+
+        if (distanceMetric == "L1") {
+            if (verbose) std::cout << "Using Cauchy distribution" << std::endl;
+            auto uniform = torch::rand({fourierEmbedDim, d}, torch::TensorOptions().device(device));
+            W = ((1 / 2) * (std * std)) * torch::tan(M_PI * (uniform - 0.5)); // Cauchy
+        } else { // L2
+            if (verbose) std::cout << "Using Gaussian distribution" << std::endl;
+            W = std * torch::randn({fourierEmbedDim, d}, torch::TensorOptions().device(device)); // Gaussian
+        }
+
+        return W.to(castToType);
+    }
+
+    // Default tiles of the blocked Fourier embedding, rows of X by dimensions of the embedding
+    inline constexpr int EMBED_ROW_TILE = 16384;
+    inline constexpr int EMBED_DIM_TILE = 256;
+
+    /**
+     * Projections of the Fourier embedding of X, i.e. [cos(XW^T), sin(XW^T)] Y, computed in tiles of rows of X and of
+     * dimensions of the embedding. The (2 * fourierEmbedDim, n) embedding is never materialised, each tile's cos/sin
+     * is accumulated straight into the projections. Beyond the result, memory is two tiles, independent of n
+     *
+     * @param X the dataset, shape (n, d)
+     * @param W the embedding matrix, shape (fourierEmbedDim, d)
+     * @param Y the random vectors, shape (2 * fourierEmbedDim, D), the cos rows then the sin rows
+     * @param rowTile rows of X per tile
+     * @param dimTile dimensions of the embedding per tile
+     * @return the projections, shape (n, D)
+     */
+    inline torch::Tensor embedAndProject(const torch::Tensor &X, const torch::Tensor &W, const torch::Tensor &Y,
+                                         int rowTile = EMBED_ROW_TILE, int dimTile = EMBED_DIM_TILE) {
+        int n = X.size(0);
+        int F = W.size(0);
+
+        auto projections = torch::empty({n, Y.size(1)}, Y.options());
+
+        for (int i = 0; i < n; i += rowTile) {
+            auto XTile = X.slice(0, i, std::min(i + rowTile, n));
+            auto projectionsTile = projections.slice(0, i, i + XTile.size(0));
+            projectionsTile.zero_();
+
+            for (int f = 0; f < F; f += dimTile) {
+                int fEnd = std::min(f + dimTile, F);
+                auto WXTile = torch::matmul(XTile, W.slice(0, f, fEnd).t()); // Shape (tileRows, tileDims)
+                projectionsTile.addmm_(torch::cos(WXTile), Y.slice(0, f, fEnd));
+                projectionsTile.addmm_(WXTile.sin_(), Y.slice(0, F + f, F + fEnd));
+            }
+        }
+
+        return projections;
+    }
+
+    /**
+     * Same as embedAndProject, with the structured projections (see hadamardProject). These mix all dimensions of the
+     * embedding, so tiles only split the rows
+     */
+    inline torch::Tensor
+    embedAndProjectHadamard(const torch::Tensor &X, const torch::Tensor &W, const torch::Tensor &signs, int D,
+                            int rowTile = EMBED_ROW_TILE) {
+        int n = X.size(0);
+
+        auto projections = torch::empty({n, D}, X.options());
+
+        for (int i = 0; i < n; i += rowTile) {
+            auto XTile = X.slice(0, i, std::min(i + rowTile, n));
+            auto WXTile = torch::matmul(XTile, W.t()); // Shape (tileRows, fourierEmbedDim)
+            auto XEmbedTile = torch::cat({torch::cos(WXTile), WXTile.sin_()}, 1);
+            projections.slice(0, i, i + XTile.size(0)).copy_(hadamardProject(XEmbedTile, signs, D));
+        }
+
+        return projections;
+    }
+
+    /**
+     * The dtype the projections of X are computed in (and Y and W are created in). Torch's 16-bit CPU matmuls are slow
+     * or convert whole operands, so 16-bit CPU datasets are projected in float, see projectDataset. So are 8-bit
+     * datasets, whatever the device
+     */
+    inline torch::Dtype projectionDType(const torch::Tensor &X) {
+        bool is16Bit = X.scalar_type() == torch::kFloat16 || X.scalar_type() == torch::kBFloat16;
+        return (X.is_cpu() && is16Bit) || is8Bit(X) ? torch::kFloat32 : X.scalar_type();
+    }
+
     inline torch::Tensor
     projectDataset(torch::Tensor &X, int D, const std::string &distanceMetric = "L2", int fourierEmbedDim = 1024,
-                   float sigmaEmbed = 1, opt <torch::Tensor> Y = std::nullopt, bool verbose = false) {
+                   float sigmaEmbed = 1, opt <torch::Tensor> Y = std::nullopt, bool verbose = false,
+                   opt <torch::Tensor> W = std::nullopt, const std::string &projectionType = "gaussian",
+                   int rowTile = EMBED_ROW_TILE) {
         int d = X.size(1);
         torch::Tensor projections;
 
         if (!Y.has_value()) {
-            Y = getRandomVectorsMatrix(d, D, distanceMetric, fourierEmbedDim, X.scalar_type());
+            Y = getRandomVectorsMatrix(d, D, distanceMetric, fourierEmbedDim, projectionDType(X), X.device(),
+                                       projectionType);
         }
 
-        if (distanceMetric == "L1" || distanceMetric == "L2") {
-            if (verbose) std::cout << "Embedding vectors" << std::endl;
-
-            torch::Tensor W;
-            float std = 1 / sigmaEmbed;
+        bool isEmbedded = distanceMetric == "L1" || distanceMetric == "L2";
+        if (isEmbedded && !W.has_value()) {
+            W = getEmbeddingMatrix(d, distanceMetric, fourierEmbedDim, sigmaEmbed, projectionDType(X), X.device(),
+                                   verbose);
+        }
 
-            if (distanceMetric == "L1") {
-                if (verbose) std::cout << "Using Cauchy distribution" << std::endl;
-                auto uniform = torch::rand({fourierEmbedDim, d}, torch::TensorOptions().device(X.device()));
-                W = ((1 / 2) * (std * std)) * torch::tan(M_PI * (uniform - 0.5)); // Cauchy
-            } else { // L2
-                if (verbose) std::cout << "Using Gaussian distribution" << std::endl;
-                W = std * torch::randn({fourierEmbedDim, d}, torch::TensorOptions().device(X.device())); // Gaussian
+        if (X.scalar_type() != projectionDType(X)) {
+            // Widen a tile of rows at a time, the dataset itself stays in 16 (or 8) bits
+            int n = X.size(0);
+            projections = torch::empty({n, D}, torch::TensorOptions().dtype(projectionDType(X)).device(X.device()));
+            for (int i = 0; i < n; i += rowTile) {
+                auto thisX = X.slice(0, i, std::min(i + rowTile, n)).to(projectionDType(X));
+                if (is8Bit(X) && distanceMetric == "COSINE") {
+                    // Clamped, so an all zero row stays zero instead of NaN (its similarities are 0, see simd::cosine)
+                    thisX = thisX / torch::linalg_vector_norm(thisX, 2, 1).clamp_min(1e-12).unsqueeze(1);
+                }
+                projections.slice(0, i, i + thisX.size(0)).copy_(
+                        projectDataset(thisX, D, distanceMetric, fourierEmbedDim, sigmaEmbed, Y, verbose, W,
+                                       projectionType, rowTile));
             }
+            return projections;
+        }
 
-            W = W.to(X.scalar_type());
-
-            // TODO this line fails for very large N~10^7
-            auto WX = torch::matmul(W, X.t()); // Shape (fourierEmbedDim, n)
-            auto XEmbed = torch::concat({torch::cos(WX), torch::sin(WX)}, 0); // Shape (2 * fourierEmbedDim, n)
+        if (isEmbedded) {
+            if (verbose) std::cout << "Embedding vectors" << std::endl;
 
-            projections = torch::matmul(XEmbed.t(), Y.value());
+            if (projectionType == "hadamard") {
+                projections = embedAndProjectHadamard(X, W.value(), Y.value(), D, rowTile);
+            } else {
+                projections = embedAndProject(X, W.value(), Y.value(), rowTile);
+            }
 
         } else if (distanceMetric == "COSINE") {
-            projections = torch::matmul(X, Y.value());
+            if (projectionType == "hadamard") {
+                projections = hadamardProject(X, Y.value(), D);
+            } else {
+                projections = torch::matmul(X, Y.value());
+            }
 
         } else {
             throw std::runtime_error("Unknown distanceMetric: '" + distanceMetric + "'");
@@ -170,50 +545,330 @@ namespace GsDBSCAN::projections {
     }
 
 
+    /**
+     * Running selection of the m smallest and m largest values of each column of the projections, fed one row block at
+     * a time, so the B matrix can be built without ever holding (or sorting) a whole column
+     *
+     * On the CPU each column keeps a candidate list per side, appending the values that beat its current m-th value and
+     * shrinking back to m once it doubles. On the GPU the block's own extremes (from topk) are merged with the running
+     * ones by another topk. Ties are broken like a stable ascending argsort on the CPU only
+     */
+    class ColumnExtremes {
+    private:
+        int m;
+        int D;
+        bool isCpu;
+
+        // CPU, per column (value, row index) candidates and the value a new row must beat to be one
+        std::vector<std::vector<std::pair<float, int>>> lowCandidates, highCandidates;
+        std::vector<float> lowThresholds, highThresholds;
+
+        // GPU, the running extremes with shape (<= m, D), the low side ascending and the high side descending
+        torch::Tensor lowVals, lowIdx, highVals, highIdx;
+
+        static bool ascending(const std::pair<float, int> &a, const std::pair<float, int> &b) {
+            return a.first < b.first || (a.first == b.first && a.second < b.second);
+        }
+
+        static bool descending(const std::pair<float, int> &a, const std::pair<float, int> &b) {
+            return ascending(b, a);
+        }
+
+        template<typename Compare>
+        void shrink(std::vector<std::pair<float, int>> &candidates, float &threshold, Compare compare) {
+            std::nth_element(candidates.begin(), candidates.begin() + m - 1, candidates.end(), compare);
+            candidates.resize(m);
+            threshold = candidates[m - 1].first;
+        }
+
+        void mergeTorch(torch::Tensor &vals, torch::Tensor &idx, const torch::Tensor &blockVals,
+                        const torch::Tensor &blockIdx, bool largest) {
+            if (!vals.defined()) {
+                vals = blockVals;
+                idx = blockIdx;
+                return;
+            }
+            auto allVals = torch::cat({vals, blockVals}, 0);
+            auto allIdx = torch::cat({idx, blockIdx}, 0);
+            auto [topVals, topPos] = allVals.topk(std::min(m, (int) allVals.size(0)), 0, largest, true);
+            vals = topVals;
+            idx = allIdx.gather(0, topPos);
+        }
+
+    public:
+        ColumnExtremes(int m, int D, torch::Device device) : m(m), D(D), isCpu(device.is_cpu()) {
+            if (isCpu) {
+                lowCandidates.resize(D);
+                highCandidates.resize(D);
+                lowThresholds.assign(D, std::numeric_limits<float>::infinity());
+                highThresholds.assign(D, -std::numeric_limits<float>::infinity());
+            }
+        }
+
+        /**
+         * Adds a block of rows of the projections
+         *
+         * @param projections the projections of the block, shape (blockSize, D)
+         * @param startIdx index of the first row of the block in the dataset
+         */
+        void add(const torch::Tensor &projections, int startIdx) {
+            int blockSize = projections.size(0);
+
+            if (!isCpu) {
+                int count = std::min(m, blockSize);
+                auto [blockLowVals, blockLowIdx] = projections.topk(count, 0, false, true);
+                auto [blockHighVals, blockHighIdx] = projections.topk(count, 0, true, true);
+                mergeTorch(lowVals, lowIdx, blockLowVals, blockLowIdx + startIdx, false);
+                mergeTorch(highVals, highIdx, blockHighVals, blockHighIdx + startIdx, true);
+                return;
+            }
+
+            auto values = toSelectableCPU(projections.t());
+            addColumnMajorCPU(values.data_ptr<float>(), blockSize, startIdx);
+        }
+
+        /**
+         * Adds a block of rows of the projections on the CPU, given column major (D, blockSize)
+         */
+        void addColumnMajorCPU(const float *values_h, int blockSize, int startIdx) {
+            #pragma omp parallel for schedule(dynamic)
+            for (int j = 0; j < D; j++) {
+                const float *column = values_h + (size_t) j * blockSize;
+                auto &low = lowCandidates[j];
+                auto &high = highCandidates[j];
+
+                for (int i = 0; i < blockSize; i++) {
+                    float v = column[i];
+                    // Earlier rows win ties on the low side and later rows on the high side, as in a stable argsort
+                    if (v < lowThresholds[j]) {
+                        low.emplace_back(v, startIdx + i);
+                        if ((int) low.size() >= 2 * m) shrink(low, lowThresholds[j], ascending);
+                    }
+                    if (v >= highThresholds[j]) {
+                        high.emplace_back(v, startIdx + i);
+                        if ((int) high.size() >= 2 * m) shrink(high, highThresholds[j], descending);
+                    }
+                }
+            }
+        }
+
+        /**
+         * Writes the B matrix from the rows added so far (at least m of them)
+         */
+        void writeBMatrix(torch::Tensor &B, bool sortDescending) {
+            if (!isCpu) {
+                // Close first, so ascending for L1/L2 and descending for COSINE, and far in the order of a sort's tail
+                auto lowAscending = lowIdx.toType(torch::kInt32).transpose(0, 1);
+                auto highAscending = highIdx.toType(torch::kInt32).flip({0}).transpose(0, 1);
+
+                auto closeIdx = sortDescending ? highAscending.flip({1}) : lowAscending;
+                auto farIdx = sortDescending ? lowAscending.flip({1}) : highAscending;
+
+                auto BRowEvenIdx = torch::arange(0, 2 * D, 2);
+                B.index_put_({BRowEvenIdx, torch::indexing::Ellipsis}, closeIdx); // Close -> close
+                B.index_put_({BRowEvenIdx + 1, torch::indexing::Ellipsis}, farIdx); // Far -> far
+                return;
+            }
+
+            writeBMatrixCPU(B.data_ptr<int>(), sortDescending);
+        }
+
+        void writeBMatrixCPU(int *B_h, bool sortDescending) {
+            #pragma omp parallel for schedule(dynamic)
+            for (int j = 0; j < D; j++) {
+                auto &low = lowCandidates[j];
+                auto &high = highCandidates[j];
+
+                if ((int) low.size() > m) shrink(low, lowThresholds[j], ascending);
+                if ((int) high.size() > m) shrink(high, highThresholds[j], descending);
+                std::sort(low.begin(), low.end(), ascending);
+                std::sort(high.begin(), high.end(), ascending);
+
+                auto &close = sortDescending ? high : low;
+                auto &far = sortDescending ? low : high;
+                int *BCloseRow = B_h + (size_t) 2 * j * m;
+                int *BFarRow = BCloseRow + m;
+                for (int l = 0; l < m; l++) {
+                    // A descending sort is the reverse of an ascending one
+                    BCloseRow[l] = close[sortDescending ? m - 1 - l : l].second; // Close -> close
+                    BFarRow[l] = far[sortDescending ? m - 1 - l : l].second; // Far -> far
+                }
+            }
+        }
+    };
+
+    /**
+     * Builds A and B in a single pass over X. Each block of ABatchSize rows is projected once, writes its rows of A,
+     * and is merged into the running extremes of every column for B. Only a block of the projections is ever held
+     *
+     * @param sketches if not null, gets the sketches of each block packed from its projections
+     */
     inline std::tuple<torch::Tensor, torch::Tensor>
-    constructABMatricesBatch(torch::Tensor &X, GsDBSCAN::GsDBSCAN_Params &params) {
+    constructABMatricesBatch(torch::Tensor &X, GsDBSCAN::GsDBSCAN_Params &params,
+                             distances::SimHashSketches *sketches = nullptr) {
 
         int n = X.size(0);
-        auto Y = getRandomVectorsMatrix(X.size(1), params.D, params.distanceMetric, params.fourierEmbedDim, X.scalar_type());
+        auto Y = getRandomVectorsMatrix(X.size(1), params.D, params.distanceMetric, params.fourierEmbedDim,
+                                        projectionDType(X), X.device(), params.projectionType);
+
+        // Every block must be embedded with the same W
+        opt <torch::Tensor> W = std::nullopt;
+        if (params.distanceMetric != "COSINE") {
+            W = getEmbeddingMatrix(X.size(1), params.distanceMetric, params.fourierEmbedDim, params.sigmaEmbed,
+                                   projectionDType(X), X.device(), params.verbose);
+        }
 
         bool sortDescending = getSortDescending(params.distanceMetric);
 
-        if (params.verbose) std::cout << "Creating A matrix" << std::endl;
-        // Construct A matrix
+        if (params.verbose) std::cout << "Creating A and B matrices" << std::endl;
+
         torch::Tensor A = torch::empty({n, 2 * params.k},
-                                       torch::TensorOptions().dtype(torch::kInt32).device(torch::kCUDA));
+                                       torch::TensorOptions().dtype(torch::kInt32).device(X.device()));
+        torch::Tensor B = torch::empty({2 * params.D, params.m},
+                                       torch::TensorOptions().dtype(torch::kInt32).device(X.device()));
+
+        ColumnExtremes BExtremes(params.m, params.D, X.device());
 
         for (int i = 0; i < n; i += params.ABatchSize) {
+            tracing::ScopedSpan batchSpan("ABBatch", {{"startIdx", i}});
             auto thisX = X.slice(0, i, std::min(i + params.ABatchSize, n));
             auto thisProjections = projectDataset(thisX, params.D, params.distanceMetric,
                                                   params.fourierEmbedDim,
-                                                  params.sigmaEmbed, Y, params.verbose);
+                                                  params.sigmaEmbed, Y, params.verbose, W, params.projectionType);
 
             constructAMatrix(thisProjections, params.k, sortDescending, A, i);
+            BExtremes.add(thisProjections, i);
+            if (sketches != nullptr) sketches->addProjections(thisProjections, i);
         }
 
-        if (params.verbose) std::cout << "A created" << std::endl;
+        {
+            tracing::ScopedSpan BSpan("writeBMatrix");
+            BExtremes.writeBMatrix(B, sortDescending);
+        }
 
-        if (params.verbose) std::cout << "Creating B matrix" << std::endl;
+        if (params.verbose) std::cout << "A and B created" << std::endl;
 
-        // Construct B matrix
-        torch::Tensor B = torch::empty({2 * params.D, params.m},
-                                       torch::TensorOptions().dtype(torch::kInt32).device(torch::kCUDA));
+        return std::make_tuple(std::ref(A), std::ref(B));
+    }
 
-        for (int j = 0; j < params.D; j += params.BBatchSize) {
-            auto thisY = Y.slice(1, j, std::min(j + params.BBatchSize, params.D));
+    // Random projections the Morton order of the dataset is taken over, more of them spread the bits of the key thinner
+    inline constexpr int MORTON_PROJECTIONS = 3;
+
+    /**
+     * Interleaves the keys of the projections, bit b of projection p goes to bit b * numProjections + p
+     */
+    inline uint64_t interleaveBits(const uint64_t *keys, int numProjections, int bitsPerProjection) {
+        uint64_t code = 0;
+        for (int b = 0; b < bitsPerProjection; b++) {
+            for (int p = 0; p < numProjections; p++) {
+                code |= ((keys[p] >> b) & 1) << (b * numProjections + p);
+            }
+        }
+        return code;
+    }
 
-            // TODO should this be projecting across the entire dataset - why don't we adjust for the batch size? - giving params.D here, not params.BBatchSize
-            auto thisProjections = projectDataset(X, params.BBatchSize, params.distanceMetric,
-                                                  params.fourierEmbedDim,
-                                                  params.sigmaEmbed, thisY);
+    /**
+     * Orders points by their projections, quantised then either taken as is (a single projection) or interleaved into a
+     * Z order curve. The keys are packed with the point index and radix sorted
+     *
+     * @param projections host array of the projections, row major with shape (n, numProjections)
+     * @param numProjections at most MORTON_PROJECTIONS
+     * @return the permutation, the point at position i of the order is permutation[i]
+     */
+    inline std::vector<int64_t> localityOrderFromProjections(const float *projections, int n, int numProjections) {
+        // The key takes the bits the index doesn't need, at most the precision of a float per projection
+        int indexBits = 1;
+        while (indexBits < 63 && ((uint64_t) 1 << indexBits) < (uint64_t) n) indexBits++;
+        int bitsPerProjection = std::min((64 - indexBits) / numProjections, 24);
+        const uint64_t maxKey = ((uint64_t) 1 << bitsPerProjection) - 1;
+
+        std::vector<float> minValues(numProjections, std::numeric_limits<float>::max());
+        std::vector<float> maxValues(numProjections, std::numeric_limits<float>::lowest());
+        for (int i = 0; i < n; i++) {
+            for (int p = 0; p < numProjections; p++) {
+                minValues[p] = std::min(minValues[p], projections[(size_t) i * numProjections + p]);
+                maxValues[p] = std::max(maxValues[p], projections[(size_t) i * numProjections + p]);
+            }
+        }
+
+        std::vector<uint64_t> keys(n);
 
-            constructBMatrix(thisProjections, params.m, sortDescending, B, j);
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            uint64_t projectionKeys[MORTON_PROJECTIONS];
+            for (int p = 0; p < numProjections; p++) {
+                float range = maxValues[p] - minValues[p];
+                float unit = range > 0 ? (projections[(size_t) i * numProjections + p] - minValues[p]) / range : 0;
+                projectionKeys[p] = std::min((uint64_t) (unit * maxKey), maxKey);
+            }
+            keys[i] = (interleaveBits(projectionKeys, numProjections, bitsPerProjection) << indexBits) | i;
         }
 
-        if (params.verbose) std::cout << "B created" << std::endl;
+        algo_utils::parallelRadixSort(keys, indexBits + numProjections * bitsPerProjection);
 
-        return std::make_tuple(std::ref(A), std::ref(B));
+        std::vector<int64_t> permutation(n);
+        const uint64_t indexMask = ((uint64_t) 1 << indexBits) - 1;
+
+        #pragma omp parallel for schedule(static)
+        for (int i = 0; i < n; i++) {
+            permutation[i] = (int64_t) (keys[i] & indexMask);
+        }
+
+        return permutation;
+    }
+
+    /**
+     * A permutation of the dataset that puts points that are likely candidates of each other close in memory, so the
+     * candidate gathers hit nearby rows. Points are ordered by a single random projection ("projection"), or by a Z
+     * order curve over MORTON_PROJECTIONS of them ("morton")
+     *
+     * @param X the (normalised) dataset, shape (n, d)
+     * @param reorder "projection" or "morton"
+     * @return the permutation, the point at position i of the reordered dataset is X[permutation[i]]
+     */
+    inline std::vector<int64_t> getLocalityOrder(const torch::Tensor &X, const std::string &reorder) {
+        int n = X.size(0);
+        int numProjections = reorder == "morton" ? MORTON_PROJECTIONS : 1;
+
+        auto Y = torch::randn({X.size(1), numProjections}, torch::TensorOptions().device(X.device()));
+        auto projections = torch::empty({n, numProjections}, torch::TensorOptions().dtype(torch::kFloat32));
+
+        for (int i = 0; i < n; i += EMBED_ROW_TILE) {
+            auto thisX = X.slice(0, i, std::min(i + EMBED_ROW_TILE, n)).to(torch::kFloat32);
+            projections.slice(0, i, i + thisX.size(0)).copy_(thisX.matmul(Y).to(torch::kCPU));
+        }
+
+        return localityOrderFromProjections(projections.data_ptr<float>(), n, numProjections);
+    }
+
+    /**
+     * The dimensions of the dataset by decreasing variance. The distances don't depend on the order of the dimensions,
+     * but the bounded eps tests (see distances::withinEpsCpu) exit earlier when the dimensions that differ most come
+     * first. The variances are accumulated in double, over tiles of rows, and centred on the first row so that
+     * E[x^2] - E[x]^2 doesn't cancel for dimensions with a large mean
+     *
+     * @param X the (normalised) dataset, shape (n, d)
+     * @return the column order, on the device of X
+     */
+    inline torch::Tensor getVarianceOrder(const torch::Tensor &X) {
+        int n = X.size(0);
+        auto options = torch::TensorOptions().dtype(torch::kFloat64).device(X.device());
+        auto sums = torch::zeros({X.size(1)}, options);
+        auto squaredSums = torch::zeros({X.size(1)}, options);
+
+        // The variance doesn't depend on the shift, shifting by a row keeps the sums on the scale of the spread
+        auto shift = X.slice(0, 0, 1).to(torch::kFloat64);
+
+        for (int i = 0; i < n; i += EMBED_ROW_TILE) {
+            auto thisX = X.slice(0, i, std::min(i + EMBED_ROW_TILE, n)).to(torch::kFloat64) - shift;
+            sums += thisX.sum(0);
+            squaredSums += (thisX * thisX).sum(0);
+        }
+
+        auto means = sums / n;
+        auto variances = squaredSums / n - means * means;
+
+        return torch::argsort(variances, 0, true);
     }
 }
 
@@ -10,6 +10,10 @@
 #include <string>
 #include <vector>
 #include <cstdint>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
 
 #include "../pch.h"
 #include "algo_utils.h"
@@ -44,50 +48,290 @@ namespace GsDBSCAN::run_utils {
         return data;
     }
 
+    /**
+     * A binary file memory mapped into the address space, unmapped on destruction
+     *
+     * Avoids the heap copy of loadBinFileToVector, pages are faulted in (from the page cache) as they are first touched.
+     * The mapping is private, so any in place writes (e.g. batch normalisation) are copy on write and never reach the file
+     *
+     * @tparam T type of the elements in the file
+     */
+    template<typename T>
+    class MappedBinFile {
+    public:
+        /**
+         * @param filePath path to the binary file
+         * @param populate whether to pre-fault the whole file (MAP_POPULATE)
+         * @param hugePages whether to advise the kernel to use (transparent) huge pages for the mapping
+         */
+        explicit MappedBinFile(const std::string &filePath, bool populate = false, bool hugePages = false) {
+            int fd = open(filePath.c_str(), O_RDONLY);
+            if (fd == -1) {
+                throw std::runtime_error("Error opening file: " + filePath);
+            }
+
+            struct stat fileStat{};
+            if (fstat(fd, &fileStat) == -1) {
+                close(fd);
+                throw std::runtime_error("Error reading the size of file: " + filePath);
+            }
+
+            fileSize = fileStat.st_size;
+
+            int flags = MAP_PRIVATE;
+            if (populate) flags |= MAP_POPULATE;
+
+            addr = mmap(nullptr, fileSize, PROT_READ | PROT_WRITE, flags, fd, 0);
+            close(fd); // The mapping keeps its own reference to the file
+
+            if (addr == MAP_FAILED) {
+                throw std::runtime_error("Error memory mapping file: " + filePath);
+            }
+
+            if (hugePages) madvise(addr, fileSize, MADV_HUGEPAGE);
+            if (!populate) madvise(addr, fileSize, MADV_WILLNEED); // Start readahead while we set up
+        }
+
+        ~MappedBinFile() {
+            if (addr != MAP_FAILED) munmap(addr, fileSize);
+        }
+
+        MappedBinFile(const MappedBinFile &) = delete;
+
+        MappedBinFile &operator=(const MappedBinFile &) = delete;
+
+        T *data() const {
+            return static_cast<T *>(addr);
+        }
+
+        size_t size() const {
+            return fileSize / sizeof(T);
+        }
+
+    private:
+        void *addr = MAP_FAILED;
+        size_t fileSize = 0;
+    };
+
     template<typename T>
     inline std::vector<T> loadCsvColumnToVector(const std::string &filePath, size_t columnIndex = 1) {
         rapidcsv::Document csvDoc(filePath);
         return csvDoc.GetColumn<T>(columnIndex);
     }
 
+    /**
+     * Writes an int32 array as a raw little endian binary file, straight from the given buffer
+     */
+    inline void writeBinInt32(const std::string &filePath, const int *data, size_t n) {
+        std::ofstream file(filePath, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Error: Unable to open file: " + filePath);
+        }
+        file.write(reinterpret_cast<const char *>(data), n * sizeof(int));
+    }
+
+    /**
+     * Writes an int32 array as a 1D .npy (v1.0) file, straight from the given buffer
+     */
+    inline void writeNpyInt32(const std::string &filePath, const int *data, size_t n) {
+        std::ofstream file(filePath, std::ios::binary);
+        if (!file.is_open()) {
+            throw std::runtime_error("Error: Unable to open file: " + filePath);
+        }
+
+        std::string header = "{'descr': '<i4', 'fortran_order': False, 'shape': (" + std::to_string(n) + ",), }";
+
+        // Magic (6) + version (2) + header length (2) + header + '\n' must be a multiple of 64
+        size_t preambleSize = 10;
+        size_t padding = 64 - (preambleSize + header.size() + 1) % 64;
+        header += std::string(padding % 64, ' ') + "\n";
+
+        auto headerSize = static_cast<uint16_t>(header.size());
+
+        file.write("\x93NUMPY", 6);
+        file.put(1);
+        file.put(0);
+        file.put(static_cast<char>(headerSize & 0xFF));
+        file.put(static_cast<char>(headerSize >> 8));
+        file << header;
+        file.write(reinterpret_cast<const char *>(data), n * sizeof(int));
+    }
+
+    /**
+     * Adds the labels to a result JSON object, either inline or, for the npy/bin output formats, as files next to the
+     * output file (named <outputFilename><suffix>.clusterLabels.<format> etc.)
+     */
+    inline void
+    addLabelsToResult(json &combined, GsDBSCAN_Params &params, int *clusterLabels, int *typeLabels,
+                      const std::string &suffix = "") {
+        if (params.outputFormat == "json") {
+            std::vector<int> clusterLabelsVec(clusterLabels, clusterLabels + (size_t) params.n);
+            combined["clusterLabels"] = clusterLabelsVec;
+        } else {
+            // Keep the JSON small, and stream the labels to their own files
+            std::string clusterLabelsFilename = params.outputFilename + suffix + ".clusterLabels." + params.outputFormat;
+            std::string typeLabelsFilename = params.outputFilename + suffix + ".typeLabels." + params.outputFormat;
+
+            auto writeLabels = params.outputFormat == "npy" ? writeNpyInt32 : writeBinInt32;
+
+            writeLabels(clusterLabelsFilename, clusterLabels, params.n);
+            if (typeLabels != nullptr) {
+                writeLabels(typeLabelsFilename, typeLabels, params.n);
+                combined["typeLabelsFilename"] = typeLabelsFilename;
+            }
+
+            combined["clusterLabelsFilename"] = clusterLabelsFilename;
+            combined["labelsDType"] = "int32";
+            combined["n"] = params.n;
+        }
+    }
+
+    inline void writeResultsJson(const std::string &filename, const json &result) {
+        std::ofstream file(filename);
+
+        if (file.is_open()) {
+            file << result.dump(4);
+            file.close();
+        } else {
+            throw std::runtime_error("Error: Unable to open file: " + filename);
+        }
+    }
+
     inline void
-    writeResults(GsDBSCAN_Params params, nlohmann::ordered_json &times, int *clusterLabels, int numClusters) {
-        std::ofstream file(params.outputFilename);
+    writeResults(GsDBSCAN_Params params, nlohmann::ordered_json &times, int *clusterLabels, int *typeLabels,
+                 int numClusters, const nlohmann::ordered_json &batchPlan = nullptr) {
         json combined;
         combined["args"] = params.toString();
         combined["times"] = times;
-
-        std::vector<int> clusterLabelsVec(clusterLabels, clusterLabels + (size_t) params.n);
         combined["numClusters"] = numClusters;
-        combined["clusterLabels"] = clusterLabelsVec;
+
+        if (!batchPlan.is_null()) {
+            combined["batchPlan"] = batchPlan;
+        }
+
+        addLabelsToResult(combined, params, clusterLabels, typeLabels);
 
         json result = json::array(); // Array of JSON objects, so Pandas can read it
         result.push_back(combined);
 
-        if (file.is_open()) {
-            file << result.dump(4);
-            file.close();
+        writeResultsJson(params.outputFilename, result);
+
+        delete[] clusterLabels;
+        delete[] typeLabels;
+    }
+
+    /**
+     * Writes the results of a sweep to a single output file, one JSON object per (eps, minPts) config. The times of the
+     * shared stages are repeated in each object as sharedTimes
+     */
+    inline void
+    writeSweepResults(GsDBSCAN_Params params, nlohmann::ordered_json &sharedTimes, std::vector<SweepResult> &results,
+                      const nlohmann::ordered_json &batchPlan = nullptr) {
+        json result = json::array(); // Array of JSON objects, so Pandas can read it
+
+        for (size_t i = 0; i < results.size(); i++) {
+            auto &configResult = results[i];
+
+            json combined;
+            combined["args"] = params.toString();
+            combined["configIdx"] = i;
+            combined["eps"] = configResult.eps;
+            combined["minPts"] = configResult.minPts;
+            combined["sharedTimes"] = sharedTimes;
+            combined["times"] = configResult.times;
+            combined["numClusters"] = configResult.numClusters;
+
+            if (!batchPlan.is_null()) {
+                combined["batchPlan"] = batchPlan;
+            }
+
+            addLabelsToResult(combined, params, configResult.clusterLabels, configResult.typeLabels,
+                              "." + std::to_string(i));
+
+            result.push_back(combined);
+
+            delete[] configResult.clusterLabels;
+            delete[] configResult.typeLabels;
+            configResult.clusterLabels = nullptr;
+            configResult.typeLabels = nullptr;
+        }
+
+        writeResultsJson(params.outputFilename, result);
+    }
+
+
+    /**
+     * Loads the dataset (memory mapped, or read into memory) and calls perform with a pointer to it
+     */
+    template<typename XType, typename F>
+    inline auto withDataset(GsDBSCAN_Params &params, F &&perform) {
+        size_t expectedSize = (size_t) params.n * params.d;
+
+        if (params.useMmap) {
+            MappedBinFile<XType> X(params.dataFilename, params.mmapPopulate, params.mmapHugePages);
+            if (X.size() < expectedSize) {
+                throw std::runtime_error("Dataset file is smaller than n * d: " + params.dataFilename);
+            }
+            return perform(X.data());
         } else {
-            throw std::runtime_error("Error: Unable to open file: " + (std::string) params.outputFilename);
+            auto X = loadBinFileToVector<XType>(params.dataFilename);
+            if (X.size() < expectedSize) {
+                throw std::runtime_error("Dataset file is smaller than n * d: " + params.dataFilename);
+            }
+            return perform(X.data());
         }
+    }
 
-        delete[] clusterLabels;
+    template<typename XType, typename torch::Dtype TorchType>
+    inline std::tuple<int *, int *, int, nlohmann::ordered_json>
+    loadAndPerformGsDbscan(GsDBSCAN_Params &params) {
+        return withDataset<XType>(params, [&](XType *X) {
+            return performGsDbscan<XType, TorchType>(X, params);
+        });
     }
 
+    template<typename XType, typename torch::Dtype TorchType>
+    inline std::tuple<std::vector<SweepResult>, nlohmann::ordered_json>
+    loadAndPerformGsDbscanSweep(GsDBSCAN_Params &params) {
+        return withDataset<XType>(params, [&](XType *X) {
+            return performGsDbscanSweep<XType, TorchType>(X, params);
+        });
+    }
 
-    inline std::tuple<int *, int, nlohmann::ordered_json>
+    inline std::tuple<int *, int *, int, nlohmann::ordered_json>
     main_helper(GsDBSCAN_Params & params) {
-        assert(params.datasetDType == "f16" || params.datasetDType == "f32");
+        assert(params.datasetDType == "f16" || params.datasetDType == "bf16" || params.datasetDType == "f32" ||
+               params.datasetDType == "u8" || params.datasetDType == "i8");
+
+        if (params.datasetDType == "f16") {
+            // Use uint16_t for f16 and bf16, as it can be reinterpreted as float16 or bfloat16 by Torch
+            return loadAndPerformGsDbscan<uint16_t, torch::kFloat16>(params);
+        } else if (params.datasetDType == "bf16") {
+            return loadAndPerformGsDbscan<uint16_t, torch::kBFloat16>(params);
+        } else if (params.datasetDType == "u8") {
+            return loadAndPerformGsDbscan<uint8_t, torch::kUInt8>(params);
+        } else if (params.datasetDType == "i8") {
+            return loadAndPerformGsDbscan<int8_t, torch::kInt8>(params);
+        } else {
+            return loadAndPerformGsDbscan<float, torch::kFloat32>(params);
+        }
+    }
+
+    inline std::tuple<std::vector<SweepResult>, nlohmann::ordered_json>
+    sweep_main_helper(GsDBSCAN_Params & params) {
+        assert(params.datasetDType == "f16" || params.datasetDType == "bf16" || params.datasetDType == "f32" ||
+               params.datasetDType == "u8" || params.datasetDType == "i8");
 
         if (params.datasetDType == "f16") {
-            auto X = loadBinFileToVector<uint16_t>(params.dataFilename);
-            auto X_h = X.data();
-            // Use uint16_t for f16, as it can be reinterpreted as float16 by Torch
-            return performGsDbscan<uint16_t, torch::kFloat16>(X_h, params);
+            return loadAndPerformGsDbscanSweep<uint16_t, torch::kFloat16>(params);
+        } else if (params.datasetDType == "bf16") {
+            return loadAndPerformGsDbscanSweep<uint16_t, torch::kBFloat16>(params);
+        } else if (params.datasetDType == "u8") {
+            return loadAndPerformGsDbscanSweep<uint8_t, torch::kUInt8>(params);
+        } else if (params.datasetDType == "i8") {
+            return loadAndPerformGsDbscanSweep<int8_t, torch::kInt8>(params);
         } else {
-            auto X = loadBinFileToVector<float>(params.dataFilename);
-            auto X_h = X.data();
-            return performGsDbscan<float, torch::kFloat32>(X_h, params);
+            return loadAndPerformGsDbscanSweep<float, torch::kFloat32>(params);
         }
     }
 }
@@ -0,0 +1,367 @@
+//
+// Vectorised reductions over pairs of vectors for the CPU distance kernels, AVX-512 or AVX2 (picked at compile time,
+// see GS_DBSCAN_NATIVE_ARCH in CMakeLists.txt) with a scalar fallback. f16, bf16 and 8-bit integer vectors are
+// widened to f32 in registers, every reduction accumulates in f32
+//
+
+#ifndef SDBSCAN_SIMD_H
+#define SDBSCAN_SIMD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <type_traits>
+#include "../pch.h"
+
+#if !defined(__CUDA_ARCH__) && (defined(__AVX512F__) || (defined(__AVX2__) && defined(__FMA__)))
+#include <immintrin.h>
+#endif
+
+#if !defined(__CUDA_ARCH__) && defined(__AVX512F__)
+#define GS_DBSCAN_AVX512
+#elif !defined(__CUDA_ARCH__) && defined(__AVX2__) && defined(__FMA__)
+#define GS_DBSCAN_AVX2
+#endif
+
+namespace GsDBSCAN::simd {
+
+    /**
+     * The reduction of a pair of vectors x, y
+     */
+    enum class Reduction {
+        L1, // sum |x - y|
+        SquaredL2, // sum (x - y)^2
+        Dot // sum x * y
+    };
+
+    // Candidate rows are prefetched this many candidates ahead, up to PREFETCH_MAX_BYTES of each row (the hardware
+    // prefetcher picks up the rest of a long row once it is being read)
+    inline constexpr int PREFETCH_DISTANCE = 4;
+    inline constexpr int PREFETCH_MAX_BYTES = 512;
+
+    // Bounded reductions check their partial sum every this many dimensions, a multiple of the widest unrolled step
+    inline constexpr int BOUND_CHECK_DIMS = 64;
+
+    inline const char *instructionSet() {
+#if defined(GS_DBSCAN_AVX512)
+        return "avx512";
+#elif defined(GS_DBSCAN_AVX2)
+        return "avx2";
+#else
+        return "scalar";
+#endif
+    }
+
+    template<typename T>
+    inline void prefetchRow(const T *row, int d) {
+        const char *bytes = reinterpret_cast<const char *>(row);
+        int numBytes = std::min((int) (d * sizeof(T)), PREFETCH_MAX_BYTES);
+        for (int offset = 0; offset < numBytes; offset += 64) {
+            __builtin_prefetch(bytes + offset, 0, 3);
+        }
+    }
+
+    template<Reduction R>
+    inline float reduceScalar(float acc, float xt, float yt) {
+        if constexpr (R == Reduction::L1) {
+            return acc + std::fabs(xt - yt);
+        } else if constexpr (R == Reduction::SquaredL2) {
+            return acc + (xt - yt) * (xt - yt);
+        } else {
+            return acc + xt * yt;
+        }
+    }
+
+#if defined(GS_DBSCAN_AVX512)
+
+    template<Reduction R>
+    inline __m512 step(__m512 acc, __m512 x, __m512 y) {
+        if constexpr (R == Reduction::L1) {
+            return _mm512_add_ps(acc, _mm512_abs_ps(_mm512_sub_ps(x, y)));
+        } else if constexpr (R == Reduction::SquaredL2) {
+            __m512 diff = _mm512_sub_ps(x, y);
+            return _mm512_fmadd_ps(diff, diff, acc);
+        } else {
+            return _mm512_fmadd_ps(x, y, acc);
+        }
+    }
+
+    template<typename T>
+    inline __m512 load16(const T *p) {
+        if constexpr (std::is_same_v<T, float>) {
+            return _mm512_loadu_ps(p);
+        } else if constexpr (std::is_same_v<T, uint8_t>) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepu8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))));
+        } else if constexpr (std::is_same_v<T, int8_t>) {
+            return _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p))));
+        } else if constexpr (std::is_same_v<T, at::BFloat16>) {
+            // bf16 is the top half of an f32
+            __m512i widened = _mm512_cvtepu16_epi32(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+            return _mm512_castsi512_ps(_mm512_slli_epi32(widened, 16));
+        } else {
+            return _mm512_cvtph_ps(_mm256_loadu_si256(reinterpret_cast<const __m256i *>(p)));
+        }
+    }
+
+    constexpr int LANES = 16;
+
+#elif defined(GS_DBSCAN_AVX2)
+
+    template<Reduction R>
+    inline __m256 step(__m256 acc, __m256 x, __m256 y) {
+        if constexpr (R == Reduction::L1) {
+            const __m256 absMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x7fffffff));
+            return _mm256_add_ps(acc, _mm256_and_ps(_mm256_sub_ps(x, y), absMask));
+        } else if constexpr (R == Reduction::SquaredL2) {
+            __m256 diff = _mm256_sub_ps(x, y);
+            return _mm256_fmadd_ps(diff, diff, acc);
+        } else {
+            return _mm256_fmadd_ps(x, y, acc);
+        }
+    }
+
+    template<typename T>
+    inline __m256 load8(const T *p) {
+        if constexpr (std::is_same_v<T, float>) {
+            return _mm256_loadu_ps(p);
+        } else if constexpr (std::is_same_v<T, uint8_t>) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+        } else if constexpr (std::is_same_v<T, int8_t>) {
+            return _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_loadl_epi64(reinterpret_cast<const __m128i *>(p))));
+        } else if constexpr (std::is_same_v<T, at::BFloat16>) {
+            __m256i widened = _mm256_cvtepu16_epi32(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+            return _mm256_castsi256_ps(_mm256_slli_epi32(widened, 16));
+        } else {
+#if defined(__F16C__)
+            return _mm256_cvtph_ps(_mm_loadu_si128(reinterpret_cast<const __m128i *>(p)));
+#endif
+        }
+    }
+
+    inline float horizontalSum(__m256 v) {
+        __m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+        sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+        sum = _mm_add_ss(sum, _mm_movehdup_ps(sum));
+        return _mm_cvtss_f32(sum);
+    }
+
+    constexpr int LANES = 8;
+
+#endif
+
+    /**
+     * Whether reduce has a vectorised path for T, i.e. float, bf16, uint8, int8, or half with F16C (implied by AVX-512)
+     */
+    template<typename T>
+    constexpr bool isVectorised() {
+        constexpr bool isWidenedByShifts = std::is_same_v<T, float> || std::is_same_v<T, at::BFloat16> ||
+                                           std::is_same_v<T, uint8_t> || std::is_same_v<T, int8_t>;
+#if defined(GS_DBSCAN_AVX512)
+        return isWidenedByShifts || std::is_same_v<T, at::Half>;
+#elif defined(GS_DBSCAN_AVX2) && defined(__F16C__)
+        return isWidenedByShifts || std::is_same_v<T, at::Half>;
+#elif defined(GS_DBSCAN_AVX2)
+        return isWidenedByShifts;
+#else
+        return false;
+#endif
+    }
+
+    /**
+     * Reduces a pair of vectors of dimension d, accumulating in float. Two independent accumulators hide the latency
+     * of the FMAs. bf16 dot products use AVX-512 BF16 (dpbf16, pairs of products straight into f32) when available
+     */
+    template<Reduction R, typename T>
+    inline float reduce(const T *x, const T *y, int d) {
+        int t = 0;
+        float acc = 0;
+
+#if defined(GS_DBSCAN_AVX512)
+        if constexpr (isVectorised<T>()) {
+            __m512 acc0 = _mm512_setzero_ps();
+            __m512 acc1 = _mm512_setzero_ps();
+#if defined(__AVX512BF16__)
+            if constexpr (R == Reduction::Dot && std::is_same_v<T, at::BFloat16>) {
+                for (; t + 2 * LANES <= d; t += 2 * LANES) {
+                    acc0 = _mm512_dpbf16_ps(acc0, (__m512bh) _mm512_loadu_si512(x + t),
+                                            (__m512bh) _mm512_loadu_si512(y + t));
+                }
+            }
+#endif
+            for (; t + 2 * LANES <= d; t += 2 * LANES) {
+                acc0 = step<R>(acc0, load16(x + t), load16(y + t));
+                acc1 = step<R>(acc1, load16(x + t + LANES), load16(y + t + LANES));
+            }
+            for (; t + LANES <= d; t += LANES) {
+                acc0 = step<R>(acc0, load16(x + t), load16(y + t));
+            }
+            if constexpr (std::is_same_v<T, float>) {
+                if (t < d) {
+                    __mmask16 mask = (__mmask16) ((1u << (d - t)) - 1);
+                    acc1 = step<R>(acc1, _mm512_maskz_loadu_ps(mask, x + t), _mm512_maskz_loadu_ps(mask, y + t));
+                    t = d;
+                }
+            }
+            acc = _mm512_reduce_add_ps(_mm512_add_ps(acc0, acc1));
+        }
+#elif defined(GS_DBSCAN_AVX2)
+        if constexpr (isVectorised<T>()) {
+            __m256 acc0 = _mm256_setzero_ps();
+            __m256 acc1 = _mm256_setzero_ps();
+            for (; t + 2 * LANES <= d; t += 2 * LANES) {
+                acc0 = step<R>(acc0, load8(x + t), load8(y + t));
+                acc1 = step<R>(acc1, load8(x + t + LANES), load8(y + t + LANES));
+            }
+            for (; t + LANES <= d; t += LANES) {
+                acc0 = step<R>(acc0, load8(x + t), load8(y + t));
+            }
+            acc = horizontalSum(_mm256_add_ps(acc0, acc1));
+        }
+#endif
+
+        for (; t < d; t++) {
+            acc = reduceScalar<R>(acc, static_cast<float>(x[t]), static_cast<float>(y[t]));
+        }
+
+        return acc;
+    }
+
+    /**
+     * Same as reduce for the reductions with non negative terms (L1, SquaredL2), but stops once the partial sum
+     * reaches bound, as the full sum can only be larger. The result is only exact below the bound
+     */
+    template<Reduction R, typename T>
+    inline float reduceBounded(const T *x, const T *y, int d, float bound) {
+        static_assert(R != Reduction::Dot, "Partial dot products are not bounded");
+
+        float acc = 0;
+        for (int t = 0; t < d; t += BOUND_CHECK_DIMS) {
+            acc += reduce<R>(x + t, y + t, std::min(BOUND_CHECK_DIMS, d - t));
+            if (acc >= bound) break;
+        }
+        return acc;
+    }
+
+    /**
+     * Cosine similarity of a pair of vectors of dimension d, i.e. their dot product over the product of their norms,
+     * in a single pass with an accumulator per sum. 0 if either vector is zero, as if its norm was clamped
+     */
+    template<typename T>
+    inline float cosine(const T *x, const T *y, int d) {
+        int t = 0;
+        float xy = 0, xx = 0, yy = 0;
+
+#if defined(GS_DBSCAN_AVX512)
+        if constexpr (isVectorised<T>()) {
+            __m512 xyAcc = _mm512_setzero_ps();
+            __m512 xxAcc = _mm512_setzero_ps();
+            __m512 yyAcc = _mm512_setzero_ps();
+            for (; t + LANES <= d; t += LANES) {
+                __m512 xt = load16(x + t);
+                __m512 yt = load16(y + t);
+                xyAcc = _mm512_fmadd_ps(xt, yt, xyAcc);
+                xxAcc = _mm512_fmadd_ps(xt, xt, xxAcc);
+                yyAcc = _mm512_fmadd_ps(yt, yt, yyAcc);
+            }
+            xy = _mm512_reduce_add_ps(xyAcc);
+            xx = _mm512_reduce_add_ps(xxAcc);
+            yy = _mm512_reduce_add_ps(yyAcc);
+        }
+#elif defined(GS_DBSCAN_AVX2)
+        if constexpr (isVectorised<T>()) {
+            __m256 xyAcc = _mm256_setzero_ps();
+            __m256 xxAcc = _mm256_setzero_ps();
+            __m256 yyAcc = _mm256_setzero_ps();
+            for (; t + LANES <= d; t += LANES) {
+                __m256 xt = load8(x + t);
+                __m256 yt = load8(y + t);
+                xyAcc = _mm256_fmadd_ps(xt, yt, xyAcc);
+                xxAcc = _mm256_fmadd_ps(xt, xt, xxAcc);
+                yyAcc = _mm256_fmadd_ps(yt, yt, yyAcc);
+            }
+            xy = horizontalSum(xyAcc);
+            xx = horizontalSum(xxAcc);
+            yy = horizontalSum(yyAcc);
+        }
+#endif
+
+        for (; t < d; t++) {
+            float xt = static_cast<float>(x[t]);
+            float yt = static_cast<float>(y[t]);
+            xy += xt * yt;
+            xx += xt * xt;
+            yy += yt * yt;
+        }
+
+        float normProduct = std::sqrt(xx * yy);
+        return normProduct > 0 ? xy / normProduct : 0;
+    }
+
+    // int8 codes are symmetric, in [-INT8_CODE_MAX, INT8_CODE_MAX], so the unsigned x signed multiplies (which take
+    // |x| and y with x's sign) never overflow their 16 bit pair sums
+    inline constexpr int INT8_CODE_MAX = 127;
+
+    // Largest dimension whose int8 dot products are exact in int32
+    inline constexpr int INT8_DOT_MAX_DIM = INT32_MAX / (INT8_CODE_MAX * INT8_CODE_MAX);
+
+#if defined(GS_DBSCAN_AVX512) || defined(GS_DBSCAN_AVX2)
+    inline int32_t horizontalSumInt32(__m256i v) {
+        __m128i sum = _mm_add_epi32(_mm256_castsi256_si128(v), _mm256_extracti128_si256(v, 1));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(1, 0, 3, 2)));
+        sum = _mm_add_epi32(sum, _mm_shuffle_epi32(sum, _MM_SHUFFLE(2, 3, 0, 1)));
+        return _mm_cvtsi128_si32(sum);
+    }
+#endif
+
+    /**
+     * Dot product of two vectors of int8 codes (see INT8_CODE_MAX) of dimension d, exact for d <= INT8_DOT_MAX_DIM.
+     * Uses VNNI when available (dpbusd), otherwise maddubs then madd
+     */
+    inline int32_t dotInt8(const int8_t *x, const int8_t *y, int d) {
+        int t = 0;
+        int32_t acc = 0;
+
+#if defined(GS_DBSCAN_AVX512) && defined(__AVX512BW__)
+        {
+            __m512i acc512 = _mm512_setzero_si512();
+#if !defined(__AVX512VNNI__)
+            const __m512i ones = _mm512_set1_epi16(1);
+#endif
+            for (; t + 64 <= d; t += 64) {
+                __m512i xv = _mm512_loadu_si512(x + t);
+                __m512i yv = _mm512_loadu_si512(y + t);
+                // |x| * (y with the sign of x) = x * y
+                __m512i ysigned = _mm512_mask_sub_epi8(yv, _mm512_movepi8_mask(xv), _mm512_setzero_si512(), yv);
+#if defined(__AVX512VNNI__)
+                acc512 = _mm512_dpbusd_epi32(acc512, _mm512_abs_epi8(xv), ysigned);
+#else
+                acc512 = _mm512_add_epi32(acc512, _mm512_madd_epi16(_mm512_maddubs_epi16(_mm512_abs_epi8(xv), ysigned),
+                                                                    ones));
+#endif
+            }
+            acc = _mm512_reduce_add_epi32(acc512);
+        }
+#endif
+#if defined(GS_DBSCAN_AVX512) || defined(GS_DBSCAN_AVX2)
+        {
+            __m256i acc256 = _mm256_setzero_si256();
+            const __m256i ones = _mm256_set1_epi16(1);
+            for (; t + 32 <= d; t += 32) {
+                __m256i xv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(x + t));
+                __m256i yv = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(y + t));
+                __m256i products = _mm256_maddubs_epi16(_mm256_sign_epi8(xv, xv), _mm256_sign_epi8(yv, xv));
+                acc256 = _mm256_add_epi32(acc256, _mm256_madd_epi16(products, ones));
+            }
+            acc += horizontalSumInt32(acc256);
+        }
+#endif
+
+        for (; t < d; t++) {
+            acc += (int32_t) x[t] * (int32_t) y[t];
+        }
+
+        return acc;
+    }
+}
+
+#endif //SDBSCAN_SIMD_H
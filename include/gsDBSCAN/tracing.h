@@ -0,0 +1,201 @@
+//
+// Scoped trace spans, exported as Chrome trace JSON (viewable in Perfetto or chrome://tracing)
+//
+
+#ifndef SDBSCAN_TRACING_H
+#define SDBSCAN_TRACING_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+#include "../pch.h"
+
+namespace GsDBSCAN::tracing {
+
+    /**
+     * A finished span. Timestamps are nanoseconds since the tracer was created
+     */
+    struct TraceEvent {
+        std::string name;
+        int64_t startNs;
+        int64_t durationNs;
+        int threadId;
+        std::vector<std::pair<std::string, int64_t>> args;
+    };
+
+    /**
+     * Collects the spans of all threads. Each thread appends to its own buffer, so recording a span never takes a lock
+     * (only the first span of each thread does, to register its buffer). When disabled, spans cost a single atomic load
+     */
+    class Tracer {
+    private:
+        struct ThreadBuffer {
+            int threadId;
+            std::vector<TraceEvent> events;
+        };
+
+        std::atomic<bool> enabled{false};
+        std::chrono::steady_clock::time_point epoch = std::chrono::steady_clock::now();
+
+        // Buffers are never freed before the tracer, threads keep a pointer to theirs
+        mutable std::mutex buffersMutex;
+        std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+
+        ThreadBuffer &threadBuffer() {
+            thread_local ThreadBuffer *buffer = nullptr;
+            if (buffer == nullptr) {
+                std::lock_guard<std::mutex> lock(buffersMutex);
+                buffers.push_back(std::make_unique<ThreadBuffer>());
+                buffer = buffers.back().get();
+                buffer->threadId = (int) buffers.size() - 1;
+            }
+            return *buffer;
+        }
+
+    public:
+        static Tracer &instance() {
+            static Tracer tracer;
+            return tracer;
+        }
+
+        void setEnabled(bool isEnabled) {
+            enabled.store(isEnabled, std::memory_order_relaxed);
+        }
+
+        bool isEnabled() const {
+            return enabled.load(std::memory_order_relaxed);
+        }
+
+        int64_t nowNs() const {
+            return std::chrono::duration_cast<std::chrono::nanoseconds>(
+                    std::chrono::steady_clock::now() - epoch).count();
+        }
+
+        /**
+         * Id of the calling thread in the trace (0 for the first thread that records a span, and so on)
+         */
+        int threadId() {
+            return threadBuffer().threadId;
+        }
+
+        void record(TraceEvent &&event) {
+            threadBuffer().events.push_back(std::move(event));
+        }
+
+        /**
+         * All the recorded spans, sorted by thread then start time. Must not be called while spans are being recorded
+         */
+        std::vector<TraceEvent> events() const {
+            std::lock_guard<std::mutex> lock(buffersMutex);
+            std::vector<TraceEvent> allEvents;
+            for (const auto &buffer: buffers) {
+                allEvents.insert(allEvents.end(), buffer->events.begin(), buffer->events.end());
+            }
+            std::stable_sort(allEvents.begin(), allEvents.end(), [](const TraceEvent &a, const TraceEvent &b) {
+                return std::tie(a.threadId, a.startNs) < std::tie(b.threadId, b.startNs);
+            });
+            return allEvents;
+        }
+
+        void clear() {
+            std::lock_guard<std::mutex> lock(buffersMutex);
+            for (auto &buffer: buffers) buffer->events.clear();
+        }
+
+        /**
+         * Converts the spans to the Chrome trace event format, as complete ("X") events. Nesting is implied by the
+         * spans of a thread containing each other
+         */
+        nlohmann::ordered_json toChromeTrace() const {
+            nlohmann::ordered_json traceEvents = nlohmann::ordered_json::array();
+            auto allEvents = events();
+
+            int numThreads;
+            {
+                std::lock_guard<std::mutex> lock(buffersMutex);
+                numThreads = (int) buffers.size();
+            }
+
+            for (int i = 0; i < numThreads; i++) {
+                traceEvents.push_back({
+                        {"name", "thread_name"}, {"ph", "M"}, {"pid", 0}, {"tid", i},
+                        {"args", {{"name", i == 0 ? "main" : "worker " + std::to_string(i)}}}
+                });
+            }
+
+            for (const auto &event: allEvents) {
+                nlohmann::ordered_json traceEvent = {
+                        {"name", event.name}, {"cat", "gsDBSCAN"}, {"ph", "X"},
+                        // Chrome trace timestamps are in microseconds, fractions keep the nanoseconds
+                        {"ts", event.startNs / 1000.0}, {"dur", event.durationNs / 1000.0},
+                        {"pid", 0}, {"tid", event.threadId}
+                };
+                if (!event.args.empty()) {
+                    nlohmann::ordered_json args;
+                    for (const auto &[key, value]: event.args) args[key] = value;
+                    traceEvent["args"] = args;
+                }
+                traceEvents.push_back(traceEvent);
+            }
+
+            return {{"traceEvents", traceEvents}, {"displayTimeUnit", "ms"}};
+        }
+
+        void writeChromeTrace(const std::string &filename) const {
+            std::ofstream file(filename);
+            if (!file.is_open()) {
+                throw std::runtime_error("Unable to open trace file: " + filename);
+            }
+            file << toChromeTrace().dump();
+        }
+    };
+
+    /**
+     * Records a span from its construction to its destruction, e.g.
+     *
+     *     tracing::ScopedSpan span("distancesBatch", {{"startIdx", i}});
+     *
+     * A span can also be ended early with end(), like the au::timeNow()/au::duration() pairs it sits next to. Spans
+     * created while the tracer is disabled are never recorded
+     */
+    class ScopedSpan {
+    private:
+        bool active;
+        TraceEvent event;
+
+    public:
+        explicit ScopedSpan(std::string name, std::initializer_list<std::pair<std::string, int64_t>> args = {})
+                : active(Tracer::instance().isEnabled()) {
+            if (!active) return;
+            event.name = std::move(name);
+            event.args = args;
+            // Registers the thread now, so the thread of the outermost span gets the first id
+            event.threadId = Tracer::instance().threadId();
+            event.startNs = Tracer::instance().nowNs();
+        }
+
+        ScopedSpan(const ScopedSpan &) = delete;
+
+        ScopedSpan &operator=(const ScopedSpan &) = delete;
+
+        void end() {
+            if (!active) return;
+            active = false;
+            auto &tracer = Tracer::instance();
+            event.durationNs = tracer.nowNs() - event.startNs;
+            tracer.record(std::move(event));
+        }
+
+        ~ScopedSpan() {
+            end();
+        }
+    };
+}
+
+#endif //SDBSCAN_TRACING_H
@@ -10,10 +10,13 @@
 #include "lib_include/rapidcsv.h"
 #include "lib_include/json.hpp"
 #include "lib_include/argparse.hpp"
+#include <omp.h>
+
+#ifndef GS_DBSCAN_CPU_ONLY
 #include <matx.h>
 #include "cuda_runtime.h"
-#include <omp.h>
 #include <thrust/random.h>
+#endif
 #include <boost/dynamic_bitset.hpp>
 
 #endif //SDBSCAN_PCH_H
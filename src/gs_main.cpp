@@ -6,6 +6,8 @@
 #include "../include/pch.h"
 #include "../include/gsDBSCAN/GsDBSCAN.h"
 #include "../include/gsDBSCAN/run_utils.h"
+#include "../include/gsDBSCAN/tracing.h"
+#include "../include/gsDBSCAN/batch_planner.h"
 
 using json = nlohmann::json;
 
@@ -20,14 +22,44 @@ int main(int argc, char *argv[]) {
 
     auto params = GsDBSCAN::parseArgs(argc, argv);
 
+    nlohmann::ordered_json batchPlan = nullptr;
+
+    if (params.autoBatchSizes) {
+        batchPlan = GsDBSCAN::batch_planner::planBatchSizes(params, (size_t) params.memoryBudgetMB * 1024 * 1024);
+        GsDBSCAN::batch_planner::applyBatchPlan(params, batchPlan);
+
+        std::cout << "Batch plan: " << batchPlan.dump(4) << std::endl;
+    }
+
     std::cout << "Params: " << params.toString() << std::endl;
 
-    auto [clusterLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
+    auto &tracer = GsDBSCAN::tracing::Tracer::instance();
+    tracer.setEnabled(!params.traceFilename.empty());
+
+    if (!params.sweepConfigs.empty()) {
+        auto [results, times] = GsDBSCAN::run_utils::sweep_main_helper(params);
+
+        for (const auto &result: results) {
+            std::cout << "eps: " << result.eps << ", minPts: " << result.minPts << ", NumClusters: "
+                      << result.numClusters << std::endl;
+        }
 
-    GsDBSCAN::run_utils::writeResults(params, times, clusterLabels, numClusters);
+        GsDBSCAN::run_utils::writeSweepResults(params, times, results, batchPlan);
 
-    std::cout << "Times: " << times.dump(4) << std::endl;
-    std::cout << "NumClusters: " << numClusters << std::endl;
+        std::cout << "Shared times: " << times.dump(4) << std::endl;
+    } else {
+        auto [clusterLabels, typeLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
+
+        GsDBSCAN::run_utils::writeResults(params, times, clusterLabels, typeLabels, numClusters, batchPlan);
+
+        std::cout << "Times: " << times.dump(4) << std::endl;
+        std::cout << "NumClusters: " << numClusters << std::endl;
+    }
+
+    if (tracer.isEnabled()) {
+        tracer.writeChromeTrace(params.traceFilename);
+        std::cout << "Trace written to: " << params.traceFilename << std::endl;
+    }
 
     return 0;
 }
\ No newline at end of file
@@ -8,6 +8,7 @@
 #include "../include/TestUtils.h"
 #include "../include/gsDBSCAN/algo_utils.h"
 #include "../include/gsDBSCAN/run_utils.h"
+#include <random>
 
 namespace tu = testUtils;
 
@@ -16,8 +17,7 @@ class AlgoUtilsTest : public ::testing::Test {
 protected:
     template<typename T>
     void assertColRowMajorMatsEqual(T *colMajorArray, T *rowMajorArray, size_t numRows, size_t numCols) {
-
-        #pragma omp parallel for
+        // Not an OpenMP loop, the ASSERTs return from the function
         for (size_t i = 0; i < numRows; ++i) {
             for (size_t j = 0; j < numCols; ++j) {
                 T colMajorValue = colMajorArray[j * numRows + i];
@@ -28,6 +28,7 @@ protected:
     }
 };
 
+#ifndef GS_DBSCAN_CPU_ONLY
 class TestColToRowMajorArrayConversion : public AlgoUtilsTest {
 };
 
@@ -144,4 +145,35 @@ TEST_F(TestCopying, TestSmallInputMatx) {
     for (int i = 0; i < 5; ++i) {
         ASSERT_NEAR(arr[i], arr_copy[i], 1e-6);
     }
-}
\ No newline at end of file
+}
+#endif
+
+class TestTiming : public AlgoUtilsTest {
+};
+
+TEST_F(TestTiming, TestLongDuration) {
+    // 2 hours in microseconds overflows an int
+    auto start = GsDBSCAN::algo_utils::timeNow();
+    auto stop = start + std::chrono::hours(2);
+
+    ASSERT_EQ(7200000000LL, GsDBSCAN::algo_utils::duration(start, stop));
+}
+
+class TestRadixSort : public AlgoUtilsTest {
+};
+
+TEST_F(TestRadixSort, TestMatchesStdSort) {
+    std::mt19937_64 gen(42);
+
+    for (int numBits: {7, 20, 40, 64}) {
+        std::vector<uint64_t> keys(100000);
+        for (auto &key: keys) key = numBits == 64 ? gen() : gen() & ((1ULL << numBits) - 1);
+
+        auto expected = keys;
+        std::sort(expected.begin(), expected.end());
+
+        GsDBSCAN::algo_utils::parallelRadixSort(keys, numBits);
+
+        ASSERT_EQ(expected, keys) << numBits;
+    }
+}
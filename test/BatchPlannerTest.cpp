@@ -0,0 +1,89 @@
+//
+// Tests for picking the batch sizes from a memory budget
+//
+
+#include "../include/pch.h"
+#include <gtest/gtest.h>
+#include "../include/gsDBSCAN/batch_planner.h"
+
+namespace bp = GsDBSCAN::batch_planner;
+
+class BatchPlannerTest : public ::testing::Test {
+};
+
+class TestFittingBatchSize : public BatchPlannerTest {
+};
+
+TEST_F(TestFittingBatchSize, TestBalancedRemainder) {
+    // 10 rows fit, so 11 batches, the last is a remainder batch of 1
+    ASSERT_EQ(10, bp::fitBatchSize(1000, 100, 101));
+
+    // 40 fit, so 3 batches, balanced to 34, 34, 32
+    ASSERT_EQ(34, bp::fitBatchSize(4000, 100, 100));
+}
+
+TEST_F(TestFittingBatchSize, TestBounds) {
+    ASSERT_EQ(1, bp::fitBatchSize(10, 100, 100));
+    ASSERT_EQ(1, bp::fitBatchSize(-10, 100, 100));
+    ASSERT_EQ(100, bp::fitBatchSize(1e12, 100, 100));
+}
+
+class TestPlanningBatchSizes : public BatchPlannerTest {
+};
+
+TEST_F(TestPlanningBatchSizes, TestFitsBudget) {
+    GsDBSCAN::GsDBSCAN_Params params("", "", 1000003, 784, 1024, 50, 2, 2000, 0.11, "COSINE");
+    params.useBatchClustering = true;
+    params.useBatchABMatrices = true;
+
+    size_t budgetBytes = (size_t) 16 << 30;
+
+    auto plan = bp::planBatchSizes(params, budgetBytes);
+
+    ASSERT_EQ("flag", plan["budgetSource"]);
+
+    size_t availableBytes = plan["usableBytes"].get<size_t>() - plan["residentBytes"].get<size_t>();
+
+    for (const auto &stage: {"normalise", "ABatch", "miniBatch", "distancesBatch"}) {
+        ASSERT_GE(plan[stage]["batchSize"].get<int>(), 1) << stage;
+        ASSERT_LE(plan[stage]["peakBytes"].get<size_t>(), availableBytes) << stage;
+    }
+
+    // A prime n must not degrade the batches to a single row
+    ASSERT_GT(plan["miniBatch"]["batchSize"].get<int>(), 1);
+
+    bp::applyBatchPlan(params, plan);
+
+    ASSERT_EQ(plan["miniBatch"]["batchSize"].get<int>(), params.miniBatchSize);
+    ASSERT_LE(params.distancesBatchSize, params.miniBatchSize);
+}
+
+TEST_F(TestPlanningBatchSizes, TestBudgetTooSmall) {
+    GsDBSCAN::GsDBSCAN_Params params("", "", 1000000, 784, 1024, 50, 2, 2000, 0.11, "COSINE");
+
+    ASSERT_THROW(bp::planBatchSizes(params, 1 << 20), std::runtime_error);
+}
+
+TEST_F(TestPlanningBatchSizes, TestDetectsBudget) {
+    GsDBSCAN::GsDBSCAN_Params params("", "", 1000, 10, 64, 5, 2, 20, 0.11, "L2");
+    params.device = "cpu";
+
+    auto plan = bp::planBatchSizes(params);
+
+    ASSERT_NE("flag", plan["budgetSource"]);
+    ASSERT_GT(plan["budgetBytes"].get<size_t>(), 0);
+}
+
+TEST_F(TestPlanningBatchSizes, TestCpuMiniBatchesGetWholeBudget) {
+    GsDBSCAN::GsDBSCAN_Params params("", "", 1000003, 784, 1024, 50, 2, 2000, 0.11, "COSINE");
+    params.device = "cpu";
+    params.useBatchClustering = true;
+
+    auto plan = bp::planBatchSizes(params, (size_t) 16 << 30);
+
+    // The host distances read the candidates in place, so no budget is set aside for gathered candidates
+    size_t availableBytes = plan["usableBytes"].get<size_t>() - plan["residentBytes"].get<size_t>();
+    ASSERT_GT(plan["miniBatch"]["peakBytes"].get<size_t>(), availableBytes / 2);
+    ASSERT_LE(plan["miniBatch"]["peakBytes"].get<size_t>(), availableBytes);
+    ASSERT_EQ(plan["miniBatch"]["batchSize"].get<int>(), plan["distancesBatch"]["batchSize"].get<int>());
+}
@@ -45,6 +45,7 @@ class TestConstructQueryVectorDegreeArray : public ClusteringTest {
 
 };
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestConstructQueryVectorDegreeArray, TestSmallInputMatX) {
     float distancesData[] = {
             0, 1, 2, 3, 5,
@@ -96,11 +97,13 @@ TEST_F(TestConstructQueryVectorDegreeArray, TestMnistAgainstPython) {
 
     assertArrayEqual(degArrayExpected.data(), degArray_h, n);
 }
+#endif
 
 class TestProcessQueryVectorDegreeArray : public ClusteringTest {
 
 };
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestProcessQueryVectorDegreeArray, TestSmallInputThrust) {
 
     int degArray[] = {3, 4, 1, 1};
@@ -142,6 +145,7 @@ TEST_F(TestProcessQueryVectorDegreeArray, TestSmallInputIntegrationThrust) {
         ASSERT_EQ(expectedData[i], startIdxArray_h[i]);
     }
 }
+#endif
 
 class TestCreatingAdjacencyList : public ClusteringTest {
 
@@ -161,6 +165,7 @@ TEST_F(TestCreatingAdjacencyList, TestSmallInput) {
     // TODO
 }
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestCreatingAdjacencyList, TestSmallInputCase2) {
     // This example was taken from my python implementation
 
@@ -310,6 +315,174 @@ TEST_F(TestCreatingAdjacencyList, TestSmallInputCase2WithBatching) {
         ASSERT_EQ(adjacencyListExpected_h[i], adjacencyList_h[i]);
     }
 }
+#endif
+
+TEST_F(TestCreatingAdjacencyList, TestSmallInputCase2Cpu) {
+    int A[10] = {
+            0, 3,
+            2, 5,
+            4, 1,
+            0, 7,
+            2, 1
+    };
+
+    int B[30] = {
+            1, 2, 3,
+            0, 4, 1,
+            3, 1, 0,
+            1, 0, 2,
+            0, 2, 3,
+            1, 2, 0,
+            0, 4, 1,
+            3, 1, 2,
+            1, 0, 4,
+            0, 2, 1
+    };
+
+    float distancesSquared[] = {
+            11.0f,  5.0f, 14.0f, 11.0f,  0.0f,  5.0f,
+            9.0f,  0.0f, 11.0f,  0.0f, 14.0f, 11.0f,
+            5.0f,  0.0f,  5.0f,  5.0f,  8.0f, 14.0f,
+            9.0f,  5.0f,  0.0f,  0.0f,  9.0f,  5.0f,
+            9.0f,  6.0f,  5.0f,  5.0f,  0.0f,  6.0f
+    };
+
+    float distances[30];
+
+    for (size_t i = 0; i < 30; ++i) {
+        distances[i] = std::sqrt(distancesSquared[i]);
+    }
+
+    int n = 5;
+    int k = 1;
+    int m = 3;
+    float eps = std::sqrt(5.1);
+
+    auto degArray = GsDBSCAN::clustering::constructQueryVectorDegreeArrayCpu(distances, n, 2 * k * m, eps, "L2");
+    auto startIdxArray = GsDBSCAN::clustering::constructStartIdxArrayCpu(degArray);
+    auto adjacencyList = GsDBSCAN::clustering::constructAdjacencyListCpu(distances, degArray, startIdxArray, A, B, n, k, m, eps, "L2");
+
+    int degArrayExpected[5] = {3, 2, 4, 4, 3};
+    int startIdxArrayExpected[5] = {0, 3, 5, 9, 13};
+
+    int adjacencyListExpected[16] {
+            2, 0, 2,
+            1, 1,
+            0, 2, 3, 0,
+            2, 3, 3, 2,
+            0, 0, 4
+    };
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(degArrayExpected[i], degArray[i]);
+        ASSERT_EQ(startIdxArrayExpected[i], startIdxArray[i]);
+    }
+
+    ASSERT_EQ(16, adjacencyList.size());
+
+    for (int i = 0; i < 16; i++) {
+        ASSERT_EQ(adjacencyListExpected[i], adjacencyList[i]);
+    }
+}
+
+class TestCreatingClusteringArraysFused : public ClusteringTest {
+
+protected:
+    float X[15] = {
+            0, 1, 3,
+            1, 2, 0,
+            2, 0, 3,
+            3, 0, 1,
+            0, 0, 1
+    };
+
+    int A[10] = {
+            0, 3,
+            2, 5,
+            4, 1,
+            0, 7,
+            2, 1
+    };
+
+    int B[30] = {
+            1, 2, 3,
+            0, 4, 1,
+            3, 1, 0,
+            1, 0, 2,
+            0, 2, 3,
+            1, 2, 0,
+            0, 4, 1,
+            3, 1, 2,
+            1, 0, 4,
+            0, 2, 1
+    };
+
+    int degArrayExpected[5] = {3, 2, 4, 4, 3};
+    int startIdxArrayExpected[5] = {0, 3, 5, 9, 13};
+
+    // Same as TestCreatingAdjacencyList, the distances are never materialised though
+    int adjacencyListExpected[16] = {
+            2, 0, 2,
+            1, 1,
+            0, 2, 3, 0,
+            2, 3, 3, 2,
+            0, 0, 4
+    };
+};
+
+TEST_F(TestCreatingClusteringArraysFused, TestSmallInputCpu) {
+    auto X_torch = torch::from_blob(X, {5, 3}, torch::TensorOptions().dtype(torch::kFloat32));
+    auto A_torch = torch::from_blob(A, {5, 2}, torch::TensorOptions().dtype(torch::kInt32));
+    auto B_torch = torch::from_blob(B, {10, 3}, torch::TensorOptions().dtype(torch::kInt32));
+
+    nlohmann::ordered_json times;
+
+    auto [adjacencyList, degArray, startIdxArray] = GsDBSCAN::clustering::createClusteringArraysFusedCpu(
+            X_torch, A_torch, B_torch, std::sqrt(5.1), "L2", times, false);
+
+    for (int i = 0; i < 5; i++) {
+        ASSERT_EQ(degArrayExpected[i], degArray[i]);
+        ASSERT_EQ(startIdxArrayExpected[i], startIdxArray[i]);
+    }
+
+    ASSERT_EQ(16, adjacencyList.size());
+
+    for (int i = 0; i < 16; i++) {
+        ASSERT_EQ(adjacencyListExpected[i], adjacencyList[i]);
+    }
+}
+
+#ifndef GS_DBSCAN_CPU_ONLY
+TEST_F(TestCreatingClusteringArraysFused, TestSmallInputGpu) {
+    auto X_torch = torch::from_blob(X, {5, 3}, torch::TensorOptions().dtype(torch::kFloat32)).to(torch::kCUDA);
+    auto A_torch = torch::from_blob(A, {5, 2}, torch::TensorOptions().dtype(torch::kInt32)).to(torch::kCUDA);
+    auto B_torch = torch::from_blob(B, {10, 3}, torch::TensorOptions().dtype(torch::kInt32)).to(torch::kCUDA);
+
+    nlohmann::ordered_json times;
+
+    auto [adjacencyList_d, adjacencyListSize, degArray_d, startIdxArray_d] = GsDBSCAN::clustering::createClusteringArraysFused(
+            X_torch, A_torch, B_torch, std::sqrt(5.1), "L2", 128, times, false);
+
+    auto degArray_h = GsDBSCAN::algo_utils::copyDeviceToHost(degArray_d, 5);
+    auto startIdxArray_h = GsDBSCAN::algo_utils::copyDeviceToHost(startIdxArray_d, 5);
+    auto adjacencyList_h = GsDBSCAN::algo_utils::copyDeviceToHost(adjacencyList_d, adjacencyListSize);
+
+    ASSERT_EQ(16, adjacencyListSize);
+
+    for (int i = 0; i < 5; i++) {
+        ASSERT_EQ(degArrayExpected[i], degArray_h[i]);
+        ASSERT_EQ(startIdxArrayExpected[i], startIdxArray_h[i]);
+
+        // The order within a row isn't deterministic on the GPU
+        std::sort(adjacencyList_h + startIdxArray_h[i], adjacencyList_h + startIdxArray_h[i] + degArray_h[i]);
+        std::sort(adjacencyListExpected + startIdxArrayExpected[i], adjacencyListExpected + startIdxArrayExpected[i] + degArrayExpected[i]);
+    }
+
+    for (int i = 0; i < 16; i++) {
+        ASSERT_EQ(adjacencyListExpected[i], adjacencyList_h[i]);
+    }
+}
+#endif
 
 class TestFormingClusters : public ClusteringTest {
 
@@ -319,6 +492,7 @@ TEST_F(TestFormingClusters, TestSmallInputIntegration) {
 
 }
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestFormingClusters, TestSmallInput) {
     // A simple case I came up with from a sketch
 
@@ -427,7 +601,9 @@ TEST_F(TestFormingClusters, TestSmallInputCpu) {
 
     int clusterLabelsExpected_h[12] = {0, 0, 0, 0, -1, 1, 1, 1, -1, 1, -1, -1};
 
-    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::processAdjacencyListCpu(adjacencyList_d, degArray_d, startIdxArray_d, n, 18, minPts);
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, 2, 4, minPts, 1, 1, 0.5, "L2");
+
+    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::processAdjacencyListCpu(adjacencyList_d, degArray_d, startIdxArray_d, params, 18);
 
     auto [clusterLabels_h, numClusters] = GsDBSCAN::clustering::formClustersCPU(neighbourhoodMatrix,
                                                                                 corePoints, n);
@@ -437,4 +613,175 @@ TEST_F(TestFormingClusters, TestSmallInputCpu) {
     }
 
     ASSERT_EQ(numClusters, 2);
-}
\ No newline at end of file
+}
+#endif
+
+TEST_F(TestFormingClusters, TestSmallInputUnionFind) {
+    int n = 12;
+    int minPts = 3;
+
+    int adjacencyList[18] = {
+            1,
+            0, 2, 3,
+            1,
+            1,
+            9, 6, 7,
+            5, 9,
+            9, 5,
+            5, 7, 6,
+            11,
+            10
+    };
+
+    int degArray[12] = {1, 3, 1, 1, 0, 3, 2, 2, 0, 3, 1, 1};
+    int startIdxArray[12] = {0, 1, 4, 5, 6, 6, 9, 11, 13, 13, 16, 17};
+
+    int clusterLabelsExpected[12] = {0, 0, 0, 0, -1, 1, 1, 1, -1, 1, -1, -1};
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, 2, 4, minPts, 1, 1, 0.5, "L2");
+
+    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::processAdjacencyListHost(adjacencyList, degArray, startIdxArray, params);
+
+    auto [clusterLabels, numClusters] = GsDBSCAN::clustering::formClustersUnionFindCPU(neighbourhoodMatrix,
+                                                                                       corePoints, n);
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(clusterLabelsExpected[i], clusterLabels[i]);
+    }
+
+    ASSERT_EQ(numClusters, 2);
+
+    delete[] clusterLabels;
+}
+
+TEST_F(TestFormingClusters, TestUnionFindAsymmetricCsr) {
+    int n = 5;
+    int minPts = 2;
+
+    // Only stored one way, 0 -> 2 -> 1 -> 3 links the four core points but 2 -> 1 and 3 -> 1 point to a smaller id.
+    // 4 is a border point, its edge to 0 is only stored in the core point's row
+    int adjacencyList[5] = {2, 4, 3, 1, 1};
+    int degArray[5] = {2, 1, 1, 1, 0};
+    int startIdxArray[5] = {0, 2, 3, 4, 5};
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, 2, 4, minPts, 1, 1, 0.5, "L2");
+    params.ignoreAdjListSymmetry = true;
+
+    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::processAdjacencyListHost(adjacencyList, degArray, startIdxArray, params);
+
+    auto [clusterLabelsExpected, numClustersExpected] = GsDBSCAN::clustering::formClustersCPU(neighbourhoodMatrix,
+                                                                                              corePoints, n);
+    auto [clusterLabels, numClusters] = GsDBSCAN::clustering::formClustersUnionFindCPU(neighbourhoodMatrix,
+                                                                                       corePoints, n);
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(clusterLabelsExpected[i], clusterLabels[i]);
+    }
+
+    ASSERT_EQ(numClustersExpected, numClusters);
+    ASSERT_EQ(numClusters, 1);
+    ASSERT_FALSE(corePoints[4]);
+    ASSERT_EQ(0, clusterLabels[4]);
+
+    delete[] clusterLabelsExpected;
+    delete[] clusterLabels;
+}
+
+class TestProcessingAdjacencyList : public ClusteringTest {
+
+};
+
+TEST_F(TestProcessingAdjacencyList, TestSymmetrisingCsr) {
+    int n = 4;
+
+    // 0 -> 1, 2 -> 0, 3 -> 3 (self loop) and 1 -> 0 twice
+    int adjacencyList[5] = {1, 0, 0, 0, 3};
+    int degArray[4] = {1, 2, 1, 1};
+    int startIdxArray[4] = {0, 1, 3, 4};
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, 2, 4, 3, 1, 1, 0.5, "L2");
+
+    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::processAdjacencyListHost(adjacencyList, degArray, startIdxArray, params);
+
+    std::vector<std::vector<int>> expected = {{1, 2}, {0}, {0}, {3}};
+
+    for (int i = 0; i < n; i++) {
+        ASSERT_EQ(expected[i], std::vector<int>(neighbourhoodMatrix.begin(i), neighbourhoodMatrix.end(i)));
+    }
+
+    ASSERT_TRUE(corePoints[0]);
+    ASSERT_FALSE(corePoints[1]);
+    ASSERT_FALSE(corePoints[2]);
+    ASSERT_FALSE(corePoints[3]);
+}
+
+class TestClusteringPairs : public ClusteringTest {
+
+};
+
+TEST_F(TestClusteringPairs, TestMatchesPerQueryCpu) {
+    int n = 400;
+    int d = 5;
+    int D = 8;
+    int k = 2;
+    int m = 25;
+    float eps = 1.2;
+
+    auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+    auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+    auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, d, D, 4, k, m, eps, "L2");
+    nlohmann::ordered_json times;
+
+    auto [adjacencyList, degArray, startIdxArray] = GsDBSCAN::clustering::createClusteringArraysFusedCpu(
+            X, A, B, eps, "L2", times, false);
+    auto [expectedMatrix, expectedCorePoints] = GsDBSCAN::clustering::processAdjacencyListHost(
+            adjacencyList.data(), degArray.data(), startIdxArray.data(), params);
+
+    auto pairs = GsDBSCAN::clustering::emitCandidatePairsCpu(A.data_ptr<int>(), B.data_ptr<int>(), n, k, m);
+    GsDBSCAN::algo_utils::parallelRadixSort(pairs);
+
+    int64_t numUniquePairs;
+    auto edges = GsDBSCAN::clustering::evaluateCandidatePairsCpu<DistanceMetric::L2>(
+            X.data_ptr<float>(), pairs, n, d, eps, numUniquePairs);
+
+    ASSERT_LT(numUniquePairs, (int64_t) pairs.size());
+
+    auto [neighbourhoodMatrix, corePoints] = GsDBSCAN::clustering::neighbourhoodFromEdgesHost(edges, params);
+
+    ASSERT_EQ(expectedMatrix.offsets, neighbourhoodMatrix.offsets);
+    ASSERT_EQ(expectedMatrix.neighbours, neighbourhoodMatrix.neighbours);
+    ASSERT_EQ(expectedCorePoints, corePoints);
+}
+
+TEST_F(TestClusteringPairs, TestOwnerBucketsMatchGlobalSort) {
+    int n = 400;
+    int D = 8;
+    int k = 2;
+    int m = 25;
+
+    auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+    auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+    auto expectedPairs = GsDBSCAN::clustering::emitCandidatePairsCpu(A.data_ptr<int>(), B.data_ptr<int>(), n, k, m);
+    GsDBSCAN::algo_utils::parallelRadixSort(expectedPairs);
+
+    std::vector<size_t> ownerOffsets;
+    auto pairs = GsDBSCAN::clustering::emitCandidatePairsByOwnerCpu(A.data_ptr<int>(), B.data_ptr<int>(), n, k, m,
+                                                                    ownerOffsets);
+
+    ASSERT_EQ(n + 1, (int) ownerOffsets.size());
+    ASSERT_EQ(pairs.size(), ownerOffsets[n]);
+
+    // Each bucket only holds the pairs of its owner
+    for (int i = 0; i < n; i++) {
+        for (size_t p = ownerOffsets[i]; p < ownerOffsets[i + 1]; p++) {
+            ASSERT_EQ(i, (int) (pairs[p] / n));
+        }
+    }
+
+    GsDBSCAN::clustering::sortOwnerBucketsCpu(pairs, ownerOffsets);
+
+    ASSERT_EQ(expectedPairs, pairs);
+}
@@ -41,7 +41,14 @@ class TestCalculatingBatchSize : public TestDistances {
 TEST_F(TestCalculatingBatchSize, TestLargeInput) {
     int batchSize = GsDBSCAN::distances::findDistanceBatchSize(1, 1000000, 3, 2, 2000);
 
-    ASSERT_EQ(20, batchSize);
+    ASSERT_EQ(22, batchSize);
+}
+
+TEST_F(TestCalculatingBatchSize, TestPrimeInput) {
+    // Used to degrade to a batch size of 1, as the only divisors of a prime are 1 and itself
+    int batchSize = GsDBSCAN::distances::findDistanceBatchSize(1, 1000003, 3, 2, 2000);
+
+    ASSERT_EQ(22, batchSize);
 }
 
 TEST_F(TestCalculatingBatchSize, TestSmallInput) {
@@ -57,6 +64,7 @@ class TestFindingDistances : public TestDistances {
 
 };
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestFindingDistances,TestSmallInputTorch) {
     float X[15] = {
             0, 1, 3,
@@ -116,4 +124,374 @@ TEST_F(TestFindingDistances,TestSmallInputTorch) {
     for (int i = 0; i < 5*6; i++) {
         ASSERT_NEAR(std::sqrt(expected_squared[i]), distances_h[i], 1e-3);
     }
-}
\ No newline at end of file
+}
+#endif
+
+TEST_F(TestFindingDistances, TestSmallInputTorchCpu) {
+    float X[15] = {
+            0, 1, 3,
+            1, 2, 0,
+            2, 0, 3,
+            3, 0, 1,
+            0, 0, 1
+    };
+
+    int A[10] = {
+            0, 3,
+            2, 5,
+            4, 1,
+            0, 7,
+            2, 1
+    };
+
+    int B[30] = {
+            1, 2, 3,
+            0, 4, 1,
+            3, 1, 0,
+            1, 0, 2,
+            0, 2, 3,
+            1, 2, 0,
+            0, 4, 1,
+            3, 1, 2,
+            1, 0, 4,
+            0, 2, 1
+    };
+
+    auto X_torch = torch::from_blob(X, {5, 3}, torch::TensorOptions().dtype(torch::kFloat32).device(torch::kCPU));
+    auto A_torch = torch::from_blob(A, {5, 2}, torch::TensorOptions().dtype(torch::kInt32).device(torch::kCPU));
+    auto B_torch = torch::from_blob(B, {10, 3}, torch::TensorOptions().dtype(torch::kInt32).device(torch::kCPU));
+
+    auto distances = GsDBSCAN::distances::findDistancesTorch(X_torch, A_torch, B_torch, 1.2, -1, "L2");
+
+    ASSERT_TRUE(distances.device().is_cpu());
+
+    auto distances_h = distances.data_ptr<float>();
+
+    float expected_squared[30] = {
+            11, 5, 14, 11, 0, 5,
+            9, 0, 11, 0, 14, 11,
+            5, 0, 5, 5, 8, 14,
+            9, 5, 0, 0, 9, 5,
+            9, 6, 5, 5, 0, 6
+    };
+
+    for (int i = 0; i < 5*6; i++) {
+        ASSERT_NEAR(std::sqrt(expected_squared[i]), distances_h[i], 1e-3);
+    }
+}
+
+TEST_F(TestFindingDistances, TestCpuEngineMatchesTorch) {
+    int n = 500;
+    int D = 64;
+    int k = 3;
+    int m = 20;
+
+    // Dimensions around the vector widths, to cover the remainders
+    for (int d: {1, 7, 16, 33, 100}) {
+        auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+        auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+        auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+        auto candidates = X.index_select(0, B.index_select(0, A.flatten()).flatten()).view({n, 2 * k * m, d});
+
+        std::vector<std::pair<std::string, torch::Tensor>> expected = {
+                {"L1",     torch::norm(candidates - X.unsqueeze(1), 1, 2)},
+                {"L2",     torch::norm(candidates - X.unsqueeze(1), 2, 2)},
+                {"COSINE", torch::sum(candidates * X.unsqueeze(1), 2)}
+        };
+
+        for (const auto &[distanceMetric, expectedDistances]: expected) {
+            auto distances = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric);
+            ASSERT_TRUE(torch::allclose(expectedDistances, distances, 1e-4, 1e-4)) << distanceMetric << ", d = " << d;
+
+            // A slice of the queries
+            auto distancesSlice = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric, 100, 200);
+            ASSERT_TRUE(torch::allclose(expectedDistances.slice(0, 100, 200), distancesSlice, 1e-4, 1e-4));
+        }
+    }
+}
+
+TEST_F(TestFindingDistances, TestCpuEngine16BitMatchesFloat) {
+    int n = 500;
+    int D = 64;
+    int k = 3;
+    int m = 20;
+
+    for (int d: {7, 33, 100}) {
+        auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+        auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+        for (auto dtype: {torch::kFloat16, torch::kBFloat16}) {
+            // The 16-bit kernels widen to float, so they match the float kernels on the same (rounded) values
+            auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32)).to(dtype);
+
+            for (std::string distanceMetric: {"L1", "L2", "COSINE"}) {
+                auto expected = GsDBSCAN::distances::findDistancesCpu(X.to(torch::kFloat32), A, B, distanceMetric);
+                auto distances = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric);
+                ASSERT_TRUE(torch::allclose(expected, distances, 1e-4, 1e-4)) << distanceMetric << ", d = " << d;
+            }
+        }
+    }
+}
+
+TEST_F(TestFindingDistances, TestCpuEngine8BitMatchesFloat) {
+    int n = 500;
+    int D = 64;
+    int k = 3;
+    int m = 20;
+
+    for (int d: {7, 33, 100}) {
+        auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+        auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+        for (auto dtype: {torch::kUInt8, torch::kInt8}) {
+            int low = dtype == torch::kUInt8 ? 0 : -128;
+            auto X = torch::randint(low, low + 256, {n, d}, torch::TensorOptions().dtype(dtype));
+            auto XFloat = X.to(torch::kFloat32);
+
+            // COSINE normalises the 8-bit vectors on the fly
+            std::vector<std::pair<std::string, torch::Tensor>> expected = {
+                    {"L1",     GsDBSCAN::distances::findDistancesCpu(XFloat, A, B, "L1")},
+                    {"L2",     GsDBSCAN::distances::findDistancesCpu(XFloat, A, B, "L2")},
+                    {"COSINE", GsDBSCAN::distances::findDistancesCpu(
+                            XFloat / torch::norm(XFloat, 2, 1).unsqueeze(1), A, B, "COSINE")}
+            };
+
+            for (const auto &[distanceMetric, expectedDistances]: expected) {
+                auto distances = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric);
+                ASSERT_TRUE(torch::allclose(expectedDistances, distances, 1e-4, 1e-4))
+                                            << distanceMetric << ", d = " << d;
+            }
+        }
+    }
+}
+
+TEST_F(TestFindingDistances, TestCpuEngine8BitZeroRowCosine) {
+    int n = 200;
+    int d = 33;
+    int D = 16;
+    int k = 3;
+    int m = 20;
+
+    auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+    auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+    // Every query has the zero vector amongst its candidates
+    B.select(1, 0).zero_();
+
+    auto X = torch::randint(0, 256, {n, d}, torch::TensorOptions().dtype(torch::kUInt8));
+    X[0].zero_();
+    auto XFloat = X.to(torch::kFloat32);
+
+    // A zero vector's similarities are 0, as with a clamped norm
+    auto expected = GsDBSCAN::distances::findDistancesCpu(
+            XFloat / torch::norm(XFloat, 2, 1).clamp_min(1e-12).unsqueeze(1), A, B, "COSINE");
+    auto distances = GsDBSCAN::distances::findDistancesCpu(X, A, B, "COSINE");
+
+    ASSERT_FALSE(torch::isnan(distances).any().item<bool>());
+    ASSERT_TRUE(torch::allclose(expected, distances, 1e-4, 1e-4));
+}
+
+TEST_F(TestFindingDistances, TestCpuEngineDedupCandidates) {
+    int n = 300;
+    int d = 10;
+    int D = 8;
+    int k = 4;
+    int m = 30;
+
+    // Few projections and many candidates per B row, so the rows of B overlap a lot
+    auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+    auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+    auto B = torch::randint(0, 50, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+    auto candidates = B.index_select(0, A.flatten()).view({n, 2 * k * m});
+    auto candidates_a = candidates.accessor<int, 2>();
+
+    for (const std::string distanceMetric: {"L1", "L2", "COSINE"}) {
+        auto expected = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric);
+
+        GsDBSCAN::distances::CandidateCounts counts;
+        auto distances = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric, 0, -1, true, &counts);
+        auto distances_a = distances.accessor<float, 2>();
+        auto expected_a = expected.accessor<float, 2>();
+
+        int64_t expectedDuplicates = 0;
+        for (int i = 0; i < n; i++) {
+            std::unordered_set<int> seen;
+            for (int c = 0; c < 2 * k * m; c++) {
+                if (seen.insert(candidates_a[i][c]).second) {
+                    ASSERT_FLOAT_EQ(expected_a[i][c], distances_a[i][c]) << distanceMetric;
+                } else {
+                    ASSERT_TRUE(std::isnan(distances_a[i][c])) << distanceMetric;
+                    expectedDuplicates++;
+                }
+            }
+        }
+
+        ASSERT_GT(expectedDuplicates, 0);
+        ASSERT_EQ(counts.candidates, (int64_t) n * 2 * k * m);
+        ASSERT_EQ(counts.duplicates, expectedDuplicates);
+    }
+}
+
+TEST_F(TestFindingDistances, TestBucketedCpuEngineMatchesPerQuery) {
+    int n = 500;
+    int D = 16;
+    int k = 3;
+    int m = 20;
+
+    for (int d: {7, 33, 100}) {
+        auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+        auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+        auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+        for (const std::string distanceMetric: {"L1", "L2", "COSINE"}) {
+            auto expected = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric);
+            auto distances = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric, 0, -1, false, nullptr,
+                                                                   true);
+            ASSERT_TRUE(torch::allclose(expected, distances, 1e-5, 1e-5)) << distanceMetric << ", d = " << d;
+
+            auto distancesSlice = GsDBSCAN::distances::findDistancesCpu(X, A, B, distanceMetric, 100, 250, false,
+                                                                        nullptr, true);
+            ASSERT_TRUE(torch::allclose(expected.slice(0, 100, 250), distancesSlice, 1e-5, 1e-5));
+        }
+    }
+}
+
+TEST_F(TestFindingDistances, TestQuantisedCpuEngineMatchesWithinEps) {
+    int n = 500;
+    int D = 16;
+    int k = 3;
+    int m = 20;
+
+    for (int d: {7, 33, 100}) {
+        auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+        auto A = torch::randint(0, 2 * D, {n, 2 * k}, torch::TensorOptions().dtype(torch::kInt32));
+        auto B = torch::randint(0, n, {2 * D, m}, torch::TensorOptions().dtype(torch::kInt32));
+
+        // Around the typical distance (similarity) of the pairs, so plenty of candidates are near eps
+        std::vector<std::tuple<std::string, torch::Tensor, float>> configs = {
+                {"L2",     X,                                          std::sqrt(2.0f * d)},
+                {"COSINE", X / torch::norm(X, 2, 1).unsqueeze(1), 0.1f}
+        };
+
+        for (auto &[distanceMetric, XMetric, eps]: configs) {
+            auto expected = GsDBSCAN::distances::findDistancesCpu(XMetric, A, B, distanceMetric);
+
+            GsDBSCAN::distances::QuantisedFilter filter{GsDBSCAN::distances::quantiseDataset(XMetric), eps};
+            auto distances = GsDBSCAN::distances::findDistancesCpu(XMetric, A, B, distanceMetric, 0, -1, false,
+                                                                   nullptr, false, &filter);
+
+            auto expected_a = expected.accessor<float, 2>();
+            auto distances_a = distances.accessor<float, 2>();
+            for (int i = 0; i < n; i++) {
+                for (int c = 0; c < 2 * k * m; c++) {
+                    bool expectedWithin = distanceMetric == "COSINE" ? expected_a[i][c] > eps : expected_a[i][c] < eps;
+                    bool within = distanceMetric == "COSINE" ? distances_a[i][c] > eps : distances_a[i][c] < eps;
+                    ASSERT_EQ(expectedWithin, within) << distanceMetric << ", d = " << d;
+                }
+            }
+
+            ASSERT_EQ(filter.candidates, (int64_t) n * 2 * k * m);
+            ASSERT_GT(filter.refined, 0);
+            ASSERT_LT(filter.refined, filter.candidates);
+        }
+    }
+}
+
+TEST_F(TestFindingDistances, TestSketchMaxHammingBoundsFalseNegatives) {
+    ASSERT_EQ(GsDBSCAN::distances::sketchMaxHamming(256, 1.0f, 1e-3f), 0);
+    ASSERT_EQ(GsDBSCAN::distances::sketchMaxHamming(256, -1.0f, 1e-3f), 256);
+
+    // P(Binomial(numBits, p) > h)
+    auto tail = [](int numBits, double p, int h) {
+        double sum = 0;
+        for (int i = h + 1; i <= numBits; i++) {
+            sum += std::exp(std::lgamma(numBits + 1.0) - std::lgamma(i + 1.0) - std::lgamma(numBits - i + 1.0) +
+                            i * std::log(p) + (numBits - i) * std::log1p(-p));
+        }
+        return sum;
+    };
+
+    for (int numBits: {64, 256, 1024}) {
+        for (float eps: {0.2f, 0.5f, 0.9f}) {
+            for (float falseNegativeRate: {1e-4f, 1e-2f}) {
+                int maxHamming = GsDBSCAN::distances::sketchMaxHamming(numBits, eps, falseNegativeRate);
+                double p = std::acos(eps) / M_PI;
+
+                // The smallest distance within the rate
+                ASSERT_LE(tail(numBits, p, maxHamming), falseNegativeRate);
+                ASSERT_GT(tail(numBits, p, maxHamming - 1), falseNegativeRate);
+            }
+        }
+    }
+}
+
+TEST_F(TestFindingDistances, TestSketchesRejectFewNeighbours) {
+    int n = 2000;
+    int d = 32;
+    int numBits = 256;
+    float eps = 0.8;
+    float falseNegativeRate = 1e-3;
+
+    // Clustered, so plenty of pairs are within eps
+    auto centres = torch::randn({20, d});
+    auto X = centres.index_select(0, torch::arange(n) % 20) + 0.6 * torch::randn({n, d});
+    X = X / torch::norm(X, 2, 1).unsqueeze(1);
+
+    auto projections = torch::matmul(X, torch::randn({d, numBits}));
+
+    GsDBSCAN::distances::SimHashSketches sketches(n, numBits, eps, falseNegativeRate);
+    sketches.addProjections(projections, 0);
+
+    auto similarities = torch::matmul(X, X.t());
+    auto similarities_a = similarities.accessor<float, 2>();
+
+    int64_t numWithin = 0, numFalseNegatives = 0, numOutside = 0, numPruned = 0;
+    for (int i = 0; i < n; i++) {
+        for (int j = i + 1; j < n; j++) {
+            if (similarities_a[i][j] > eps) {
+                numWithin++;
+                numFalseNegatives += sketches.rejects(i, j);
+            } else {
+                numOutside++;
+                numPruned += sketches.rejects(i, j);
+            }
+        }
+    }
+
+    ASSERT_GT(numWithin, 0);
+    ASSERT_LE(numFalseNegatives, 3 * falseNegativeRate * numWithin);
+    // Most of the pairs that aren't neighbours are far apart
+    ASSERT_GT(numPruned, numOutside / 2);
+}
+
+TEST_F(TestFindingDistances, TestBoundedEpsMatchesFullDistances) {
+    int n = 200;
+
+    // Around the bound check interval, so the partial sums stop at every chunk
+    for (int d: {7, 64, 65, 200}) {
+        auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+        const float *X_h = X.data_ptr<float>();
+
+        for (float eps: {2.0f, 10.0f, 20.0f}) {
+            for (int i = 0; i < n; i++) {
+                for (int j = 0; j < n; j += 7) {
+                    const float *x = X_h + (size_t) i * d;
+                    const float *y = X_h + (size_t) j * d;
+
+                    float l1 = GsDBSCAN::distances::distanceCpu<DistanceMetric::L1>(x, y, d);
+                    float l2 = GsDBSCAN::distances::distanceCpu<DistanceMetric::L2>(x, y, d);
+
+                    // Sums in a different order, so skip the distances right at eps
+                    if (std::fabs(l1 - eps) > 1e-3 * eps) {
+                        ASSERT_EQ(l1 < eps, GsDBSCAN::distances::withinEpsCpu<DistanceMetric::L1>(x, y, d, eps));
+                    }
+                    if (std::fabs(l2 - eps) > 1e-3 * eps) {
+                        ASSERT_EQ(l2 < eps, GsDBSCAN::distances::withinEpsCpu<DistanceMetric::L2>(x, y, d, eps));
+                    }
+                }
+            }
+        }
+    }
+}
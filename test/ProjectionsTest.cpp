@@ -13,8 +13,7 @@ class ProjectionsTest : public ::testing::Test {
 protected:
     template<typename T>
     void assertColRowMajorMatsEqual(T *colMajorArray, T *rowMajorArray, size_t numRows, size_t numCols) {
-
-        #pragma omp parallel for
+        // Not an OpenMP loop, the ASSERTs return from the function
         for (size_t i = 0; i < numRows; ++i) {
             for (size_t j = 0; j < numCols; ++j) {
                 T colMajorValue = colMajorArray[j * numRows + i];
@@ -36,6 +35,7 @@ class TestConstructingABMatrices : public ProjectionsTest {
 
 };
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestConstructingABMatrices, TestSmallInputTorch) {
     // n = 6, D = 5
     float distances[30] = {
@@ -89,4 +89,256 @@ TEST_F(TestConstructingABMatrices, TestSmallInputTorch) {
 
     assertArrayEqual(expectedA, A_h, 6 * 4);
     assertArrayEqual(expectedB, B_h, 10 * 2);
-}
\ No newline at end of file
+}
+#endif
+
+TEST_F(TestConstructingABMatrices, TestSmallInputCpu) {
+    // Same input as TestSmallInputTorch, given row major, (n, D) = (6, 5)
+    float projections[30] = {
+            12.0f, 63.0f, 45.0f, 92.0f, 51.0f,
+            85.0f, 77.0f, 90.0f, 18.0f, 39.0f,
+            47.0f, 20.0f, 27.0f, 61.0f, 74.0f,
+            23.0f, 34.0f, 69.0f, 83.0f, 6.0f,
+            56.0f, 89.0f, 10.0f, 25.0f, 81.0f,
+            10.0f, 4.0f, 3.0f, 15.0f, 2.0f
+    };
+
+    int expectedA[(6) * (2 * 2)] = {
+            2 * 0, 2 * 2, 2 * 1 + 1, 2 * 3 + 1,
+            2 * 3, 2 * 4, 2 * 0 + 1, 2 * 2 + 1,
+            2 * 1, 2 * 2, 2 * 3 + 1, 2 * 4 + 1,
+            2 * 4, 2 * 0, 2 * 2 + 1, 2 * 3 + 1,
+            2 * 2, 2 * 3, 2 * 4 + 1, 2 * 1 + 1,
+            2 * 4, 2 * 2, 2 * 0 + 1, 2 * 3 + 1
+    };
+
+    int expectedB[(2 * 5) * 2] = {
+            5, 0,
+            4, 1,
+            5, 2,
+            1, 4,
+            5, 4,
+            3, 1,
+            5, 1,
+            3, 0,
+            5, 3,
+            2, 4
+    };
+
+    auto projectionsTensor = torch::from_blob(projections, {6, 5}, torch::TensorOptions().dtype(torch::kFloat32));
+
+    auto [A, B] = GsDBSCAN::projections::constructABMatrices(projectionsTensor, 2, 2);
+
+    assertArrayEqual(expectedA, A.data_ptr<int>(), 6 * 4);
+    assertArrayEqual(expectedB, B.data_ptr<int>(), 10 * 2);
+}
+
+TEST_F(TestConstructingABMatrices, TestMatchesArgsortCpu) {
+    int n = 50000;
+    int D = 64;
+    int k = 3;
+    int m = 100;
+
+    for (const std::string distanceMetric: {"L2", "COSINE"}) {
+        bool sortDescending = GsDBSCAN::projections::getSortDescending(distanceMetric);
+
+        auto projections = torch::randn({n, D}, torch::TensorOptions().dtype(torch::kFloat32));
+
+        auto [A, B] = GsDBSCAN::projections::constructABMatrices(projections, k, m, distanceMetric);
+
+        auto rowSorted = projections.argsort(1, sortDescending).toType(torch::kInt32);
+        auto colSorted = projections.argsort(0, sortDescending).toType(torch::kInt32);
+
+        auto expectedA = torch::cat({2 * rowSorted.slice(1, 0, k), 2 * rowSorted.slice(1, D - k, D) + 1}, 1);
+        auto expectedB = torch::stack({colSorted.slice(0, 0, m).t(), colSorted.slice(0, n - m, n).t()}, 1)
+                .reshape({2 * D, m});
+
+        // Random values, so there are no ties to break differently
+        ASSERT_TRUE(torch::equal(expectedA, A));
+        ASSERT_TRUE(torch::equal(expectedB, B));
+    }
+}
+
+TEST_F(TestConstructingABMatrices, TestBatchMatchesUnbatchedCpu) {
+    int n = 10000;
+    int d = 16;
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, d, 128, 3, 2, 50, 0.1, "COSINE");
+    params.ABatchSize = 999; // Doesn't divide n, and is smaller than the batches' m extremes combined
+
+    auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32));
+
+    torch::manual_seed(0);
+    auto [A, B] = GsDBSCAN::projections::constructABMatricesBatch(X, params);
+
+    torch::manual_seed(0);
+    auto projections = GsDBSCAN::projections::projectDataset(X, params.D, params.distanceMetric);
+    auto [expectedA, expectedB] = GsDBSCAN::projections::constructABMatrices(projections, params.k, params.m,
+                                                                             params.distanceMetric);
+
+    ASSERT_TRUE(torch::equal(expectedA, A));
+    ASSERT_TRUE(torch::equal(expectedB, B));
+}
+
+class TestProjectingDataset : public ProjectionsTest {
+
+};
+
+TEST_F(TestProjectingDataset, TestBlockedEmbeddingMatchesUnblocked) {
+    int n = 1000;
+    int d = 8;
+    int F = 100;
+    int D = 32;
+
+    auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat64));
+    auto W = torch::randn({F, d}, torch::TensorOptions().dtype(torch::kFloat64));
+    auto Y = torch::randn({2 * F, D}, torch::TensorOptions().dtype(torch::kFloat64));
+
+    auto WX = torch::matmul(W, X.t());
+    auto XEmbed = torch::concat({torch::cos(WX), torch::sin(WX)}, 0);
+    auto expected = torch::matmul(XEmbed.t(), Y);
+
+    // Tiles that divide neither n nor F
+    auto projections = GsDBSCAN::projections::embedAndProject(X, W, Y, 300, 32);
+
+    ASSERT_TRUE(torch::allclose(expected, projections, 1e-9, 1e-9));
+}
+
+TEST_F(TestProjectingDataset, Test16BitDatasetProjectedInFloat) {
+    int n = 1000;
+    int d = 8;
+    int D = 32;
+    int rowTile = 300;
+
+    for (auto dtype: {torch::kFloat16, torch::kBFloat16}) {
+        auto X = torch::randn({n, d}, torch::TensorOptions().dtype(torch::kFloat32)).to(dtype);
+        auto XFloat = X.to(torch::kFloat32);
+        ASSERT_EQ(torch::kFloat32, GsDBSCAN::projections::projectionDType(X));
+
+        for (std::string distanceMetric: {"L2", "COSINE"}) {
+            torch::manual_seed(0);
+            auto expected = GsDBSCAN::projections::projectDataset(XFloat, D, distanceMetric, 64);
+            torch::manual_seed(0);
+            auto projections = GsDBSCAN::projections::projectDataset(X, D, distanceMetric, 64, 1, std::nullopt, false,
+                                                                     std::nullopt, "gaussian", rowTile);
+
+            ASSERT_EQ(torch::kFloat32, projections.scalar_type());
+            ASSERT_TRUE(torch::allclose(expected, projections, 1e-5, 1e-5)) << distanceMetric;
+        }
+    }
+}
+
+TEST_F(TestProjectingDataset, Test8BitDatasetNormalisedOnTheFly) {
+    int n = 1000;
+    int d = 8;
+    int D = 32;
+    int rowTile = 300;
+
+    // With an all zero row, which must stay zero rather than become NaN
+    auto X = torch::randint(0, 256, {n, d}, torch::TensorOptions().dtype(torch::kUInt8));
+    X[0].zero_();
+    auto XFloat = X.to(torch::kFloat32);
+    auto XNormalised = XFloat / torch::norm(XFloat, 2, 1).clamp_min(1e-12).unsqueeze(1);
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, d, D, 3, 2, 50, 0.1, "COSINE");
+    ASSERT_TRUE(torch::equal(X, GsDBSCAN::projections::normaliseDataset(X, params)));
+
+    std::vector<std::pair<std::string, torch::Tensor>> expectedInputs = {{"L2", XFloat}, {"COSINE", XNormalised}};
+    for (auto &[distanceMetric, XExpected]: expectedInputs) {
+        torch::manual_seed(0);
+        auto expected = GsDBSCAN::projections::projectDataset(XExpected, D, distanceMetric, 64);
+        torch::manual_seed(0);
+        auto projections = GsDBSCAN::projections::projectDataset(X, D, distanceMetric, 64, 1, std::nullopt, false,
+                                                                 std::nullopt, "gaussian", rowTile);
+
+        ASSERT_EQ(torch::kFloat32, projections.scalar_type());
+        ASSERT_FALSE(torch::isnan(projections).any().item<bool>()) << distanceMetric;
+        ASSERT_TRUE(torch::allclose(expected, projections, 1e-4, 1e-4)) << distanceMetric;
+    }
+}
+
+TEST_F(TestProjectingDataset, TestHadamardMatchesDenseTransform) {
+    int P = 16;
+
+    // Sylvester's construction, H_2P = [[H_P, H_P], [H_P, -H_P]]
+    auto H = torch::ones({1, 1}, torch::TensorOptions().dtype(torch::kFloat64));
+    while (H.size(0) < P) {
+        H = torch::cat({torch::cat({H, H}, 1), torch::cat({H, -H}, 1)}, 0);
+    }
+
+    auto x = torch::randn({5, P}, torch::TensorOptions().dtype(torch::kFloat64));
+
+    ASSERT_TRUE(torch::allclose(torch::matmul(x, H), GsDBSCAN::projections::fastWalshHadamard(x)));
+
+    // Two blocks of three rounds, the input is padded from 10 to 16 dimensions and the projections cut at 20
+    int inputDim = 10;
+    int D = 20;
+    auto input = torch::randn({5, inputDim}, torch::TensorOptions().dtype(torch::kFloat64));
+    auto signs = GsDBSCAN::projections::getHadamardSigns(inputDim, D, torch::kCPU);
+
+    ASSERT_EQ(2 * GsDBSCAN::projections::HADAMARD_ROUNDS, signs.size(0));
+    ASSERT_EQ(P, signs.size(1));
+
+    auto padded = torch::cat({input, torch::zeros({5, P - inputDim}, input.options())}, 1);
+    std::vector<torch::Tensor> blocks;
+    for (int b = 0; b < 2; b++) {
+        auto z = padded;
+        for (int r = 0; r < GsDBSCAN::projections::HADAMARD_ROUNDS; r++) {
+            auto blockSigns = signs[b * GsDBSCAN::projections::HADAMARD_ROUNDS + r].to(torch::kFloat64);
+            z = torch::matmul(z * blockSigns, H);
+        }
+        blocks.push_back(z);
+    }
+    auto expected = torch::cat(blocks, 1).slice(1, 0, D) / P;
+
+    ASSERT_TRUE(torch::allclose(expected, GsDBSCAN::projections::hadamardProject(input, signs, D)));
+}
+
+class TestReorderingDataset : public ProjectionsTest {
+};
+
+TEST_F(TestReorderingDataset, TestLocalityOrderIsPermutation) {
+    int n = 10000;
+
+    for (int numProjections: {1, GsDBSCAN::projections::MORTON_PROJECTIONS}) {
+        auto projections = torch::randn({n, numProjections}, torch::TensorOptions().dtype(torch::kFloat32));
+        const float *projections_h = projections.data_ptr<float>();
+
+        auto permutation = GsDBSCAN::projections::localityOrderFromProjections(projections_h, n, numProjections);
+
+        auto sortedPermutation = permutation;
+        std::sort(sortedPermutation.begin(), sortedPermutation.end());
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(i, sortedPermutation[i]);
+        }
+
+        // A single projection is just sorted (up to its quantisation)
+        if (numProjections == 1) {
+            for (int i = 1; i < n; i++) {
+                ASSERT_LE(projections_h[permutation[i - 1]], projections_h[permutation[i]] + 1e-5);
+            }
+        }
+
+        // Labels of the reordered points map back to the original order
+        std::vector<int> labels(n);
+        for (int i = 0; i < n; i++) labels[i] = (int) permutation[i];
+        GsDBSCAN::algo_utils::inversePermute(labels.data(), permutation);
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(i, labels[i]);
+        }
+    }
+}
+
+TEST_F(TestReorderingDataset, TestVarianceOrderWithLargeMeans) {
+    int n = 100000;
+
+    // Standard deviations 1e-3, 1e-2 and 1e-1, behind means large enough for E[x^2] - E[x]^2 to cancel in float
+    auto stds = torch::tensor({1e-3, 1e-2, 1e-1}, torch::TensorOptions().dtype(torch::kFloat64));
+    auto X = (1000 + torch::randn({n, 3}, torch::TensorOptions().dtype(torch::kFloat64)) * stds).to(torch::kFloat32);
+
+    auto order = GsDBSCAN::projections::getVarianceOrder(X);
+
+    ASSERT_EQ(2, order[0].item<int64_t>());
+    ASSERT_EQ(1, order[1].item<int64_t>());
+    ASSERT_EQ(0, order[2].item<int64_t>());
+}
@@ -8,6 +8,7 @@
 #include <gtest/gtest.h>
 
 #include <iostream>
+#include <random>
 
 namespace tu = testUtils;
 
@@ -38,6 +39,7 @@ class TestMainHelper : public RunUtilsTest {
 
 };
 
+#ifndef GS_DBSCAN_CPU_ONLY
 TEST_F(TestMainHelper, TestNormally) {
     GsDBSCAN::GsDBSCAN_Params params = GsDBSCAN::GsDBSCAN_Params(
             "/home/hphi344/Documents/GS-DBSCAN-Analysis/data/mnist/mnist_images_row_major.bin",
@@ -59,7 +61,7 @@ TEST_F(TestMainHelper, TestNormally) {
 
     std::cout << params.toString() << std::endl;
 
-    auto [clusterLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
+    auto [clusterLabels, typeLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
 
     std::cout << "Number of clusters: " << numClusters << std::endl;
 
@@ -87,7 +89,7 @@ TEST_F(TestMainHelper, TestNormallyF16) {
 
     std::cout << params.toString() << std::endl;
 
-    auto [clusterLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
+    auto [clusterLabels, typeLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
 
     std::cout << "Number of clusters: " << numClusters << std::endl;
 
@@ -115,7 +117,7 @@ TEST_F(TestMainHelper, TestMnist8m1MF16) {
 
     std::cout << params.toString() << std::endl;
 
-    auto [clusterLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
+    auto [clusterLabels, typeLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
 
     std::cout << "Number of clusters: " << numClusters << std::endl;
 
@@ -148,10 +150,11 @@ TEST_F(TestMainHelper, TestPortoF32) {
 
     std::cout << params.toString() << std::endl;
 
-    auto [clusterLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
+    auto [clusterLabels, typeLabels, numClusters, times] = GsDBSCAN::run_utils::main_helper(params);
 
     std::cout << "Number of clusters: " << numClusters << std::endl;
 }
+#endif
 
 class TestReadMnist : public RunUtilsTest {
 
@@ -167,3 +170,133 @@ TEST_F(TestReadMnist, TestBinNormally) {
     tu::printDurationSinceStart(start, "Reading MNIST via binary");
 }
 
+TEST_F(TestReadMnist, TestBinMmap) {
+    auto start = tu::timeNow();
+
+    GsDBSCAN::run_utils::MappedBinFile<float> X(
+            "/home/hphi344/Documents/Thesis/python/data/mnist/mnist_images_col_major.bin");
+
+    tu::printDurationSinceStart(start, "Reading MNIST via mmap");
+
+    auto vec = GsDBSCAN::run_utils::loadBinFileToVector<float>(
+            "/home/hphi344/Documents/Thesis/python/data/mnist/mnist_images_col_major.bin");
+
+    ASSERT_EQ(vec.size(), X.size());
+
+    for (size_t i = 0; i < vec.size(); i++) {
+        ASSERT_EQ(vec[i], X.data()[i]);
+    }
+}
+
+class TestWritingResults : public RunUtilsTest {
+
+};
+
+TEST_F(TestWritingResults, TestNpyLabels) {
+    int labels[5] = {0, 0, -1, 1, 1};
+
+    GsDBSCAN::run_utils::writeNpyInt32("test_labels.npy", labels, 5);
+
+    auto fileBytes = GsDBSCAN::run_utils::loadBinFileToVector<char>("test_labels.npy");
+
+    ASSERT_EQ(std::string("\x93NUMPY"), std::string(fileBytes.data(), 6));
+
+    // The header is padded so the data starts at a multiple of 64 bytes
+    size_t dataStart = 10 + ((unsigned char) fileBytes[8] | ((unsigned char) fileBytes[9] << 8));
+
+    ASSERT_EQ(0, dataStart % 64);
+    ASSERT_EQ('\n', fileBytes[dataStart - 1]);
+    ASSERT_EQ(dataStart + 5 * sizeof(int), fileBytes.size());
+
+    auto data = reinterpret_cast<int *>(fileBytes.data() + dataStart);
+
+    for (int i = 0; i < 5; i++) {
+        ASSERT_EQ(labels[i], data[i]);
+    }
+
+    std::remove("test_labels.npy");
+}
+
+TEST_F(TestWritingResults, TestSweepResults) {
+    int n = 4;
+
+    GsDBSCAN::GsDBSCAN_Params params("", "test_sweep.json", n, 2, 4, 2, 1, 1, 0.5, "L2");
+
+    std::vector<GsDBSCAN::SweepResult> results = {
+            {0.5, 2, new int[4]{0, 0, 1, 1}, new int[4]{1, 1, 1, 1}, 2, {{"overall", 10}}},
+            {0.1, 3, new int[4]{-1, -1, -1, -1}, new int[4]{-1, -1, -1, -1}, 0, {{"overall", 5}}}
+    };
+
+    nlohmann::ordered_json sharedTimes = {{"distances", 100}};
+
+    GsDBSCAN::run_utils::writeSweepResults(params, sharedTimes, results);
+
+    std::ifstream file("test_sweep.json");
+    auto output = nlohmann::json::parse(file);
+
+    ASSERT_EQ(2, output.size());
+
+    ASSERT_FLOAT_EQ(0.5, output[0]["eps"].get<float>());
+    ASSERT_EQ(2, output[0]["minPts"]);
+    ASSERT_EQ(2, output[0]["numClusters"]);
+    ASSERT_EQ(std::vector<int>({0, 0, 1, 1}), output[0]["clusterLabels"].get<std::vector<int>>());
+    ASSERT_EQ(100, output[0]["sharedTimes"]["distances"]);
+    ASSERT_EQ(10, output[0]["times"]["overall"]);
+
+    ASSERT_EQ(3, output[1]["minPts"]);
+    ASSERT_EQ(0, output[1]["numClusters"]);
+    ASSERT_EQ(5, output[1]["times"]["overall"]);
+
+    ASSERT_EQ(nullptr, results[0].clusterLabels);
+
+    std::remove("test_sweep.json");
+}
+
+class TestSweep : public RunUtilsTest {
+};
+
+TEST_F(TestSweep, TestMatchesSingleRunsCpu) {
+    int n = 2000;
+    int d = 8;
+
+    std::mt19937 gen(0);
+    std::normal_distribution<float> normal(0, 0.05);
+    std::vector<float> X((size_t) n * d);
+    for (size_t i = 0; i < X.size(); i++) {
+        X[i] = (i / d) % 4 + normal(gen); // 4 blobs
+    }
+
+    GsDBSCAN::GsDBSCAN_Params params("", "", n, d, 64, 5, 2, 20, 0.1, "L2");
+    params.device = "cpu";
+    params.sweepConfigs = {{0.1, 5}, {0.3, 10}};
+
+    // The sweep and the single runs must use the same random projections
+    torch::manual_seed(42);
+    auto [results, sharedTimes] = GsDBSCAN::performGsDbscanSweep<float, torch::kFloat32>(X.data(), params);
+
+    ASSERT_EQ(2, results.size());
+
+    for (auto &result: results) {
+        GsDBSCAN::GsDBSCAN_Params configParams = params;
+        configParams.setEps(result.eps);
+        configParams.minPts = result.minPts;
+
+        // Normalisation is in place, so each run gets its own copy
+        std::vector<float> XCopy = X;
+        torch::manual_seed(42);
+        auto [clusterLabels, typeLabels, numClusters, times] = GsDBSCAN::performGsDbscan<float, torch::kFloat32>(
+                XCopy.data(), configParams);
+
+        ASSERT_EQ(numClusters, result.numClusters);
+
+        for (int i = 0; i < n; i++) {
+            ASSERT_EQ(clusterLabels[i], result.clusterLabels[i]);
+            ASSERT_EQ(typeLabels[i], result.typeLabels[i]);
+        }
+
+        delete[] clusterLabels;
+        delete[] typeLabels;
+        delete[] result.clusterLabels;
+        delete[] result.typeLabels;
+    }
+}
@@ -0,0 +1,101 @@
+//
+// Tests for the trace spans and their Chrome trace export
+//
+
+#include "../include/pch.h"
+#include <gtest/gtest.h>
+#include <set>
+#include "../include/gsDBSCAN/tracing.h"
+
+namespace tr = GsDBSCAN::tracing;
+
+class TracingTest : public ::testing::Test {
+protected:
+    void SetUp() override {
+        tr::Tracer::instance().clear();
+        tr::Tracer::instance().setEnabled(true);
+    }
+
+    void TearDown() override {
+        tr::Tracer::instance().setEnabled(false);
+        tr::Tracer::instance().clear();
+    }
+};
+
+class TestScopedSpans : public TracingTest {
+};
+
+TEST_F(TestScopedSpans, TestNestedSpans) {
+    {
+        tr::ScopedSpan outer("outer", {{"n", 10}});
+        {
+            tr::ScopedSpan inner("inner");
+        }
+        tr::ScopedSpan ended("ended");
+        ended.end();
+    }
+
+    auto events = tr::Tracer::instance().events();
+
+    ASSERT_EQ(3, events.size());
+
+    // Sorted by start time
+    ASSERT_EQ("outer", events[0].name);
+    ASSERT_EQ("inner", events[1].name);
+    ASSERT_EQ("ended", events[2].name);
+
+    for (int i = 1; i < 3; i++) {
+        ASSERT_EQ(events[0].threadId, events[i].threadId);
+        ASSERT_GE(events[i].startNs, events[0].startNs);
+        ASSERT_LE(events[i].startNs + events[i].durationNs, events[0].startNs + events[0].durationNs);
+    }
+
+    ASSERT_EQ(1, events[0].args.size());
+    ASSERT_EQ("n", events[0].args[0].first);
+    ASSERT_EQ(10, events[0].args[0].second);
+}
+
+TEST_F(TestScopedSpans, TestDisabled) {
+    tr::Tracer::instance().setEnabled(false);
+    {
+        tr::ScopedSpan span("notRecorded");
+    }
+    ASSERT_TRUE(tr::Tracer::instance().events().empty());
+}
+
+TEST_F(TestScopedSpans, TestThreads) {
+    int numThreads = 4;
+
+    #pragma omp parallel num_threads(numThreads)
+    {
+        tr::ScopedSpan span("thread", {{"threadIdx", omp_get_thread_num()}});
+    }
+
+    auto events = tr::Tracer::instance().events();
+
+    ASSERT_EQ(numThreads, events.size());
+
+    std::set<int> threadIds;
+    for (const auto &event: events) threadIds.insert(event.threadId);
+
+    ASSERT_EQ(numThreads, threadIds.size());
+}
+
+TEST_F(TestScopedSpans, TestChromeTrace) {
+    {
+        tr::ScopedSpan span("stage", {{"startIdx", 5}});
+    }
+
+    auto trace = tr::Tracer::instance().toChromeTrace();
+
+    ASSERT_TRUE(trace.contains("traceEvents"));
+
+    nlohmann::ordered_json stageEvent;
+    for (const auto &event: trace["traceEvents"]) {
+        if (event["ph"] == "X") stageEvent = event;
+    }
+
+    ASSERT_EQ("stage", stageEvent["name"]);
+    ASSERT_EQ(5, stageEvent["args"]["startIdx"]);
+    ASSERT_GE(stageEvent["dur"].get<double>(), 0);
+}